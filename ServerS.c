@@ -9,7 +9,20 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <time.h>
-#include <sys/file.h>  // Pour flock()
+
+#include "tftp_prof.h"
+#include "tftp_shaper.h"
+#include "tftp_sched.h"
+#include "tftp_netascii.h"
+#include "tftp_crc32c.h"
+#include "tftp_xdp.h"
+#include "tftp_upload.h"
+#include "tftp_trace.h"
+#include "tftp_codec.h"
+#include "tftp_sockbuf.h"
+#include "tftp_resume.h"
+#include "tftp_fsm.h"
+#include "tftp_image.h"
 
 #define TFTP_PORT 6969
 #define PACKET_SIZE 516    // 2 octets opcode, 2 octets numéro de bloc, 512 octets de données
@@ -23,10 +36,12 @@
 #define OP_ERROR 5
 
 // Code d'erreur
+#define ERR_UNDEFINED 0
 #define ERR_FILE_NOT_FOUND 1
+#define ERR_ILLEGAL_OP 4
 
-// Délai d'inactivité pour fermer une session (en secondes)
-#define SESSION_TIMEOUT 2
+// Durée maximale d'attente d'une requête dans la file d'admission (en secondes)
+#define QUEUE_TIMEOUT 5
 
 // Structure pour une session de transfert
 typedef struct session {
@@ -34,19 +49,58 @@ typedef struct session {
     struct sockaddr_in client_addr;
     socklen_t addr_len;
     int opcode;                    // OP_RRQ ou OP_WRQ
-    FILE *fp;                      // Fichier ouvert pour lecture (RRQ) ou écriture (WRQ)
-    int block;                     // Numéro de bloc actuel
-    int finished;                  // Indique si la session est terminée
-    time_t last_activity;          // "Timestamp" de la dernière activité sur cette session
+    fsm_t fsm;                     // Protocole (tftp_fsm.h) : blocs, retransmissions, fin de session
+    double send_at;                // Date (shaper_now) de la prochaine tentative d'envoi (fsm.pending)
+    int cls;                       // Classe de priorité (ordonnancement)
+    double size;                   // Taille du fichier (RRQ), 0 si inconnue
+    double last_served;            // Date (shaper_now) du dernier envoi
+    int netascii;                  // Mode netascii (sinon octet)
+    netascii_t na;                 // État de conversion netascii
+    image_reader_t src;            // Fichier ou image compressée lu avec CRC32C au fil de l'eau (RRQ)
+    long long offset;              // Reprise (option offset) : position du bloc 1 dans le fichier (RRQ)
+    uint32_t crc;                  // CRC32C des données écrites (WRQ)
+    upload_t up;                   // Fichier anonyme remplaçant l'ancien au dernier bloc (WRQ)
+    uint16_t xdp_port;             // TID servi par AF_XDP (sock vaut alors -1), 0 sinon
+    unsigned char mac[ETH_ALEN];   // Adresse MAC du client (AF_XDP)
+    sockbuf_t sb;                  // Tampons et pertes de la socket dédiée
     struct session *next;
 } session_t;
 
 session_t *session_list = NULL;
+int session_count = 0;
+
+// Requête mise en attente faute de place (admission)
+typedef struct queued_request {
+    unsigned char buffer[PACKET_SIZE];
+    int n;
+    struct sockaddr_in client;
+    socklen_t client_len;
+    time_t arrival;
+    int cls;                       // Classe et taille pour choisir la prochaine requête admise
+    double size;
+    struct queued_request *next;
+} queued_request_t;
+
+queued_request_t *queue_head = NULL, *queue_tail = NULL;
+int queue_len = 0;
+
+// Paramètres d'admission (0 = illimité / pas de file)
+int max_sessions = 0;
+int queue_max = 0;
+
+shaper_t shaper;
+
+// Socket du port bien connu : pertes noyau comptées, tampon agrandi au besoin (option -B)
+sockbuf_t listen_buf;
+
+// Chemin de données AF_XDP pour les RRQ (option -X), désactivé si xdp.fd < 0
+xdp_engine_t xdp = XDP_ENGINE_INITIALIZER;
 
 // Ajouter une session à la "liste"
 void add_session(session_t *sess) {
     sess->next = session_list;
     session_list = sess;
+    session_count++;
 }
 
 
@@ -56,6 +110,7 @@ void remove_session(session_t *sess) {
     while (*p) {
         if (*p == sess) {
             *p = sess->next;
+            session_count--;
             return;
         }
         p = &(*p)->next;
@@ -65,30 +120,109 @@ void remove_session(session_t *sess) {
 // Envoyer code d'erreur
 void send_error(int sock, struct sockaddr_in *client, socklen_t addr_len, int err_code, const char *msg) {
     unsigned char buffer[PACKET_SIZE];
-    int len = 0;
-    buffer[len++] = 0;
-    buffer[len++] = OP_ERROR;
-    buffer[len++] = 0;
-    buffer[len++] = err_code;
-    strcpy((char*)(buffer + len), msg);
-    len += strlen(msg) + 1;
+    size_t len = tftp_put_error(buffer, sizeof(buffer), err_code, msg);
     sendto(sock, buffer, len, 0, (struct sockaddr *)client, addr_len);
 }
 
-// Fonction qui gère la réception d'une nouvelle requête sur le socket principal
-void handle_new_request(int main_sock) {
-    unsigned char buffer[PACKET_SIZE];
-    struct sockaddr_in client;
-    socklen_t client_len = sizeof(client);
-    int n = recvfrom(main_sock, buffer, PACKET_SIZE, 0, (struct sockaddr *)&client, &client_len);
-    if (n < 4)
+// Lecture du fichier (RRQ), appelée par la machine à états pour chaque nouveau bloc
+size_t session_read(void *ctx, unsigned char *buf, size_t len) {
+    session_t *sess = ctx;
+    PROF_BEGIN(t_read);
+    size_t bytes = sess->netascii ? netascii_read_block(&sess->na, image_fread, &sess->src, buf, len)
+                                  : image_fread(&sess->src, buf, len);
+    PROF_END(PROF_READ, t_read);
+    return bytes;
+}
+
+// Écriture des données reçues (WRQ) ; au dernier bloc, le fichier remplace l'ancien et son CRC est mémorisé avec lui
+int session_write(void *ctx, const unsigned char *data, size_t len, int last) {
+    session_t *sess = ctx;
+    int ret = 0;
+    PROF_BEGIN(t_write);
+    if (sess->netascii) {
+        unsigned char text[PACKET_SIZE + 1];
+        size_t n = netascii_decode(&sess->na, data, len, text);
+        if (last)
+            n += netascii_decode_finish(&sess->na, text + n);
+        if (upload_write(&sess->up, text, n) < 0)
+            ret = -1;
+        sess->crc = crc32c(sess->crc, text, n);
+    } else {
+        if (upload_write(&sess->up, data, len) < 0)
+            ret = -1;
+        sess->crc = crc32c(sess->crc, data, len);
+    }
+    PROF_END(PROF_WRITE, t_write);
+    if (ret < 0) {      // Disque plein, préfixe non recopié... : ERROR au client, rien n'est mis en place
+        perror("Session WRQ: écriture du fichier reçu");
+        return -1;
+    }
+    if (!last)
+        return 0;
+    if (upload_commit(&sess->up) < 0) {
+        perror("Session WRQ: mise en place du fichier");
+        return -1;
+    }
+    printf("Session WRQ: fichier reçu, crc32c=%08x (%s)%s\n", sess->crc,
+           digest_store(sess->up.fd, sess->crc) == 0 ? "mémorisé" : "non mémorisé",
+           sess->up.unchanged ? ", contenu inchangé" : "");
+    return 0;
+}
+
+// Envoi d'un paquet de la session (socket dédiée ou AF_XDP) ; -1 si plus de trame libre dans l'UMEM
+int session_send(void *ctx, const unsigned char *pkt, size_t len) {
+    session_t *sess = ctx;
+    int ret = 0;
+    PROF_BEGIN(t_send);
+    if (sess->xdp_port)
+        ret = xdp_send(&xdp, sess->mac, &sess->client_addr, sess->xdp_port, pkt, len) < 0 ? -1 : 0;
+    else
+        sendto(sess->sock, pkt, len, 0, (struct sockaddr *)&sess->client_addr, sess->addr_len);
+    PROF_END(PROF_SEND, t_send);
+    return ret;
+}
+
+static const fsm_ops_t session_ops = { session_read, session_write, session_send, NULL };
+
+// Envoie le bloc prêt si la limitation de débit le permet, sinon note quand réessayer
+void rrq_flush(session_t *sess) {
+    if (image_failed(&sess->src)) {     // Image compressée invalide : erreur plutôt qu'un dernier bloc tronqué
+        fsm_abort(&sess->fsm, ERR_UNDEFINED, "Image compressée invalide");
         return;
-    
-    // On récupère l'opcode (le 2ème octet, le premier étant 0)
-    int opcode = buffer[1];
-    printf("Nouvelle requête %s reçue de %s:%d\n",
-           (opcode == OP_RRQ) ? "RRQ" : (opcode == OP_WRQ ? "WRQ" : "INCONNU"),
-           inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+    }
+    double delay = shaper_reserve(&shaper, sess->client_addr.sin_addr, sess->fsm.out_len);
+    if (delay > 0) {
+        sess->send_at = shaper_now() + delay;
+        return;
+    }
+    // Plus de trame libre dans l'UMEM : on réessaie dès que possible
+    if (fsm_flush(&sess->fsm, shaper_now()) < 0) {
+        sess->send_at = shaper_now() + 0.001;
+        return;
+    }
+    printf("Session RRQ: Envoyé bloc %d (%ld octets)\n", sess->fsm.block, (long)sess->fsm.out_len - 4);
+    sess->last_served = shaper_now();
+}
+
+// Fin de session (dernier ACK reçu, timeout ou erreur du client)
+void session_end(session_t *sess) {
+    if (sess->fsm.state == FSM_FAILED)
+        printf("Session %s abandonnée pour %s:%d (bloc %d, %lu retransmissions)\n",
+               sess->opcode == OP_RRQ ? "RRQ" : "WRQ", inet_ntoa(sess->client_addr.sin_addr),
+               ntohs(sess->client_addr.sin_port), sess->fsm.block, sess->fsm.retransmits);
+    else if (sess->opcode == OP_RRQ && sess->offset)     // Le CRC ne couvre que la fin du fichier
+        printf("Session RRQ: fichier envoyé à partir de l'octet %lld\n", sess->offset);
+    else if (sess->opcode == OP_RRQ)
+        printf("Session RRQ: fichier envoyé, crc32c=%08x (%s)\n", sess->src.rd.crc, image_verify(&sess->src));
+}
+
+// Démarre une session pour une requête RRQ/WRQ admise
+void start_session(int main_sock, unsigned char *buffer, int n, struct sockaddr_in client, socklen_t client_len) {
+    tftp_packet_t req;
+    PROF_BEGIN(t_parse);
+    int opcode = tftp_parse(buffer, n, &req);   // Déjà validée par handle_new_request
+    PROF_END(PROF_PARSE, t_parse);
+    const char *filename = req.filename, *mode = req.mode;
     
     // Création d'une socket dédiée pour la session (port temporaire)
     int newsock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -109,139 +243,300 @@ void handle_new_request(int main_sock) {
     sess->client_addr = client;
     sess->addr_len = client_len;
     sess->opcode = opcode;
-    sess->block = (opcode == OP_RRQ) ? 1 : 0;  // Pour RRQ, début à 1 ; pour WRQ, on enverra ACK 0
-    sess->finished = 0;
-    sess->fp = NULL;
+    sess->size = 0;
+    sess->last_served = shaper_now();
+    memset(&sess->src, 0, sizeof(sess->src));
+    sess->offset = 0;
+    sess->xdp_port = 0;
     sess->next = NULL;
-    sess->last_activity = time(NULL);
+    sockbuf_init_peer(&sess->sb, newsock, &client, SOCKBUF_SESSION);
+    fsm_ops_t ops = session_ops;
+    ops.ctx = sess;
     
-    // Extraction du nom de fichier et du mode (à partir de l'offset 2)
-    char filename[256], mode[12];
-    int idx = 2, j = 0;
-    while (idx < n && buffer[idx] != 0 && j < 255) {
-        filename[j++] = buffer[idx++];
-    }
-    filename[j] = '\0';
-    idx++; // Passer le 0
-    j = 0;
-    while (idx < n && buffer[idx] != 0 && j < 11) {
-        mode[j++] = buffer[idx++];
-    }
-    mode[j] = '\0';
-    printf("Session: fichier '%s', mode '%s'\n", filename, mode);
+    sess->cls = sched_classify(filename, client.sin_addr);
+    sess->netascii = netascii_mode(mode);
+    netascii_init(&sess->na);
+    printf("Session: fichier '%s', mode '%s', classe %d\n", filename, mode, sess->cls);
     
     if (opcode == OP_RRQ) {
-        // Pour RRQ : ouvrir le fichier pour lecture
+        // Pour RRQ : ouvrir le fichier (ou à défaut son image compressée) pour lecture
         char path[300];
+        long long size;
         snprintf(path, sizeof(path), "Server/%s", filename);
-        sess->fp = fopen(path, "rb");
-        if (!sess->fp) {
+        if (image_open(&sess->src, path, &size) < 0) {
             printf("Fichier '%s' non trouvé.\n", path);
             send_error(main_sock, &client, client_len, ERR_FILE_NOT_FOUND, "File not found");
             close(newsock);
             free(sess);
             return;
         }
-        // Envoyer immédiatement le premier bloc
-        unsigned char data[PACKET_SIZE];
-        size_t bytes = fread(data + 4, 1, DATA_SIZE, sess->fp);
-        data[0] = 0;
-        data[1] = OP_DATA;
-        data[2] = (sess->block >> 8) & 0xFF;
-        data[3] = sess->block & 0xFF;
-        sendto(newsock, data, bytes + 4, 0, (struct sockaddr *)&client, client_len);
-        printf("Session RRQ: Envoyé bloc %d (%ld octets)\n", sess->block, bytes);
-        sess->block++;
-        if (bytes < DATA_SIZE)
-            sess->finished = 1;
+        sess->size = size > 0 ? size : 0;
+        if (sess->src.img)
+            printf("Session RRQ: image compressée '%s' (%lld octets)\n", sess->src.img->path, size);
+        // Client joignable par AF_XDP : la socket dédiée n'est pas utilisée
+        if ((sess->xdp_port = xdp_port_open(&xdp, client.sin_addr, sess->mac)) != 0) {
+            close(newsock);
+            sess->sock = -1;
+            printf("Session RRQ servie par AF_XDP (port %d)\n", sess->xdp_port);
+        }
+        // Reprise et taille : OACK d'abord, le bloc 1 (lu à partir de offset) partira à réception de l'ACK 0
+        unsigned char oack[64];
+        sess->offset = resume_offset(&req, size, sess->netascii);
+        if (sess->offset && image_seek(&sess->src, sess->offset) == 0)
+            printf("Session RRQ: reprise à l'octet %lld\n", sess->offset);
+        else
+            sess->offset = 0;
+        size_t oack_len = image_oack(oack, sizeof(oack), &req, size, sess->offset, sess->netascii);
+        // Envoyer immédiatement le premier paquet (ou dès que le débit le permet)
+        fsm_start_rrq(&sess->fsm, &ops, oack, oack_len);
+        rrq_flush(sess);
     }
     else if (opcode == OP_WRQ) {
-        // Pour WRQ : ouvrir le fichier pour écriture avec verrouillage
+        // Pour WRQ : écrire dans un fichier anonyme, l'ancienne version reste lisible jusqu'au dernier bloc
         char path[300];
         snprintf(path, sizeof(path), "Server/%s", filename);
-        // Ouvrir le fichier en mode écriture (création/troncature)
-        int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0666);
+        const char *tsize = tftp_option(&req, "tsize");
+        int fd = upload_open(&sess->up, path, tsize ? atoll(tsize) : -1);
         if (fd < 0) {
             send_error(main_sock, &client, client_len, 2, "L'ouverture du fichier pour l'écriture a échouée");
             close(newsock);
             free(sess);
             return;
         }
-        // Essayer d'obtenir un verrou exclusif non bloquant
-        if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
-            send_error(main_sock, &client, client_len, 3, "flock a échoué");
-            close(fd);
-            close(newsock);
-            free(sess);
+        sess->crc = 0;
+        fsm_start_wrq(&sess->fsm, &ops);
+        fsm_flush(&sess->fsm, shaper_now());
+    }
+    
+    add_session(sess);
+}
+
+// Classe et taille (RRQ) d'une requête mise en file d'attente
+void request_class(queued_request_t *q, unsigned char *buffer, int n, struct in_addr ip) {
+    char path[300];
+    tftp_packet_t req;
+    int opcode = tftp_parse(buffer, n, &req);
+    q->cls = sched_classify(req.filename, ip);
+    q->size = 0;
+    snprintf(path, sizeof(path), "Server/%s", req.filename);
+    if (opcode == OP_RRQ && (q->size = image_size(path)) < 0)
+        q->size = 0;
+}
+
+// Fonction qui gère la réception d'une nouvelle requête sur le socket principal
+void handle_new_request(int main_sock) {
+    unsigned char buffer[PACKET_SIZE];
+    struct sockaddr_in client;
+    socklen_t client_len = sizeof(client);
+    PROF_BEGIN(t_recv);
+    int n = sockbuf_recvfrom(&listen_buf, buffer, PACKET_SIZE, 0, (struct sockaddr *)&client, &client_len);
+    PROF_END(PROF_RECV, t_recv);
+    if (n < 4)
+        return;
+    trace_record(&client, buffer, n);
+    
+    // Seules les requêtes bien formées ouvrent une session
+    tftp_packet_t req;
+    int opcode = tftp_parse(buffer, n, &req);
+    printf("Nouvelle requête %s reçue de %s:%d\n",
+           (opcode == OP_RRQ) ? "RRQ" : (opcode == OP_WRQ ? "WRQ" : "INCONNU"),
+           inet_ntoa(client.sin_addr), ntohs(client.sin_port));
+    if (opcode != OP_RRQ && opcode != OP_WRQ) {
+        send_error(main_sock, &client, client_len, ERR_ILLEGAL_OP, "Illegal TFTP operation");
+        return;
+    }
+    
+    // Admission : trop de sessions actives -> file d'attente ou refus
+    if (max_sessions > 0 && session_count >= max_sessions) {
+        // Une retransmission de la même requête ne doit pas occuper deux places
+        for (queued_request_t *q = queue_head; q; q = q->next)
+            if (q->client.sin_addr.s_addr == client.sin_addr.s_addr && q->client.sin_port == client.sin_port)
+                return;
+        if (queue_len >= queue_max) {
+            printf("Serveur saturé (%d sessions), requête refusée.\n", session_count);
+            send_error(main_sock, &client, client_len, ERR_UNDEFINED, "Server busy, retry later");
             return;
         }
-        // Convertir le descripteur en FILE*
-        sess->fp = fdopen(fd, "wb");
-        if (!sess->fp) {
-            send_error(main_sock, &client, client_len, 4, "fdopen pour l'écriture a échoué");
-            close(fd);
-            close(newsock);
-            free(sess);
+        queued_request_t *q = malloc(sizeof(queued_request_t));
+        if (!q)
             return;
+        memcpy(q->buffer, buffer, n);
+        q->n = n;
+        request_class(q, buffer, n, client.sin_addr);
+        q->client = client;
+        q->client_len = client_len;
+        q->arrival = time(NULL);
+        q->next = NULL;
+        if (queue_tail)
+            queue_tail->next = q;
+        else
+            queue_head = q;
+        queue_tail = q;
+        queue_len++;
+        printf("Serveur saturé, requête mise en file d'attente (%d en attente).\n", queue_len);
+        return;
+    }
+    start_session(main_sock, buffer, n, client, client_len);
+}
+
+// Démarre les requêtes en attente tant qu'il y a de la place, la meilleure (score) d'abord
+void admit_queued(int main_sock) {
+    time_t now = time(NULL);
+    
+    // Purger les requêtes trop anciennes : le client a probablement abandonné, on le prévient quand même
+    queued_request_t **p = &queue_head;
+    queue_tail = NULL;
+    while (*p) {
+        queued_request_t *q = *p;
+        if (now - q->arrival > QUEUE_TIMEOUT) {
+            send_error(main_sock, &q->client, q->client_len, ERR_UNDEFINED, "Server busy, retry later");
+            *p = q->next;
+            queue_len--;
+            free(q);
+        } else {
+            queue_tail = q;
+            p = &q->next;
         }
-        unsigned char ack[4] = {0, OP_ACK, 0, 0};
-        sendto(newsock, ack, 4, 0, (struct sockaddr *)&client, client_len);
     }
     
-    add_session(sess);
+    while (queue_head && (max_sessions <= 0 || session_count < max_sessions)) {
+        queued_request_t **best = &queue_head;
+        for (p = &queue_head; *p; p = &(*p)->next)
+            if (sched_score((*p)->cls, (*p)->size, now - (*p)->arrival) <
+                sched_score((*best)->cls, (*best)->size, now - (*best)->arrival))
+                best = p;
+        queued_request_t *q = *best;
+        *best = q->next;
+        if (queue_tail == q) {
+            queue_tail = NULL;
+            for (queued_request_t *t = queue_head; t; t = t->next)
+                queue_tail = t;
+        }
+        queue_len--;
+        start_session(main_sock, q->buffer, q->n, q->client, q->client_len);
+        free(q);
+    }
+}
+
+// Score d'ordonnancement d'une session (plus petit = servie en premier)
+double session_score(session_t *sess, double now) {
+    double remaining = 0, sent = sess->offset + (double)sess->fsm.bytes;
+    if (sess->opcode == OP_RRQ && sess->size > sent)
+        remaining = sess->size - sent;
+    return sched_score(sess->cls, remaining, now - sess->last_served);
+}
+
+int compare_scores(const void *a, const void *b) {
+    double sa = ((const double *)a)[0], sb = ((const double *)b)[0];
+    return (sa > sb) - (sa < sb);
+}
+
+// Traitement d'un paquet reçu par une session (socket dédiée ou AF_XDP)
+void session_input(session_t *sess, const unsigned char *buffer, int n) {
+    double now = shaper_now();
+    if (!fsm_input(&sess->fsm, buffer, n, now) || fsm_over(&sess->fsm))
+        return;
+    if (sess->opcode == OP_RRQ) {
+        // ACK du bloc en vol : le suivant est lu, il part dès que le débit le permet
+        rrq_flush(sess);
+    } else {
+        sess->last_served = now;
+        printf("Session WRQ: Reçu bloc %d, ACK envoyé\n", sess->fsm.block);
+    }
 }
 
 // Fonction de traitement d'une session active
 void process_session(session_t *sess) {
     unsigned char buffer[PACKET_SIZE];
-    int n = recvfrom(sess->sock, buffer, PACKET_SIZE, 0, NULL, NULL);
+    PROF_BEGIN(t_recv);
+    struct sockaddr_in from;
+    socklen_t from_len = sizeof(from);
+    int n = sockbuf_recvfrom(&sess->sb, buffer, PACKET_SIZE, 0, (struct sockaddr *)&from, &from_len);
+    PROF_END(PROF_RECV, t_recv);
     if (n < 0)
         return;
-    
-    // Mettre à jour le timestamp d'activité
-    sess->last_activity = time(NULL);
-    
-    if (sess->opcode == OP_RRQ) {
-        // Pour RRQ, attendre un ACK du client pour le bloc précédent, puis envoyer le bloc suivant.
-        if (n < 4)
+    trace_record(&from, buffer, n);
+    session_input(sess, buffer, n);
+}
+
+// Paquet reçu par AF_XDP (lu en place dans l'UMEM) : remis à la session qui a ce port
+void xdp_input(void *ctx, const struct sockaddr_in *from, uint16_t port, const unsigned char *payload, int len) {
+    (void)ctx;
+    for (session_t *sess = session_list; sess; sess = sess->next) {
+        if (sess->xdp_port == port && sess->client_addr.sin_addr.s_addr == from->sin_addr.s_addr &&
+            sess->client_addr.sin_port == from->sin_port) {
+            trace_record(from, payload, len);
+            session_input(sess, payload, len);
             return;
-        int ack_opcode = buffer[1];
-        int ack_block = (((unsigned char)buffer[2]) << 8) | ((unsigned char)buffer[3]);
-        // On attend un ACK pour le bloc précédent (bloc envoyé en dernier, c'est-à-dire bloc = courant - 1)
-        if (ack_opcode == OP_ACK && ack_block == sess->block - 1) {
-            unsigned char data[PACKET_SIZE];
-            size_t bytes = fread(data + 4, 1, DATA_SIZE, sess->fp);
-            data[0] = 0;
-            data[1] = OP_DATA;
-            data[2] = (sess->block >> 8) & 0xFF;
-            data[3] = sess->block & 0xFF;
-            sendto(sess->sock, data, bytes + 4, 0, (struct sockaddr *)&sess->client_addr, sess->addr_len);
-            printf("Session RRQ: Envoyé bloc %d (%ld octets)\n", sess->block, bytes);
-            sess->block++;
-            if (bytes < DATA_SIZE)
-                sess->finished = 1;
         }
     }
-    else if (sess->opcode == OP_WRQ) {
-        // Pour WRQ, recevoir des paquets DATA du client.
-        if (n < 4)
-            return;
-        int data_opcode = buffer[1];
-        int block = (((unsigned char)buffer[2]) << 8) | ((unsigned char)buffer[3]);
-        if (data_opcode == OP_DATA && block == sess->block + 1) {
-            fwrite(buffer + 4, 1, n - 4, sess->fp);
-            fflush(sess->fp);
-            sess->block = block;
-            unsigned char ack[4] = {0, OP_ACK, buffer[2], buffer[3]};
-            sendto(sess->sock, ack, 4, 0, (struct sockaddr *)&sess->client_addr, sess->addr_len);
-            printf("Session WRQ: Reçu bloc %d, ACK envoyé\n", block);
-            if (n - 4 < DATA_SIZE)
-                sess->finished = 1;
+}
+
+int main(int argc, char *argv[]) {
+    PROF_INIT();
+    double global_rate = 0, client_rate = 0, subnet_rate = 0;
+    int prefix = 24, opt;
+    char *xdp_if = NULL;
+    while ((opt = getopt(argc, argv, "m:q:g:c:n:p:P:A:X:T:B:D")) != -1) {
+        switch (opt) {
+        case 'm': max_sessions = atoi(optarg); break;
+        case 'q': queue_max = atoi(optarg); break;
+        case 'g': global_rate = shaper_parse_rate(optarg); break;
+        case 'c': client_rate = shaper_parse_rate(optarg); break;
+        case 'n': subnet_rate = shaper_parse_rate(optarg); break;
+        case 'p': prefix = atoi(optarg); break;
+        case 'P':
+            if (sched_add_rule(optarg) < 0) {
+                fprintf(stderr, "Règle de priorité invalide : %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'A': sched_aging = shaper_parse_rate(optarg); break;
+        case 'X': xdp_if = optarg; break;
+        case 'D': upload_dedup = 1; break;
+        case 'B':
+            if (sockbuf_parse(optarg) < 0) {
+                fprintf(stderr, "Taille de tampon invalide : %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            if (trace_open(optarg) < 0) {
+                perror(optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            fprintf(stderr, "Utilisation : %s [-m max_sessions] [-q taille_file] [-g débit_global]\n"
+                            "            [-c débit_par_client] [-n débit_par_sous_réseau] [-p préfixe]\n"
+                            "            [-P motif=classe | -P a.b.c.d/n=classe]... [-A vieillissement]\n"
+                            "            [-X interface[:file]] [-T trace] [-B min[:max]] [-D]\n"
+                            "Débits en octets/s, suffixes k/M/G acceptés (ex. -g 100M).\n"
+                            "Classe 0 = la plus prioritaire, vieillissement en octets de score par seconde d'attente.\n"
+                            "-X : données RRQ par AF_XDP sur l'interface à une file de réception (ports %d à %d,\n"
+                            "     mode générique).\n"
+                            "-T : enregistre les paquets reçus dans une trace (rejouable avec replay).\n"
+                            "-B : tampons de la socket du port %d (octets, k/M), agrandis jusqu'à max en cas de pertes.\n"
+                            "-D : fichiers reçus rangés par contenu (Server/.objects), contenus identiques partagés.\n",
+                    argv[0], XDP_PORT_BASE, XDP_PORT_BASE + XDP_PORT_COUNT - 1, TFTP_PORT);
+            exit(EXIT_FAILURE);
         }
     }
-}
+    shaper_init(&shaper, global_rate, client_rate, subnet_rate, prefix);
+    if (xdp_if) {
+        char *colon = strchr(xdp_if, ':');
+        unsigned queue = 0;
+        if (colon) {
+            *colon = '\0';
+            queue = atoi(colon + 1);
+        }
+        if (xdp_open(&xdp, xdp_if, queue) < 0)
+            fprintf(stderr, "AF_XDP indisponible sur %s, les RRQ passeront par les sockets.\n", xdp_if);
+        else
+            printf("AF_XDP actif sur %s file %u (ports %d à %d)\n", xdp_if, queue,
+                   XDP_PORT_BASE, XDP_PORT_BASE + XDP_PORT_COUNT - 1);
+    }
 
-int main(void) {
     // Création du dossier "Server" s'il n'existe pas
     struct stat st = {0};
     if (stat("Server", &st) == -1) {
@@ -269,6 +564,10 @@ int main(void) {
         exit(EXIT_FAILURE);
     }
     
+    char name[48];
+    snprintf(name, sizeof(name), "port %d", TFTP_PORT);
+    sockbuf_init(&listen_buf, main_sock, name, sockbuf_policy.min);
+    
     // Mettre la socket principale en non bloquant
     int flags = fcntl(main_sock, F_GETFL, 0);
     fcntl(main_sock, F_SETFL, flags | O_NONBLOCK);
@@ -281,38 +580,55 @@ int main(void) {
         FD_ZERO(&read_fds);
         FD_SET(main_sock, &read_fds);
         maxfd = main_sock;
+        if (xdp.fd >= 0) {
+            FD_SET(xdp.fd, &read_fds);
+            if (xdp.fd > maxfd)
+                maxfd = xdp.fd;
+        }
         session_t *sess = session_list;
         while (sess) {
-            FD_SET(sess->sock, &read_fds);
-            if (sess->sock > maxfd)
-                maxfd = sess->sock;
+            if (sess->sock >= 0) {
+                FD_SET(sess->sock, &read_fds);
+                if (sess->sock > maxfd)
+                    maxfd = sess->sock;
+            }
             sess = sess->next;
         }
         
-        // Setup du timeout
+        // Setup du timeout : prochain envoi retenu par le limiteur de débit ou prochaine retransmission
+        double wait = FSM_TIMEOUT;
+        double now_s = shaper_now();
+        for (sess = session_list; sess; sess = sess->next) {
+            double at = sess->fsm.pending ? sess->send_at : fsm_deadline(&sess->fsm);
+            if (at >= 0 && at - now_s < wait)
+                wait = at - now_s > 0 ? at - now_s : 0;
+        }
+        wait = trace_wait(wait);        // Trace (-T) écrite même sans trafic
         struct timeval tv;
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
+        tv.tv_sec = (time_t)wait;
+        tv.tv_usec = (suseconds_t)((wait - tv.tv_sec) * 1e6);
         
         // Appel de select pour surveiller les sockets
+        PROF_BEGIN(t_wait);
         int activity = select(maxfd + 1, &read_fds, NULL, NULL, &tv);
-        if (activity < 0 && errno != EINTR) {
+        PROF_END(PROF_WAIT, t_wait);
+        sockbuf_poll(&listen_buf);      // Pertes survenues après le dernier paquet reçu
+        trace_tick();
+        if (activity < 0) {
+            if (errno == EINTR)
+                continue;
             perror("select");
             break;
         }
         
-        // Si aucune activité pendant 2 secondes, vérifier le timeout pour les sessions WRQ
-        if (activity == 0) {
-            time_t now = time(NULL);
-            session_t *cur = session_list;
-            while (cur) {
-                if (cur->opcode == OP_WRQ && (now - cur->last_activity) >= SESSION_TIMEOUT) {
-                    printf("Timeout de la session WRQ pour %s:%d, fermeture de la session.\n",
-                           inet_ntoa(cur->client_addr.sin_addr), ntohs(cur->client_addr.sin_port));
-                    cur->finished = 1;
-                }
-                cur = cur->next;
-            }
+        // Timers expirés : dernier paquet répété, ou session abandonnée après FSM_RETRIES essais
+        now_s = shaper_now();
+        for (session_t *cur = session_list; cur; cur = cur->next) {
+            double at = fsm_deadline(&cur->fsm);
+            if (at >= 0 && now_s >= at && fsm_timeout(&cur->fsm, now_s))
+                printf("Timeout de la session %s pour %s:%d, bloc %d répété (%d/%d)\n",
+                       cur->opcode == OP_RRQ ? "RRQ" : "WRQ", inet_ntoa(cur->client_addr.sin_addr),
+                       ntohs(cur->client_addr.sin_port), cur->fsm.block, cur->fsm.retries, FSM_RETRIES);
         }
         
         // Traitement des nouvelles requêtes
@@ -320,34 +636,74 @@ int main(void) {
             handle_new_request(main_sock);
         }
         
-        // Traitement des requêtes existantes (partie 2)
-        session_t *prev = NULL;
-        sess = session_list;
-        while (sess) {
-            session_t *next = sess->next;
+        // ACK reçus par AF_XDP
+        if (xdp.fd >= 0 && FD_ISSET(xdp.fd, &read_fds)) {
+            PROF_BEGIN(t_recv);
+            while (xdp_poll(&xdp, xdp_input, NULL) > 0)
+                ;
+            PROF_END(PROF_RECV, t_recv);
+        }
+        
+        // Traitement des requêtes existantes (partie 2), par ordre de score :
+        // les sessions prioritaires passent en premier quand les jetons manquent
+        struct { double score; session_t *sess; } *ready = malloc(session_count * sizeof(*ready));
+        int nready = 0;
+        now_s = shaper_now();
+        for (sess = session_list; sess && ready; sess = sess->next) {
+            if ((sess->sock >= 0 && FD_ISSET(sess->sock, &read_fds)) || (sess->fsm.pending && now_s >= sess->send_at)) {
+                ready[nready].score = session_score(sess, now_s);
+                ready[nready++].sess = sess;
+            }
+        }
+        qsort(ready, nready, sizeof(*ready), compare_scores);
+        for (int i = 0; i < nready; i++) {
+            sess = ready[i].sess;
             
             // Traitement des requêtes encore en activité
-            if (FD_ISSET(sess->sock, &read_fds)) {
+            if (sess->sock >= 0 && FD_ISSET(sess->sock, &read_fds)) {
                 process_session(sess);
             }
             
+            // Blocs retenus par le limiteur de débit
+            if (sess->fsm.pending && !fsm_over(&sess->fsm) && shaper_now() >= sess->send_at) {
+                rrq_flush(sess);
+            }
+        }
+        free(ready);
+        
+        session_t *prev = NULL;
+        sess = session_list;
+        while (sess) {
+            session_t *next = sess->next;
+            
             // Si une requête est finie, on y met fin
-            if (sess->finished) {
+            if (fsm_over(&sess->fsm)) {
+                session_end(sess);
                 printf("Session terminée pour %s:%d\n", inet_ntoa(sess->client_addr.sin_addr),
                        ntohs(sess->client_addr.sin_port));
-                close(sess->sock);
-                if (sess->fp)
-                    fclose(sess->fp);
+                if (sess->sock >= 0) {
+                    sockbuf_report(&sess->sb);
+                    close(sess->sock);
+                }
+                if (sess->xdp_port)
+                    xdp_port_close(&xdp, sess->xdp_port);
+                if (sess->opcode == OP_WRQ)
+                    upload_close(&sess->up);    // Fichier anonyme abandonné s'il n'a pas été mis en place
+                image_close(&sess->src);
                 if (prev)
                     prev->next = next;
                 else
                     session_list = next;
+                session_count--;
                 free(sess);
             } else {
                 prev = sess;
             }
             sess = next;
         }
+        
+        // Des places se sont peut-être libérées
+        admit_queued(main_sock);
     }
     
     close(main_sock);
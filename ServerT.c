@@ -7,6 +7,20 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
+
+#include "tftp_prof.h"
+#include "tftp_shaper.h"
+#include "tftp_sched.h"
+#include "tftp_netascii.h"
+#include "tftp_crc32c.h"
+#include "tftp_upload.h"
+#include "tftp_trace.h"
+#include "tftp_codec.h"
+#include "tftp_sockbuf.h"
+#include "tftp_resume.h"
+#include "tftp_image.h"
+#include "tftp_fsm.h"
 
 #define TFTP_PORT 6969
 #define BUFFER_SIZE 516  // 2 octets opcode, 2 octets numéro de bloc, 512 octets de données
@@ -20,10 +34,12 @@
 #define OP_ERROR 5
 
 // Code d'erreur TFTP
+#define ERR_UNDEFINED 0
 #define ERR_FILE_NOT_FOUND 1
+#define ERR_UNKNOWN_TID 5
 
-// Mutex global pour protéger l'accès aux fichiers
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Durée maximale d'attente d'une requête dans la file d'admission (en secondes)
+#define QUEUE_TIMEOUT 5
 
 // Déclaration de la structure pour les arguments de thread
 struct thread_args {
@@ -32,200 +48,463 @@ struct thread_args {
     socklen_t addr_len;
     unsigned char buffer[BUFFER_SIZE];
     ssize_t received_bytes;
+    time_t arrival;            // Date de mise en file d'attente (admission)
+    int cls;                   // Classe et taille (RRQ) pour choisir la prochaine requête admise
+    double size;
+    struct thread_args *next;
 };
 
 // Typedef pour simplifier l'utilisation de la structure
 typedef struct thread_args thread_args_t;
 
+// Admission : nombre de sessions actives et file des requêtes en attente
+pthread_mutex_t admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+int active_sessions = 0;
+int max_sessions = 0;      // 0 = illimité
+int queue_max = 0;         // 0 = refus immédiat quand le serveur est plein
+int queue_len = 0;
+thread_args_t *queue_head = NULL, *queue_tail = NULL;
+
+// Limitation de débit des envois DATA, dans l'ordre des scores quand les jetons manquent
+shaper_t shaper;
+sched_gate_t send_gate = SCHED_GATE_INITIALIZER;
+
 // Prototypes des fonctions de thread
 void *handle_wrq(void *args);
 void *handle_rrq(void *args);
+void spawn_session(thread_args_t *targs);
 
-// Gestion de la requête WRQ
-void *handle_wrq(void *args) {
-    thread_args_t *targs = (thread_args_t *)args;  // Conversion du paramètre
-    char filename[256];
-    char mode[12];
-    int index = 2; // après l'opcode
+// Envoie un paquet d'erreur depuis la socket principale
+void send_error(thread_args_t *targs, int code, const char *msg) {
+    unsigned char err_pkt[BUFFER_SIZE];
+    size_t err_index = tftp_put_error(err_pkt, sizeof(err_pkt), code, msg);
+    if(sendto(targs->sock, err_pkt, err_index, 0,
+              (struct sockaddr *)&targs->client_addr, targs->addr_len) < 0)
+        perror("sendto erreur");
+}
 
-    // Construction du chemin complet : "Server/<nom_fichier>"
-    snprintf(filename, sizeof(filename), "Server/");
-    strncat(filename, (char *)(targs->buffer + index), sizeof(filename) - strlen(filename) - 1);
-
-    // Avancer l'index jusqu'au '\0' qui termine le nom de fichier
-    while(index < targs->received_bytes && targs->buffer[index] != '\0')
-        index++;
-    index++; // passer le '\0'
-    strncpy(mode, (char *)(targs->buffer + index), sizeof(mode) - 1);
-    mode[sizeof(mode) - 1] = '\0';
-
-    printf("[WRQ] Demande d'écriture pour le fichier '%s' en mode %s\n", filename, mode);
-
-    // Création d'une socket dédiée pour cette session
-    int sock_thread = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock_thread < 0) {
-        perror("[WRQ] socket (thread)");
-        free(targs);
-        pthread_exit(NULL);
+// Classe et taille (RRQ) d'une requête, d'après son nom de fichier
+void request_class(thread_args_t *targs) {
+    char path[300];
+    tftp_packet_t req;
+    int opcode = tftp_parse(targs->buffer, targs->received_bytes, &req);
+    targs->cls = sched_classify(req.filename, targs->client_addr.sin_addr);
+    targs->size = 0;
+    snprintf(path, sizeof(path), "Server/%s", req.filename);
+    if (opcode == OP_RRQ && (targs->size = image_size(path)) < 0)
+        targs->size = 0;
+}
+
+// Libère la place d'une session terminée ou la transmet à la meilleure requête en attente
+void release_session(void) {
+    pthread_mutex_lock(&admission_mutex);
+    time_t now = time(NULL);
+    
+    // Purger les requêtes trop anciennes : le client a probablement abandonné, on le prévient quand même
+    thread_args_t **p = &queue_head;
+    queue_tail = NULL;
+    while (*p) {
+        thread_args_t *q = *p;
+        if (now - q->arrival > QUEUE_TIMEOUT) {
+            send_error(q, ERR_UNDEFINED, "Server busy, retry later");
+            *p = q->next;
+            queue_len--;
+            free(q);
+        } else {
+            queue_tail = q;
+            p = &q->next;
+        }
+    }
+    
+    if (queue_head) {
+        thread_args_t **best = &queue_head;
+        for (p = &queue_head; *p; p = &(*p)->next)
+            if (sched_score((*p)->cls, (*p)->size, now - (*p)->arrival) <
+                sched_score((*best)->cls, (*best)->size, now - (*best)->arrival))
+                best = p;
+        thread_args_t *q = *best;
+        *best = q->next;
+        if (queue_tail == q) {
+            queue_tail = NULL;
+            for (thread_args_t *t = queue_head; t; t = t->next)
+                queue_tail = t;
+        }
+        queue_len--;
+        pthread_mutex_unlock(&admission_mutex);
+        spawn_session(q);      // La place passe directement à la requête choisie
+        return;
     }
+    active_sessions--;
+    pthread_mutex_unlock(&admission_mutex);
+}
 
-    // Envoi de l'ACK initial (bloc 0)
-    unsigned char ack[4] = {0, OP_ACK, 0, 0};
-    if(sendto(sock_thread, ack, 4, 0, (struct sockaddr *)&targs->client_addr, targs->addr_len) < 0)
-        perror("[WRQ] sendto ACK initial");
+// Point d'entrée des threads : traite la requête puis libère sa place
+void *session_thread(void *args) {
+    thread_args_t *targs = (thread_args_t *)args;
+    tftp_packet_t req;
+    if (tftp_parse(targs->buffer, targs->received_bytes, &req) == OP_WRQ)
+        handle_wrq(targs);
     else
-        printf("[WRQ] Envoi de l'ACK initial (bloc 0) à %s:%d\n",
-               inet_ntoa(targs->client_addr.sin_addr), ntohs(targs->client_addr.sin_port));
-
-    // Ouverture du fichier en écriture avec protection
-    pthread_mutex_lock(&file_mutex);
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("[WRQ] fopen");
-        pthread_mutex_unlock(&file_mutex);
-        close(sock_thread);
+        handle_rrq(targs);
+    release_session();
+    return NULL;
+}
+
+void spawn_session(thread_args_t *targs) {
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, session_thread, targs) != 0) {
+        perror("pthread_create");
+        free(targs);
+        release_session();
+        return;
+    }
+    pthread_detach(thread_id);
+}
+
+// Décide si une requête démarre tout de suite, attend son tour ou est refusée
+void admit_request(thread_args_t *targs) {
+    pthread_mutex_lock(&admission_mutex);
+    if (max_sessions <= 0 || active_sessions < max_sessions) {
+        active_sessions++;
+        pthread_mutex_unlock(&admission_mutex);
+        spawn_session(targs);
+        return;
+    }
+    // Une retransmission de la même requête ne doit pas occuper deux places
+    for (thread_args_t *q = queue_head; q; q = q->next) {
+        if (q->client_addr.sin_addr.s_addr == targs->client_addr.sin_addr.s_addr &&
+            q->client_addr.sin_port == targs->client_addr.sin_port) {
+            pthread_mutex_unlock(&admission_mutex);
+            free(targs);
+            return;
+        }
+    }
+    if (queue_len >= queue_max) {
+        pthread_mutex_unlock(&admission_mutex);
+        printf("Serveur saturé (%d sessions), requête refusée.\n", max_sessions);
+        send_error(targs, ERR_UNDEFINED, "Server busy, retry later");
         free(targs);
-        pthread_exit(NULL);
+        return;
+    }
+    targs->arrival = time(NULL);
+    targs->next = NULL;
+    request_class(targs);
+    if (queue_tail)
+        queue_tail->next = targs;
+    else
+        queue_head = targs;
+    queue_tail = targs;
+    queue_len++;
+    printf("Serveur saturé, requête mise en file d'attente (%d en attente).\n", queue_len);
+    pthread_mutex_unlock(&admission_mutex);
+}
+
+/*
+ * Transfert servi par un thread : socket dédiée (son port est le TID du
+ * serveur) et machine à états (tftp_fsm.h). Le thread attend le client
+ * jusqu'à la prochaine échéance de la machine : sans nouvelle, le dernier
+ * paquet est répété, puis le transfert est abandonné et sa place libérée.
+ */
+typedef struct {
+    thread_args_t *targs;
+    char filename[256];            // "Server/<nom_fichier>"
+    int opcode;
+    int sock;
+    sockbuf_t sb;
+    int netascii;
+    netascii_t na;
+    fsm_t fsm;
+    image_reader_t src;            // RRQ : fichier ou image compressée, CRC32C au fil de l'eau
+    long long offset;              // RRQ : reprise, position du bloc 1 dans le fichier
+    int cls;                       // RRQ : classe, taille et dernier envoi pour l'ordonnancement
+    double size, last_served;
+    upload_t up;                   // WRQ : fichier anonyme mis en place au dernier bloc
+    uint32_t crc;                  // WRQ : CRC32C des données écrites
+} session_t;
+
+// Lecture du fichier (RRQ), appelée par la machine à états pour chaque nouveau bloc
+size_t session_read(void *ctx, unsigned char *buf, size_t len) {
+    session_t *sess = ctx;
+    PROF_BEGIN(t_read);
+    size_t n = sess->netascii ? netascii_read_block(&sess->na, image_fread, &sess->src, buf, len)
+                              : image_fread(&sess->src, buf, len);
+    PROF_END(PROF_READ, t_read);
+    return n;
+}
+
+// Écriture d'un bloc reçu (WRQ) ; au dernier, le fichier remplace l'ancien et son CRC est mémorisé avec lui
+int session_write(void *ctx, const unsigned char *data, size_t len, int last) {
+    session_t *sess = ctx;
+    int ret = 0;
+    PROF_BEGIN(t_write);
+    if (sess->netascii) {
+        unsigned char text[BUFFER_SIZE + 1];
+        size_t n = netascii_decode(&sess->na, data, len, text);
+        if (last)
+            n += netascii_decode_finish(&sess->na, text + n);
+        if (upload_write(&sess->up, text, n) < 0)
+            ret = -1;
+        sess->crc = crc32c(sess->crc, text, n);
+    } else {
+        if (upload_write(&sess->up, data, len) < 0)
+            ret = -1;
+        sess->crc = crc32c(sess->crc, data, len);
     }
+    PROF_END(PROF_WRITE, t_write);
+    if (ret < 0) {      // Disque plein, préfixe non recopié... : ERROR au client, rien n'est mis en place
+        perror("[WRQ] écriture du fichier reçu");
+        return -1;
+    }
+    if (!last)
+        return 0;
+    if (upload_commit(&sess->up) < 0) {
+        perror("[WRQ] mise en place du fichier");
+        return -1;
+    }
+    printf("[WRQ] Fichier '%s' reçu, crc32c=%08x (%s)%s\n", sess->filename, sess->crc,
+           digest_store(sess->up.fd, sess->crc) == 0 ? "mémorisé" : "non mémorisé",
+           sess->up.unchanged ? ", contenu inchangé" : "");
+    return 0;
+}
+
+int session_send(void *ctx, const unsigned char *pkt, size_t len) {
+    session_t *sess = ctx;
+    PROF_BEGIN(t_send);
+    if (sendto(sess->sock, pkt, len, 0, (struct sockaddr *)&sess->targs->client_addr, sess->targs->addr_len) < 0)
+        perror(sess->opcode == OP_RRQ ? "[RRQ] sendto" : "[WRQ] sendto");
+    PROF_END(PROF_SEND, t_send);
+    return 0;
+}
+
+static const fsm_ops_t session_ops = { session_read, session_write, session_send, NULL };
+
+// Envoie le bloc prêt (RRQ) à son tour dans l'ordonnancement des envois
+void rrq_flush(session_t *sess) {
+    if (image_failed(&sess->src)) {     // Image compressée invalide : erreur plutôt qu'un dernier bloc tronqué
+        fsm_abort(&sess->fsm, ERR_UNDEFINED, "Image compressée invalide");
+        printf("[RRQ] Image compressée '%s' invalide\n", sess->filename);
+        return;
+    }
+    double remaining = sess->size - sess->offset - (double)(sess->fsm.block - 1) * DATA_SIZE;
+    sched_gate_send(&send_gate, &shaper, sess->targs->client_addr.sin_addr, sess->fsm.out_len,
+                    sess->cls, remaining > 0 ? remaining : 0, sess->last_served);
+    fsm_flush(&sess->fsm, shaper_now());
+    sess->last_served = shaper_now();
+    printf("[RRQ] Envoi du bloc %d, taille = %ld octets\n", sess->fsm.block, (long)sess->fsm.out_len - 4);
+}
 
-    uint16_t expected_block = 1;
-    int finished = 0;
-    while (!finished) {
-        unsigned char data_packet[BUFFER_SIZE];
-        struct sockaddr_in client;
-        socklen_t client_len = sizeof(client);
-        ssize_t n = recvfrom(sock_thread, data_packet, BUFFER_SIZE, 0,
-                             (struct sockaddr *)&client, &client_len);
+// Boucle du transfert : envois, paquets du client et échéances jusqu'à la fin ou l'abandon
+void session_run(session_t *sess) {
+    thread_args_t *targs = sess->targs;
+    const char *tag = sess->opcode == OP_RRQ ? "[RRQ]" : "[WRQ]";
+    unsigned char buffer[BUFFER_SIZE];
+    while (!fsm_over(&sess->fsm)) {
+        if (sess->fsm.pending) {
+            if (sess->opcode == OP_RRQ)
+                rrq_flush(sess);
+            else
+                fsm_flush(&sess->fsm, shaper_now());
+            continue;
+        }
+        double now = shaper_now(), left = fsm_deadline(&sess->fsm) - now;
+        if (left <= 0) {
+            if (fsm_timeout(&sess->fsm, now))
+                printf("%s Pas de réponse de %s:%d, répétition du bloc %d\n", tag,
+                       inet_ntoa(targs->client_addr.sin_addr), ntohs(targs->client_addr.sin_port),
+                       sess->fsm.block);
+            continue;
+        }
+        // Attente bornée par l'échéance (un timeout nul bloquerait indéfiniment)
+        struct timeval tv = { (time_t)left, (suseconds_t)((left - (time_t)left) * 1e6) };
+        if (tv.tv_sec == 0 && tv.tv_usec == 0)
+            tv.tv_usec = 1;
+        setsockopt(sess->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        PROF_BEGIN(t_recv);
+        ssize_t n = sockbuf_recvfrom(&sess->sb, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+        PROF_END(PROF_RECV, t_recv);
         if (n < 0) {
-            perror("[WRQ] recvfrom");
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            perror(sess->opcode == OP_RRQ ? "[RRQ] recvfrom" : "[WRQ] recvfrom");
+            sess->fsm.state = FSM_FAILED;
             break;
         }
-        uint16_t opcode = (((unsigned char)data_packet[0]) << 8) | ((unsigned char)data_packet[1]);
-        if (opcode != OP_DATA) {
-            printf("[WRQ] Paquet reçu non DATA (opcode %d)\n", opcode);
+        trace_record(&from, buffer, n);
+        if (from.sin_addr.s_addr != targs->client_addr.sin_addr.s_addr ||
+            from.sin_port != targs->client_addr.sin_port) {
+            size_t len = tftp_put_error(buffer, sizeof(buffer), ERR_UNKNOWN_TID, "Unknown transfer ID");
+            sendto(sess->sock, buffer, len, 0, (struct sockaddr *)&from, from_len);  // Le transfert continue
             continue;
         }
-        uint16_t block = (((unsigned char)data_packet[2]) << 8) | ((unsigned char)data_packet[3]);
-        printf("[WRQ] Reçu bloc %d (attendu %d), taille données = %ld octets\n", block, expected_block, n - 4);
-        if (block != expected_block) {
-            printf("[WRQ] Bloc inattendu : %d au lieu de %d\n", block, expected_block);
+        if (!fsm_input(&sess->fsm, buffer, n, shaper_now()))
             continue;
-        }
-        size_t data_len = n - 4;
-        fwrite(data_packet + 4, 1, data_len, fp);
-        fflush(fp);
-
-        ack[2] = data_packet[2];
-        ack[3] = data_packet[3];
-        if(sendto(sock_thread, ack, 4, 0, (struct sockaddr *)&client, client_len) < 0)
-            perror("[WRQ] sendto ACK");
-        else
-            printf("[WRQ] Envoi de l'ACK pour le bloc %d\n", block);
-        expected_block++;
-        if (data_len < DATA_SIZE)
-            finished = 1;
+        if (sess->opcode == OP_WRQ && sess->fsm.state != FSM_FAILED)
+            printf("[WRQ] Reçu et confirmé bloc %d\n", sess->fsm.block);
+        else if (sess->opcode == OP_RRQ && sess->fsm.block == 1 && sess->fsm.pending && sess->offset)
+            printf("[RRQ] Reprise de '%s' à l'octet %lld\n", sess->filename, sess->offset);
+    }
+
+    if (sess->fsm.state == FSM_FAILED)
+        printf("%s Abandon du transfert de '%s' pour %s:%d (bloc %d, %lu retransmissions)\n", tag,
+               sess->filename, inet_ntoa(targs->client_addr.sin_addr), ntohs(targs->client_addr.sin_port),
+               sess->fsm.block, sess->fsm.retransmits);
+    else if (sess->opcode == OP_RRQ && sess->offset)     // Le CRC ne couvre que la fin du fichier
+        printf("[RRQ] Fichier '%s' envoyé à partir de l'octet %lld\n", sess->filename, sess->offset);
+    else if (sess->opcode == OP_RRQ)
+        printf("[RRQ] Fichier '%s' envoyé, crc32c=%08x (%s)\n", sess->filename, sess->src.rd.crc,
+               image_verify(&sess->src));
+    sockbuf_report(&sess->sb);
+    close(sess->sock);
+    printf("%s Transfert terminé pour '%s'\n", tag, sess->filename);
+}
+
+// Socket dédiée à la session ; -1 si elle n'a pas pu être créée
+int session_socket(session_t *sess) {
+    sess->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sess->sock < 0) {
+        perror(sess->opcode == OP_RRQ ? "[RRQ] socket (thread)" : "[WRQ] socket (thread)");
+        return -1;
+    }
+    sockbuf_init_peer(&sess->sb, sess->sock, &sess->targs->client_addr, SOCKBUF_SESSION);
+    return 0;
+}
+
+// Gestion de la requête WRQ
+void *handle_wrq(void *args) {
+    thread_args_t *targs = (thread_args_t *)args;  // Conversion du paramètre
+    session_t sess = { .targs = targs, .opcode = OP_WRQ };
+    tftp_packet_t req;
+
+    PROF_BEGIN(t_parse);
+    tftp_parse(targs->buffer, targs->received_bytes, &req);    // Validée à la réception
+    // Construction du chemin complet : "Server/<nom_fichier>"
+    snprintf(sess.filename, sizeof(sess.filename), "Server/%s", req.filename);
+    const char *mode = req.mode;    // Pointe dans targs->buffer
+    PROF_END(PROF_PARSE, t_parse);
+
+    printf("[WRQ] Demande d'écriture pour le fichier '%s' en mode %s\n", sess.filename, mode);
+    sess.netascii = netascii_mode(mode);
+    netascii_init(&sess.na);
+
+    // Écriture dans un fichier anonyme : l'ancienne version reste lisible jusqu'au dernier bloc
+    const char *tsize = tftp_option(&req, "tsize");
+    if (upload_open(&sess.up, sess.filename, tsize ? atoll(tsize) : -1) < 0) {
+        perror("[WRQ] ouverture du fichier");
+        send_error(targs, 2, "L'ouverture du fichier pour l'écriture a échouée");
+        free(targs);
+        return NULL;
+    }
+    if (session_socket(&sess) == 0) {
+        fsm_ops_t ops = session_ops;
+        ops.ctx = &sess;
+        fsm_start_wrq(&sess.fsm, &ops);     // ACK 0 envoyé par la boucle
+        session_run(&sess);
     }
-    fclose(fp);
-    pthread_mutex_unlock(&file_mutex);
-    close(sock_thread);
-    printf("[WRQ] Transfert terminé pour '%s'\n", filename);
+    upload_close(&sess.up);     // Transfert interrompu : rien n'apparaît
     free(targs);
-    pthread_exit(NULL);
+    return NULL;
 }
 
 // Gestion de la requête RRQ (lecture)
 void *handle_rrq(void *args) {
     thread_args_t *targs = (thread_args_t *)args;  // Conversion du paramètre
-    char filename[256];
-    char mode[12];
-    int index = 2; // après l'opcode
-
-    snprintf(filename, sizeof(filename), "Server/");
-    strncat(filename, (char *)(targs->buffer + index), sizeof(filename) - strlen(filename) - 1);
-
-    while(index < targs->received_bytes && targs->buffer[index] != '\0')
-        index++;
-    index++; // passer le '\0'
-    strncpy(mode, (char *)(targs->buffer + index), sizeof(mode) - 1);
-    mode[sizeof(mode) - 1] = '\0';
-
-    printf("[RRQ] Demande de lecture pour le fichier '%s' en mode %s\n", filename, mode);
-
-    pthread_mutex_lock(&file_mutex);
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        pthread_mutex_unlock(&file_mutex);
-        unsigned char err_pkt[BUFFER_SIZE];
-        int err_index = 0;
-        err_pkt[err_index++] = 0;
-        err_pkt[err_index++] = OP_ERROR;
-        err_pkt[err_index++] = 0;
-        err_pkt[err_index++] = ERR_FILE_NOT_FOUND;
-        const char *err_msg = "File not found";
-        strcpy((char *)&err_pkt[err_index], err_msg);
-        err_index += strlen(err_msg) + 1;
-        if(sendto(targs->sock, err_pkt, err_index, 0,
-                  (struct sockaddr *)&targs->client_addr, targs->addr_len) < 0)
-            perror("[RRQ] sendto erreur");
-        printf("[RRQ] Fichier '%s' non trouvé, envoi de l'erreur\n", filename);
+    session_t sess = { .targs = targs, .opcode = OP_RRQ };
+    tftp_packet_t req;
+
+    PROF_BEGIN(t_parse);
+    tftp_parse(targs->buffer, targs->received_bytes, &req);    // Validée à la réception
+    // Construction du chemin complet : "Server/<nom_fichier>"
+    snprintf(sess.filename, sizeof(sess.filename), "Server/%s", req.filename);
+    const char *mode = req.mode;    // Pointe dans targs->buffer
+    PROF_END(PROF_PARSE, t_parse);
+
+    printf("[RRQ] Demande de lecture pour le fichier '%s' en mode %s\n", sess.filename, mode);
+    sess.netascii = netascii_mode(mode);
+    netascii_init(&sess.na);
+
+    // Pas de verrou : un envoi concurrent ne remplace le fichier qu'une fois complet.
+    // Fichier absent : son image compressée (.gz, .zst), décompressée à la volée
+    long long file_size;
+    if (image_open(&sess.src, sess.filename, &file_size) < 0) {
+        send_error(targs, ERR_FILE_NOT_FOUND, "File not found");
+        printf("[RRQ] Fichier '%s' non trouvé, envoi de l'erreur\n", sess.filename);
         free(targs);
-        pthread_exit(NULL);
+        return NULL;
     }
-    pthread_mutex_unlock(&file_mutex);
 
-    int sock_thread = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock_thread < 0) {
-        perror("[RRQ] socket (thread)");
-        fclose(fp);
-        free(targs);
-        pthread_exit(NULL);
+    // Classe de priorité et taille, pour l'ordonnancement des envois
+    sess.cls = sched_classify(req.filename, targs->client_addr.sin_addr);
+    sess.size = file_size > 0 ? file_size : 0;
+    sess.last_served = shaper_now();
+    printf("[RRQ] '%s' : classe %d, %.0f octets%s\n", sess.filename, sess.cls, sess.size,
+           sess.src.img ? " (image compressée)" : "");
+
+    if (session_socket(&sess) == 0) {
+        // Reprise (option offset) et taille (tsize) : OACK, puis le bloc 1 part de offset une fois l'ACK 0 reçu
+        sess.offset = resume_offset(&req, file_size, sess.netascii);
+        if (sess.offset && image_seek(&sess.src, sess.offset) != 0)
+            sess.offset = 0;
+        unsigned char oack[64];
+        size_t oack_len = image_oack(oack, sizeof(oack), &req, file_size, sess.offset, sess.netascii);
+        fsm_ops_t ops = session_ops;
+        ops.ctx = &sess;
+        fsm_start_rrq(&sess.fsm, &ops, oack, oack_len);
+        session_run(&sess);
     }
+    image_close(&sess.src);
+    free(targs);
+    return NULL;
+}
 
-    uint16_t block = 1;
-    int finished = 0;
-    unsigned char data_packet[BUFFER_SIZE];
-    while (!finished) {
-        size_t nread = fread(data_packet + 4, 1, DATA_SIZE, fp);
-        data_packet[0] = 0;
-        data_packet[1] = OP_DATA;
-        data_packet[2] = block >> 8;
-        data_packet[3] = block & 0xFF;
-        ssize_t packet_size = nread + 4;
-        if(sendto(sock_thread, data_packet, packet_size, 0,
-                  (struct sockaddr *)&targs->client_addr, targs->addr_len) < 0) {
-            perror("[RRQ] sendto DATA");
+int main(int argc, char *argv[]) {
+    PROF_INIT();
+    double global_rate = 0, client_rate = 0, subnet_rate = 0;
+    int prefix = 24, opt;
+    while ((opt = getopt(argc, argv, "m:q:g:c:n:p:P:A:T:B:D")) != -1) {
+        switch (opt) {
+        case 'm': max_sessions = atoi(optarg); break;
+        case 'q': queue_max = atoi(optarg); break;
+        case 'g': global_rate = shaper_parse_rate(optarg); break;
+        case 'c': client_rate = shaper_parse_rate(optarg); break;
+        case 'n': subnet_rate = shaper_parse_rate(optarg); break;
+        case 'p': prefix = atoi(optarg); break;
+        case 'P':
+            if (sched_add_rule(optarg) < 0) {
+                fprintf(stderr, "Règle de priorité invalide : %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
             break;
-        }
-        printf("[RRQ] Envoi du bloc %d, taille = %ld octets\n", block, nread);
-
-        unsigned char ack[4];
-        struct sockaddr_in client;
-        socklen_t client_len = sizeof(client);
-        ssize_t ack_bytes = recvfrom(sock_thread, ack, 4, 0,
-                                     (struct sockaddr *)&client, &client_len);
-        if (ack_bytes < 0) {
-            perror("[RRQ] recvfrom ACK");
+        case 'A': sched_aging = shaper_parse_rate(optarg); break;
+        case 'D': upload_dedup = 1; break;
+        case 'T':
+            if (trace_open(optarg) < 0) {
+                perror(optarg);
+                exit(EXIT_FAILURE);
+            }
             break;
+        case 'B':
+            if (sockbuf_parse(optarg) < 0) {
+                fprintf(stderr, "Taille de tampon invalide : %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            fprintf(stderr, "Utilisation : %s [-m max_sessions] [-q taille_file] [-g débit_global]\n"
+                            "            [-c débit_par_client] [-n débit_par_sous_réseau] [-p préfixe]\n"
+                            "            [-P motif=classe | -P a.b.c.d/n=classe]... [-A vieillissement] [-T trace]\n"
+                            "            [-B min[:max]] [-D]\n"
+                            "Débits en octets/s, suffixes k/M/G acceptés (ex. -g 100M).\n"
+                            "Classe 0 = la plus prioritaire, vieillissement en octets de score par seconde d'attente.\n"
+                            "-T : enregistre les paquets reçus dans une trace (rejouable avec replay).\n"
+                            "-B : tampons de la socket du port %d (octets, k/M), agrandis jusqu'à max en cas de pertes.\n"
+                            "-D : fichiers reçus rangés par contenu (Server/.objects), contenus identiques partagés.\n",
+                    argv[0], TFTP_PORT);
+            exit(EXIT_FAILURE);
         }
-        uint16_t ack_opcode = (((unsigned char)ack[0]) << 8) | ((unsigned char)ack[1]);
-        uint16_t ack_block  = (((unsigned char)ack[2]) << 8) | ((unsigned char)ack[3]);
-        printf("[RRQ] Reçu ACK pour le bloc %d\n", ack_block);
-        if (ack_opcode != OP_ACK || ack_block != block) {
-            printf("[RRQ] ACK inattendu : opcode %d, bloc %d\n", ack_opcode, ack_block);
-            continue;
-        }
-        block++;
-        if (nread < DATA_SIZE)
-            finished = 1;
     }
-    fclose(fp);
-    close(sock_thread);
-    printf("[RRQ] Transfert terminé pour '%s'\n", filename);
-    free(targs);
-    pthread_exit(NULL);
-}
-
-int main(void) {
+    shaper_init(&shaper, global_rate, client_rate, subnet_rate, prefix);
     struct stat st = {0};
     if (stat("Server", &st) == -1) {
         if(mkdir("Server", 0777) < 0) {
@@ -254,6 +533,16 @@ int main(void) {
         perror("bind");
         exit(EXIT_FAILURE);
     }
+    // Pertes noyau comptées, tampon agrandi au besoin (option -B)
+    sockbuf_t listen_buf;
+    char name[48];
+    snprintf(name, sizeof(name), "port %d", TFTP_PORT);
+    sockbuf_init(&listen_buf, sockfd, name, sockbuf_policy.min);
+    if (tftp_trace.fp) {
+        // Trace (-T) : réveil régulier pour l'écrire même sans trafic, et pour s'arrêter sur SIGINT/SIGTERM
+        struct timeval tv = { 0, (suseconds_t)(TRACE_FLUSH * 1e6) };
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
     printf("Serveur TFTP démarré sur le port %d\n", TFTP_PORT);
 
     while (1) {
@@ -263,38 +552,38 @@ int main(void) {
             continue;
         }
         args->addr_len = client_len;
-        args->received_bytes = recvfrom(sockfd, args->buffer, BUFFER_SIZE, 0,
-                                        (struct sockaddr *)&client_addr, &client_len);
+        PROF_BEGIN(t_recv);
+        args->received_bytes = sockbuf_recvfrom(&listen_buf, args->buffer, BUFFER_SIZE, 0,
+                                                (struct sockaddr *)&client_addr, &client_len);
+        PROF_END(PROF_RECV, t_recv);
+        sockbuf_poll(&listen_buf);
+        trace_tick();
         if (args->received_bytes < 0) {
-            perror("recvfrom");
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                perror("recvfrom");
             free(args);
             continue;
         }
+        trace_record(&client_addr, args->buffer, args->received_bytes);
         args->client_addr = client_addr;
         args->sock = sockfd;
         
-        uint16_t opcode = (((unsigned char)args->buffer[0]) << 8) | ((unsigned char)args->buffer[1]);
-        pthread_t thread_id;
+        // Seules les requêtes bien formées ouvrent une session
+        tftp_packet_t req;
+        int opcode = tftp_parse(args->buffer, args->received_bytes, &req);
         if (opcode == OP_WRQ) {
             printf("Requête WRQ reçue de %s:%d\n",
                    inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-            if (pthread_create(&thread_id, NULL, handle_wrq, args) != 0) {
-                perror("pthread_create WRQ");
-                free(args);
-            }
+            admit_request(args);
         } else if (opcode == OP_RRQ) {
             printf("Requête RRQ reçue de %s:%d\n",
                    inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
-            if (pthread_create(&thread_id, NULL, handle_rrq, args) != 0) {
-                perror("pthread_create RRQ");
-                free(args);
-            }
+            admit_request(args);
         } else {
             printf("Requête TFTP inconnue (opcode %d) reçue de %s:%d\n",
                    opcode, inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port));
             free(args);
         }
-        pthread_detach(thread_id);
     }
     
     close(sockfd);
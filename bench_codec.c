@@ -0,0 +1,122 @@
+/*
+ * Microbenchmark de tftp_codec.h : coût moyen (ns) d'analyse et de construction
+ * par type de paquet, sur des paquets typiques.
+ *
+ * Avec -m ns, le code de sortie vaut 1 si l'analyse d'un DATA ou d'un ACK
+ * dépasse ce seuil : utilisable comme garde-fou après une modification.
+ *
+ * Compilation : gcc -O2 bench_codec.c -o bench_codec
+ * Utilisation : bench_codec [-n itérations] [-m ns_max]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tftp_codec.h"
+
+#define BENCH_ITERATIONS 20000000L
+#define BENCH_PACKET 1468
+
+static volatile unsigned long sink;     // Empêche le compilateur de supprimer la boucle
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Analyse répétée d'un paquet ; retourne le coût moyen en ns
+static double bench_parse(const unsigned char *pkt, size_t len, long iterations) {
+    tftp_packet_t p = {0};
+    unsigned long acc = 0;
+    double start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        // Le tampon change d'adresse apparente à chaque tour : pas d'analyse sortie de la boucle
+        const unsigned char *b = pkt;
+        __asm__ volatile("" : "+r"(b));
+        acc += tftp_parse(b, len, &p) + p.block + p.len;
+    }
+    double ns = (bench_now() - start) * 1e9 / iterations;
+    sink += acc;
+    return ns;
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = BENCH_ITERATIONS;
+    double max_ns = 0;
+    int c;
+    while ((c = getopt(argc, argv, "n:m:")) != -1) {
+        switch (c) {
+        case 'n': iterations = atol(optarg); break;
+        case 'm': max_ns = atof(optarg); break;
+        default:
+            fprintf(stderr, "Utilisation : %s [-n itérations] [-m ns_max]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < 1)
+        iterations = 1;
+
+    unsigned char data[BENCH_PACKET], ack[TFTP_HEADER], rrq[512], oack[128], err[128];
+    memset(data, 0xA5, sizeof(data));
+    tftp_put_header(data, OP_DATA, 4242);
+    tftp_put_ack(ack, 4242);
+    size_t rrq_len = tftp_put_request(rrq, sizeof(rrq), OP_RRQ, "images/pxelinux.0", "octet");
+    rrq_len = tftp_put_option(rrq, sizeof(rrq), rrq_len, "blksize", "1428");
+    rrq_len = tftp_put_option(rrq, sizeof(rrq), rrq_len, "windowsize", "16");
+    rrq_len = tftp_put_option(rrq, sizeof(rrq), rrq_len, "tsize", "0");
+    size_t oack_len = tftp_put_oack(oack, sizeof(oack));
+    oack_len = tftp_put_option(oack, sizeof(oack), oack_len, "blksize", "1428");
+    oack_len = tftp_put_option(oack, sizeof(oack), oack_len, "tsize", "26843545");
+    size_t err_len = tftp_put_error(err, sizeof(err), 1, "File not found");
+
+    struct {
+        const char *name;
+        const unsigned char *pkt;
+        size_t len;
+    } cases[] = {
+        { "DATA", data, sizeof(data) },
+        { "ACK", ack, sizeof(ack) },
+        { "ERROR", err, err_len },
+        { "RRQ+options", rrq, rrq_len },
+        { "OACK", oack, oack_len },
+    };
+    int ncases = sizeof(cases) / sizeof(cases[0]);
+    double worst_fast = 0;
+    printf("%-14s %10s\n", "Analyse", "ns/paquet");
+    for (int i = 0; i < ncases; i++) {
+        double ns = bench_parse(cases[i].pkt, cases[i].len, iterations);
+        printf("%-14s %10.2f\n", cases[i].name, ns);
+        if (i < 2 && ns > worst_fast)
+            worst_fast = ns;
+    }
+
+    // Construction : en-tête DATA dans un iovec, ACK
+    struct iovec iov[2];
+    unsigned char hdr[TFTP_HEADER];
+    unsigned long acc = 0;
+    double start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        acc += tftp_data_iov(iov, hdr, (uint16_t)i, data + TFTP_HEADER, sizeof(data) - TFTP_HEADER);
+        __asm__ volatile("" : : "r"(hdr) : "memory");
+    }
+    double data_ns = (bench_now() - start) * 1e9 / iterations;
+    start = bench_now();
+    for (long i = 0; i < iterations; i++) {
+        acc += tftp_put_ack(ack, (uint16_t)i);
+        __asm__ volatile("" : : "r"(ack) : "memory");
+    }
+    double ack_ns = (bench_now() - start) * 1e9 / iterations;
+    sink += acc;
+    printf("%-14s %10s\n", "Construction", "ns/paquet");
+    printf("%-14s %10.2f\n", "DATA (iovec)", data_ns);
+    printf("%-14s %10.2f\n", "ACK", ack_ns);
+
+    if (max_ns > 0 && worst_fast > max_ns) {
+        printf("Seuil dépassé : %.2f ns > %.2f ns\n", worst_fast, max_ns);
+        return 1;
+    }
+    return 0;
+}
@@ -4,7 +4,15 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
 
 #define SERVER_PORT 6969      
 #define PACKET_SIZE 516
@@ -17,6 +25,18 @@
 #define OP_DATA 3 
 #define OP_ACK 4 
 #define OP_ERROR 5 
+#define OP_OACK 6
+
+// Mode rapide
+#define MAX_BLKSIZE 65464
+#define FAST_BLKSIZE 1428           // Tient dans une trame Ethernet de 1500 octets
+#define FAST_WINDOWSIZE 16
+#define BATCH_SIZE (1 << 20)        // Les données reçues sont écrites par lots d'1 Mio
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+#include "tftp_client.h"
 
 // Configure un timeout de réception sur la socket
 void set_timeout(int sock) {
@@ -24,12 +44,21 @@ void set_timeout(int sock) {
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 }
 
-// Construit et envoie la requête initiale (WRQ ou RRQ)
-void send_request(int sock, struct sockaddr_in *server_addr, const char *filename, int opcode) {
-    char buffer[PACKET_SIZE];
+// Construit et envoie la requête initiale (WRQ ou RRQ), avec l'option offset si une reprise est demandée
+void send_request(int sock, struct sockaddr_in *server_addr, const char *filename, int opcode, long long offset) {
+    unsigned char buffer[PACKET_SIZE];
     // Construit le paquet : 0, opcode, nom_du_fichier, 0, "octet", 0
-    // Attention : ici sprintf est utilisé pour simplifier, mais dans un contexte binaire il faut veiller aux caractères NUL.
-    int len = sprintf(buffer, "%c%c%s%c%s%c", 0, opcode, filename, 0, "octet", 0);
+    size_t len = tftp_put_request(buffer, sizeof(buffer), opcode, filename, "octet");
+    if (offset > 0) {
+        char value[24];
+        snprintf(value, sizeof(value), "%lld", offset);
+        len = tftp_put_option(buffer, sizeof(buffer), len, RESUME_OPTION, value);
+        len = tftp_put_option(buffer, sizeof(buffer), len, "tsize", "0");    // Taille finale vérifiée
+    }
+    if (len == 0) {
+        fprintf(stderr, "Nom de fichier trop long\n");
+        return;
+    }
     
     printf("Envoi de la requête %s pour le fichier : %s\n",
            (opcode == OP_WRQ) ? "WRQ" : "RRQ", filename);
@@ -37,8 +66,14 @@ void send_request(int sock, struct sockaddr_in *server_addr, const char *filenam
     sendto(sock, buffer, len, 0, (struct sockaddr *)server_addr, sizeof(*server_addr));
 }
 
-// Pour une requête de lecture (RRQ) : réception et écriture dans le fichier local.
-void receive_file(int sock, struct sockaddr_in *server_addr, const char *filename) {
+// Confirme un bloc sur une socket connectée
+void send_ack(int sock, unsigned block) {
+    unsigned char ack[TFTP_HEADER];
+    send(sock, ack, tftp_put_ack(ack, block), 0);
+}
+
+// Pour une requête de lecture (RRQ) : réception et écriture dans le fichier local (à partir de offset en reprise).
+void receive_file(int sock, struct sockaddr_in *server_addr, const char *filename, long long offset) {
     char buffer[PACKET_SIZE];
     socklen_t addr_len = sizeof(*server_addr);
     
@@ -51,12 +86,18 @@ void receive_file(int sock, struct sockaddr_in *server_addr, const char *filenam
     }
     
     // Vérifier si le paquet est une erreur (OP_ERROR)
-    uint16_t opcode = (((unsigned char)buffer[0]) << 8) | ((unsigned char)buffer[1]);
+    tftp_packet_t pkt;
+    int opcode = tftp_parse(buffer, bytes_received, &pkt);
     if (opcode == OP_ERROR) {
-        uint16_t error_code = (((unsigned char)buffer[2]) << 8) | ((unsigned char)buffer[3]);
-        fprintf(stderr, "Erreur du serveur: code %d, message: %s\n", error_code, buffer + 4);
+        fprintf(stderr, "Erreur du serveur: code %d, message: %.*s\n", pkt.block, (int)pkt.len, pkt.data);
         return;
     }
+    // Reprise acceptée seulement si le serveur confirme la position demandée
+    const char *resumed = opcode == OP_OACK ? tftp_option(&pkt, RESUME_OPTION) : NULL;
+    if (!resumed || atoll(resumed) != offset)
+        offset = 0;
+    const char *announced = opcode == OP_OACK ? tftp_option(&pkt, "tsize") : NULL;
+    long long tsize = announced ? atoll(announced) : -1, received = 0;
     
     // Mise à jour de la connexion : on se connecte sur la socket au port indiqué par le serveur
     if (connect(sock, (struct sockaddr *)server_addr, addr_len) < 0) {
@@ -65,39 +106,71 @@ void receive_file(int sock, struct sockaddr_in *server_addr, const char *filenam
     }
     printf("Connexion établie vers %s:%d\n", inet_ntoa(server_addr->sin_addr), ntohs(server_addr->sin_port));
     
-    // Ouvre le fichier local en écriture
-    FILE *file = fopen(filename, "wb");
-    if (!file) {
+    // Ouvre le fichier local en écriture (à la suite des octets déjà reçus en cas de reprise)
+    FILE *file = offset ? fopen(filename, "r+b") : fopen(filename, "wb");
+    if (!file || (offset && fseeko(file, offset, SEEK_SET) < 0)) {
         perror("fopen (RRQ fichier local)");
+        if (file)
+            fclose(file);
         return;
     }
+    if (opcode == OP_OACK) {
+        // Le bloc 1 suit l'ACK 0, répété si le serveur ne répond pas
+        int retries = 0;
+        do {
+            send_ack(sock, 0);
+            bytes_received = recv(sock, buffer, PACKET_SIZE, 0);
+        } while (bytes_received < 4 && ++retries < MAX_RETRIES);
+        if (bytes_received < 4) {
+            fprintf(stderr, "Pas de données après l'OACK\n");
+            fclose(file);
+            return;
+        }
+        if (offset)
+            printf("Reprise à l'octet %lld\n", offset);
+    }
     
     int block = 1;
     do {
-        uint16_t block_received = (((unsigned char)buffer[2]) << 8) | ((unsigned char)buffer[3]);
+        tftp_parse(buffer, bytes_received, &pkt);
+        uint16_t block_received = pkt.block;
         printf("Reçu bloc %d avec %d octets\n", block_received, bytes_received - 4);
-        fwrite(buffer + 4, 1, bytes_received - 4, file);
-        fflush(file);
+        if (block_received != (uint16_t)block) {
+            // Doublon (notre ACK s'est perdu) : on le confirme à nouveau sans l'écrire
+            send_ack(sock, block_received);
+            printf("Bloc %d inattendu (attendu %d), ignoré\n", block_received, (uint16_t)block);
+            bytes_received = recv(sock, buffer, PACKET_SIZE, 0);
+            if (bytes_received < 4) {
+                perror("recv (RRQ DATA)");
+                break;
+            }
+            continue;
+        }
+        fwrite(pkt.data, 1, pkt.len, file);
+        received += pkt.len;
         
         // Prépare et envoie l'ACK pour le bloc reçu
-        unsigned char ack[4] = {0, OP_ACK, buffer[2], buffer[3]};
-        send(sock, ack, 4, 0);
+        send_ack(sock, block_received);
         printf("Envoi de l'ACK pour le bloc %d\n", block_received);
         
         // Si la taille des données est inférieure à DATA_SIZE, c'est le dernier bloc.
-        if ((bytes_received - 4) < DATA_SIZE)
+        if (pkt.len < DATA_SIZE)
             break;
         
         // Réception du bloc suivant (la socket est connectée, on utilise recv())
         bytes_received = recv(sock, buffer, PACKET_SIZE, 0);
-        if (bytes_received < 0) {
+        if (bytes_received < 4) {
             perror("recv (RRQ DATA)");
             break;
         }
         block++;
     } while (1);
     
-    printf("Réception du fichier terminée.\n");
+    if (tsize >= 0 && offset + received != tsize)
+        fprintf(stderr, "Fichier reçu de %lld octets au lieu de %lld (tsize) : transfert à refaire\n",
+                offset + received, tsize);
+    else
+        printf("Réception du fichier terminée.\n");
     fclose(file);
 }
 
@@ -112,10 +185,11 @@ void send_data(int sock, struct sockaddr_in *server_addr, FILE *file) {
     retries = 0;
     while (1) {
         int ret = recvfrom(sock, ack, sizeof(ack), 0, (struct sockaddr *)server_addr, &addr_len);
+        tftp_packet_t pkt;
         if (ret >= 4) {
             // Si c'est un paquet d'erreur, l'afficher et quitter
-            if ( (unsigned char)ack[1] == OP_ERROR ) {
-                fprintf(stderr, "Erreur du serveur : %s\n", ack + 4);
+            if (tftp_parse(ack, ret, &pkt) == OP_ERROR) {
+                fprintf(stderr, "Erreur du serveur : %.*s\n", (int)pkt.len, pkt.data);
                 return;
             }
             // Si le paquet vient du port bien connu, on l'ignore
@@ -141,20 +215,18 @@ void send_data(int sock, struct sockaddr_in *server_addr, FILE *file) {
     }
     
     while ((bytes_read = fread(buffer + 4, 1, DATA_SIZE, file)) > 0) {
-        buffer[0] = 0;
-        buffer[1] = OP_DATA;
-        buffer[2] = (block >> 8) & 0xFF;
-        buffer[3] = block & 0xFF;
+        tftp_put_header((unsigned char *)buffer, OP_DATA, block);
 
         retries = 0;
         do {
             send(sock, buffer, bytes_read + 4, 0);
             printf("Envoi du bloc %d (%d octets)\n", block, bytes_read);
             int ret = recv(sock, ack, sizeof(ack), 0);
+            tftp_packet_t pkt;
             if (ret >= 4) {
                 // Vérifier si on a reçu un paquet d'erreur
-                if ((unsigned char)ack[1] == OP_ERROR) {
-                    fprintf(stderr, "Erreur du serveur lors de l'envoi du bloc %d : %s\n", block, ack + 4);
+                if (tftp_parse(ack, ret, &pkt) == OP_ERROR) {
+                    fprintf(stderr, "Erreur du serveur lors de l'envoi du bloc %d : %.*s\n", block, (int)pkt.len, pkt.data);
                     return;
                 }
                 break;
@@ -174,11 +246,563 @@ void send_data(int sock, struct sockaddr_in *server_addr, FILE *file) {
 }
 
 
+/*
+ * Mode rapide (-f) : options RFC 2347/2348/2349/7440 (blksize, windowsize, tsize).
+ * Réception par fenêtres avec tampon de réordonnancement, écriture par lots
+ * avec pwrite et préallocation du fichier d'après tsize.
+ */
+
+// Envoie la requête et attend la première réponse (OACK, DATA, ACK ou ERROR), la requête est répétée en cas de timeout
+int first_response(int sock, struct sockaddr_in *server_addr, const char *req, int req_len, char *buffer, int cap) {
+    socklen_t addr_len = sizeof(*server_addr);
+    struct sockaddr_in well_known = *server_addr;
+    for (int retries = 0; retries <= MAX_RETRIES; retries++) {
+        sendto(sock, req, req_len, 0, (struct sockaddr *)&well_known, sizeof(well_known));
+        int n = recvfrom(sock, buffer, cap, 0, (struct sockaddr *)server_addr, &addr_len);
+        if (n >= 4)
+            return n;
+        printf("Pas de réponse à la requête, tentative %d/%d\n", retries + 1, MAX_RETRIES);
+    }
+    return -1;
+}
+
+double elapsed_since(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// RRQ rapide : réception par fenêtres dans un tampon de réordonnancement écrit par lots
+int receive_file_fast(int sock, struct sockaddr_in *server_addr, const char *filename, options_t opt) {
+    char req[PACKET_SIZE];
+    int req_len = build_request(req, sizeof(req), OP_RRQ, filename, &opt);
+    if (req_len < 0) {
+        fprintf(stderr, "Nom de fichier trop long\n");
+        return -1;
+    }
+    printf("Envoi de la requête RRQ (blksize %d, windowsize %d) pour le fichier : %s\n",
+           opt.blksize, opt.windowsize, filename);
+    long long requested = opt.offset;   // Remplacé par la valeur négociée
+
+    char *packet = malloc(MAX_BLKSIZE + 4);
+    if (!packet)
+        return -1;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n = first_response(sock, server_addr, req, req_len, packet, MAX_BLKSIZE + 4);
+    if (n < 0) {
+        fprintf(stderr, "Pas de réponse du serveur\n");
+        free(packet);
+        return -1;
+    }
+    tftp_packet_t pkt;
+    int opcode = tftp_parse(packet, n, &pkt);
+    if (opcode == OP_ERROR) {
+        fprintf(stderr, "Erreur du serveur: code %d, message: %.*s\n", pkt.block, (int)pkt.len, pkt.data);
+        free(packet);
+        return -1;
+    }
+    int have_packet = 0;
+    if (opcode == OP_OACK) {
+        options_from_oack(&pkt, &opt);
+    } else {
+        // Serveur sans options : 512 octets, un bloc à la fois, taille inconnue
+        opt.blksize = DATA_SIZE;
+        opt.windowsize = 1;
+        opt.tsize = -1;
+        have_packet = 1;
+    }
+    if (connect(sock, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+        perror("connect (RRQ)");
+        free(packet);
+        return -1;
+    }
+    printf("Connexion établie vers %s:%d (blksize %d, windowsize %d, tsize %lld)\n",
+           inet_ntoa(server_addr->sin_addr), ntohs(server_addr->sin_port), opt.blksize, opt.windowsize, opt.tsize);
+
+    // Reprise : seulement à la position demandée, sinon le fichier local repart de zéro
+    if (have_packet || opt.offset != requested)
+        opt.offset = 0;
+    int fd = open(filename, O_WRONLY | O_CREAT | (opt.offset ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        perror("open (RRQ fichier local)");
+        free(packet);
+        return -1;
+    }
+    if (opt.offset)
+        printf("Reprise à l'octet %lld\n", opt.offset);
+    // Préallocation : évite la fragmentation et les allocations au fil des écritures. La taille
+    // apparente ne bouge pas : un client tué en cours de route laisse les seuls octets reçus (-R).
+    // Appel système direct : fallocate() n'est déclarée qu'avec _GNU_SOURCE.
+    if (opt.tsize > 0 && syscall(SYS_fallocate, fd, FALLOC_FL_KEEP_SIZE, (off_t)0, (off_t)opt.tsize) < 0)
+        printf("Préallocation de %lld octets impossible, on continue sans\n", opt.tsize);
+
+    // Tampon de réordonnancement : nslots blocs consécutifs à partir du bloc base
+    long nslots = BATCH_SIZE / opt.blksize;
+    if (nslots < 2L * opt.windowsize)
+        nslots = 2L * opt.windowsize;
+    char *staging = malloc((size_t)nslots * opt.blksize);
+    char *received = calloc(nslots, 1);
+    if (!staging || !received) {
+        perror("malloc");
+        free(staging);
+        free(received);
+        free(packet);
+        close(fd);
+        return -1;
+    }
+
+    long long base = 1;         // Numéro absolu du bloc en tête du tampon
+    long long next = 1;         // Premier bloc manquant
+    long long acked = 0;        // Dernier bloc confirmé
+    long long final_block = 0;  // Numéro du dernier bloc (connu à sa réception)
+    int final_len = 0, retries = 0, status = -1;
+    long long out_of_order = 0, duplicates = 0;
+
+    if (!have_packet)
+        send_ack(sock, 0);
+    while (1) {
+        if (!have_packet) {
+            n = recv(sock, packet, MAX_BLKSIZE + 4, 0);
+            if (n < 0) {
+                if (++retries > MAX_RETRIES) {
+                    fprintf(stderr, "Abandon : plus de données du serveur (bloc %lld attendu)\n", next);
+                    break;
+                }
+                printf("Timeout, nouvel ACK du bloc %lld (%d/%d)\n", next - 1, retries, MAX_RETRIES);
+                send_ack(sock, (unsigned)(next - 1));
+                acked = next - 1;
+                continue;
+            }
+        }
+        have_packet = 0;
+        opcode = tftp_parse(packet, n, &pkt);
+        if (opcode == OP_ERROR) {
+            fprintf(stderr, "Erreur du serveur: code %d, message: %.*s\n", pkt.block, (int)pkt.len, pkt.data);
+            break;
+        }
+        if (opcode != OP_DATA)
+            continue;
+        retries = 0;
+
+        // Numéro absolu du bloc (les numéros sur 16 bits reviennent à 0)
+        long long abs_block = next + (int16_t)(pkt.block - (uint16_t)next);
+        int dlen = pkt.len;
+        if (abs_block < next) {
+            duplicates++;
+            if (abs_block == next - 1)      // Notre ACK s'est sans doute perdu
+                send_ack(sock, (unsigned)(next - 1));
+            continue;
+        }
+        if (abs_block >= base + nslots)     // Trop loin devant : sera renvoyé
+            continue;
+        long slot = abs_block - base;
+        if (!received[slot]) {
+            if (abs_block != next)
+                out_of_order++;
+            memcpy(staging + slot * opt.blksize, pkt.data, dlen);
+            received[slot] = 1;
+            if (dlen < opt.blksize) {
+                final_block = abs_block;
+                final_len = dlen;
+            }
+        }
+        while (next < base + nslots && received[next - base] && (!final_block || next <= final_block))
+            next++;
+        int done = final_block && next > final_block;
+
+        // Écriture par lot quand le tampon est plein et contigu, ou en fin de transfert
+        if (done || next == base + nslots) {
+            size_t bytes = (size_t)(next - base) * opt.blksize;
+            if (done)
+                bytes -= opt.blksize - final_len;
+            if (pwrite(fd, staging, bytes, opt.offset + (base - 1) * opt.blksize) != (ssize_t)bytes) {
+                perror("pwrite");
+                break;
+            }
+            memset(received, 0, nslots);
+            base = next;
+        }
+        if (done) {
+            send_ack(sock, (unsigned)final_block);
+            status = 0;
+            break;
+        }
+        // Fin de fenêtre : on confirme le dernier bloc reçu dans l'ordre
+        if (abs_block >= acked + opt.windowsize) {
+            send_ack(sock, (unsigned)(next - 1));
+            acked = next - 1;
+        }
+    }
+
+    if (status == 0) {
+        long long total = (final_block - 1) * opt.blksize + final_len;
+        if (ftruncate(fd, opt.offset + total) < 0)
+            perror("ftruncate");
+        double secs = elapsed_since(&start);
+        if (opt.tsize >= 0 && opt.offset + total != opt.tsize) {
+            // Reprise sur un fichier local faux, fichier modifié pendant le transfert...
+            fprintf(stderr, "Fichier reçu de %lld octets au lieu de %lld (tsize) : transfert à refaire\n",
+                    opt.offset + total, opt.tsize);
+            status = -1;
+        } else {
+            printf("Réception du fichier terminée : %lld octets en %.3f s (%.1f Mo/s), %lld hors ordre, %lld doublons.\n",
+                   total, secs, secs > 0 ? total / secs / 1e6 : 0, out_of_order, duplicates);
+        }
+    } else {
+        // Échec : le fichier garde les blocs reçus dans l'ordre (repris par -R), pas la préallocation
+        long long kept = (next - 1) * opt.blksize;
+        size_t staged = (size_t)(next - base) * opt.blksize;
+        if (staged && pwrite(fd, staging, staged, opt.offset + (base - 1) * opt.blksize) != (ssize_t)staged)
+            kept = (base - 1) * opt.blksize;
+        if (ftruncate(fd, opt.offset + kept) < 0)
+            perror("ftruncate");
+    }
+    close(fd);
+    free(staging);
+    free(received);
+    free(packet);
+    return status;
+}
+
+// WRQ rapide : envoi par fenêtres, chaque fenêtre lue d'un seul pread
+int send_data_fast(int sock, struct sockaddr_in *server_addr, const char *filename, options_t opt) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Erreur ouverture fichier");
+        return -1;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    opt.tsize = st.st_size;
+
+    char req[PACKET_SIZE];
+    int req_len = build_request(req, sizeof(req), OP_WRQ, filename, &opt);
+    if (req_len < 0) {
+        fprintf(stderr, "Nom de fichier trop long\n");
+        close(fd);
+        return -1;
+    }
+    printf("Envoi de la requête WRQ (blksize %d, windowsize %d, tsize %lld) pour le fichier : %s\n",
+           opt.blksize, opt.windowsize, opt.tsize, filename);
+
+    char reply[PACKET_SIZE];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int n = first_response(sock, server_addr, req, req_len, reply, sizeof(reply));
+    tftp_packet_t pkt;
+    int opcode = n < 0 ? -1 : tftp_parse(reply, n, &pkt);
+    if (opcode == OP_OACK) {
+        options_from_oack(&pkt, &opt);
+    } else if (opcode == OP_ACK) {
+        opt.blksize = DATA_SIZE;
+        opt.windowsize = 1;
+    } else {
+        if (opcode == OP_ERROR)
+            fprintf(stderr, "Erreur du serveur : %.*s\n", (int)pkt.len, pkt.data);
+        else
+            fprintf(stderr, "Pas de réponse valide du serveur\n");
+        close(fd);
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr *)server_addr, sizeof(*server_addr)) < 0) {
+        perror("connect (WRQ)");
+        close(fd);
+        return -1;
+    }
+    printf("Connexion établie vers %s:%d (blksize %d, windowsize %d)\n",
+           inet_ntoa(server_addr->sin_addr), ntohs(server_addr->sin_port), opt.blksize, opt.windowsize);
+
+    // Le dernier bloc est toujours plus court que blksize (éventuellement vide)
+    long long total_blocks = st.st_size / opt.blksize + 1;
+    char *window = malloc((size_t)opt.windowsize * opt.blksize);
+    if (!window) {
+        perror("malloc");
+        close(fd);
+        return -1;
+    }
+    long long acked = 0;
+    int retries = 0, status = -1;
+    while (acked < total_blocks) {
+        long long first = acked + 1;
+        long long last = acked + opt.windowsize < total_blocks ? acked + opt.windowsize : total_blocks;
+        ssize_t avail = pread(fd, window, (size_t)(last - first + 1) * opt.blksize, (first - 1) * opt.blksize);
+        if (avail < 0) {
+            perror("pread");
+            break;
+        }
+        for (long long b = first; b <= last; b++) {
+            size_t off = (size_t)(b - first) * opt.blksize;
+            size_t len = (ssize_t)off >= avail ? 0 : (size_t)avail - off;
+            if (len > (size_t)opt.blksize)
+                len = opt.blksize;
+            unsigned char hdr[TFTP_HEADER];
+            struct iovec iov[2];
+            writev(sock, iov, tftp_data_iov(iov, hdr, b, window + off, len));
+        }
+
+        /*
+         * Attente de l'ACK de la fenêtre (ou d'un ACK partiel si le serveur a
+         * perdu un bloc). Seul le timeout provoque un renvoi : un ACK en double
+         * ou périmé, ou un autre paquet, ne fait que prolonger l'attente
+         * jusqu'à l'échéance (sinon chaque doublon coûterait une fenêtre entière).
+         */
+        double deadline = mono_now() + TIMEOUT;
+        int advanced = 0, failed = 0;
+        while (!advanced && !failed) {
+            double left = deadline - mono_now();
+            struct timeval tv = { (time_t)left, (suseconds_t)((left - (time_t)left) * 1e6) };
+            if (left <= 0 || setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+                break;
+            n = recv(sock, reply, sizeof(reply), 0);
+            if (n < 0 && errno != EINTR)
+                break;
+            if (n < 4)
+                continue;
+            opcode = tftp_parse(reply, n, &pkt);
+            if (opcode == OP_ERROR) {
+                fprintf(stderr, "Erreur du serveur lors de l'envoi du bloc %lld : %.*s\n", first, (int)pkt.len, pkt.data);
+                failed = 1;
+            } else if (opcode == OP_ACK) {
+                long long abs_block = acked + (int16_t)(pkt.block - (uint16_t)acked);
+                if (abs_block > acked && abs_block <= last) {
+                    acked = abs_block;
+                    retries = 0;
+                    advanced = 1;
+                }
+            }
+        }
+        if (failed)
+            break;
+        if (!advanced) {
+            if (++retries > MAX_RETRIES) {
+                fprintf(stderr, "Erreur : la fenêtre à partir du bloc %lld n'a pas été confirmée, annulation.\n", first);
+                break;
+            }
+            printf("ACK non reçu, nouvel envoi à partir du bloc %lld (%d/%d)\n", first, retries, MAX_RETRIES);
+        }
+    }
+    if (acked == total_blocks) {
+        double secs = elapsed_since(&start);
+        printf("Transfert de fichier terminé : %lld octets en %.3f s (%.1f Mo/s).\n",
+               (long long)st.st_size, secs, secs > 0 ? st.st_size / secs / 1e6 : 0);
+        status = 0;
+    }
+    free(window);
+    close(fd);
+    return status;
+}
+
+
+/*
+ * Mode lot (-m manifeste) : plusieurs transferts, éventuellement vers plusieurs
+ * serveurs, menés en parallèle par une seule boucle epoll.
+ *
+ * Une ligne du manifeste : <IP serveur[:port]> <RRQ|WRQ> <fichier> [fichier local]
+ * (lignes vides et commentaires '#' ignorés). Chaque transfert est une machine à
+ * états non bloquante avec sa propre socket ; un transfert échoué est relancé
+ * depuis le début jusqu'à -r tentatives, puis un bilan est affiché.
+ */
+#define BATCH_CONCURRENCY 8
+#define BATCH_ATTEMPTS 3
+#define BATCH_EVENTS 64
+
+// Charge le manifeste, retourne le nombre de transferts (-1 en cas d'erreur)
+int load_manifest(const char *path, transfer_t **list) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("fopen (manifeste)");
+        return -1;
+    }
+    char line[1024];
+    int n = 0, cap = 0, lineno = 0;
+    *list = NULL;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char host[64], op[8], name[256], local[256] = "";
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\0')
+            continue;
+        if (sscanf(p, "%63s %7s %255s %255s", host, op, name, local) < 3 ||
+            (strcmp(op, "RRQ") != 0 && strcmp(op, "WRQ") != 0)) {
+            fprintf(stderr, "Manifeste ligne %d invalide, ignorée\n", lineno);
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            transfer_t *grown = realloc(*list, cap * sizeof(transfer_t));
+            if (!grown) {
+                perror("realloc");
+                break;
+            }
+            *list = grown;
+        }
+        transfer_t *t = &(*list)[n];
+        memset(t, 0, sizeof(*t));
+        t->server.sin_family = AF_INET;
+        t->server.sin_port = htons(SERVER_PORT);
+        char *colon = strchr(host, ':');
+        if (colon) {
+            *colon = '\0';
+            t->server.sin_port = htons(atoi(colon + 1));
+        }
+        if (inet_pton(AF_INET, host, &t->server.sin_addr) != 1) {
+            fprintf(stderr, "Manifeste ligne %d : adresse %s invalide, ignorée\n", lineno, host);
+            continue;
+        }
+        t->opcode = strcmp(op, "WRQ") == 0 ? OP_WRQ : OP_RRQ;
+        snprintf(t->filename, sizeof(t->filename), "%s", name);
+        snprintf(t->local, sizeof(t->local), "%s", local[0] ? local : name);
+        t->sock = t->fd = -1;
+        t->state = T_PENDING;
+        n++;
+    }
+    fclose(f);
+    return n;
+}
+
+int run_batch(const char *manifest, const options_t *opt, int fast, int concurrency, int max_attempts) {
+    transfer_t *list;
+    int n = load_manifest(manifest, &list);
+    if (n <= 0) {
+        fprintf(stderr, "Manifeste vide ou illisible\n");
+        return 1;
+    }
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    // File des transferts à (re)lancer, dans l'ordre du manifeste
+    int *queue = malloc(n * sizeof(int));
+    transfer_t **active = calloc(concurrency, sizeof(transfer_t *));
+    if (!queue || !active) {
+        perror("malloc");
+        return 1;
+    }
+    int q_head = 0, q_len = n, nactive = 0, finished = 0;
+    for (int i = 0; i < n; i++)
+        queue[i] = i;
+    unsigned char *pkt = malloc(MAX_BLKSIZE + 4);
+    double start = mono_now();
+    printf("Lot de %d transferts, %d en parallèle\n", n, concurrency);
+
+    while (finished < n) {
+        double now = mono_now();
+        while (nactive < concurrency && q_len > 0) {
+            transfer_t *t = &list[queue[q_head]];
+            q_head = (q_head + 1) % n;
+            q_len--;
+            transfer_begin(t, epfd, opt, fast, now);
+            active[nactive++] = t;
+        }
+
+        // Attente jusqu'au premier timer
+        double next = now + TIMEOUT;
+        for (int i = 0; i < nactive; i++)
+            if (active[i]->state <= T_TRANSFER && active[i]->deadline < next)
+                next = active[i]->deadline;
+        int wait_ms = next > now ? (int)((next - now) * 1000) + 1 : 0;
+        struct epoll_event events[BATCH_EVENTS];
+        int ready = epoll_wait(epfd, events, BATCH_EVENTS, wait_ms);
+        if (ready < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        now = mono_now();
+        for (int i = 0; i < ready; i++) {
+            transfer_t *t = events[i].data.ptr;
+            while (t->sock >= 0) {
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                int len = recvfrom(t->sock, pkt, MAX_BLKSIZE + 4, 0, (struct sockaddr *)&from, &from_len);
+                if (len < 0)
+                    break;
+                transfer_input(t, pkt, len, &from, now);
+            }
+        }
+
+        // Timers, puis fin des transferts terminés (relancés s'il reste des tentatives)
+        for (int i = 0; i < nactive; i++) {
+            transfer_t *t = active[i];
+            if (t->state <= T_TRANSFER && t->deadline <= now)
+                transfer_timeout(t, now);
+            if (t->state < T_DONE)
+                continue;
+            active[i--] = active[--nactive];
+            if (t->state == T_FAILED && !t->fatal && t->attempts < max_attempts) {
+                printf("%s %s : %s, nouvelle tentative (%d/%d)\n", t->opcode == OP_RRQ ? "RRQ" : "WRQ",
+                       t->filename, t->error, t->attempts + 1, max_attempts);
+                t->state = T_PENDING;
+                queue[(q_head + q_len++) % n] = t - list;
+                continue;
+            }
+            t->elapsed = now - t->started;
+            finished++;
+        }
+    }
+
+    // Bilan
+    double total_time = mono_now() - start;
+    long long total_bytes = 0;
+    int ok = 0;
+    printf("\nBilan :\n");
+    for (int i = 0; i < n; i++) {
+        transfer_t *t = &list[i];
+        char resumed[48] = "";
+        if (t->offset)
+            snprintf(resumed, sizeof(resumed), " (reprise à l'octet %lld)", t->offset);
+        printf("  %-5s %s:%d %s %s : %lld octets%s en %.3f s, %d tentative(s)%s%s\n",
+               t->state == T_DONE ? "OK" : "ÉCHEC", inet_ntoa(t->server.sin_addr), ntohs(t->server.sin_port),
+               t->opcode == OP_RRQ ? "RRQ" : "WRQ", t->filename, t->bytes, resumed, t->elapsed, t->attempts,
+               t->state == T_DONE ? "" : " - ", t->state == T_DONE ? "" : t->error);
+        if (t->state == T_DONE) {
+            ok++;
+            total_bytes += t->bytes;
+        }
+    }
+    printf("Lot terminé : %d/%d transferts réussis, %lld octets en %.3f s (%.1f Mo/s).\n",
+           ok, n, total_bytes, total_time, total_time > 0 ? total_bytes / total_time / 1e6 : 0);
+    close(epfd);
+    free(pkt);
+    free(queue);
+    free(active);
+    free(list);
+    return ok == n ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
-    if (argc != 4) {
-        printf("Utilisation : %s <IP serveur> <WRQ|RRQ> <fichier>\n", argv[0]);
+    options_t opt = { FAST_BLKSIZE, FAST_WINDOWSIZE, 0, 0, 0 };
+    int fast = 0, c;
+    const char *manifest = NULL;
+    int concurrency = BATCH_CONCURRENCY, attempts = BATCH_ATTEMPTS;
+    while ((c = getopt(argc, argv, "fRb:w:m:j:r:")) != -1) {
+        switch (c) {
+        case 'f': fast = 1; break;
+        case 'R': opt.resume = 1; break;
+        case 'm': manifest = optarg; break;
+        case 'j': concurrency = atoi(optarg); break;
+        case 'r': attempts = atoi(optarg); break;
+        case 'b': fast = 1; opt.blksize = atoi(optarg); break;
+        case 'w': fast = 1; opt.windowsize = atoi(optarg); break;
+        default: argc = 0; break;
+        }
+    }
+    if ((manifest ? argc - optind != 0 : argc - optind != 3) || opt.blksize < 8 || opt.blksize > MAX_BLKSIZE ||
+        opt.windowsize < 1 || concurrency < 1 || attempts < 1) {
+        printf("Utilisation : %s [-f] [-R] [-b blksize] [-w windowsize] <IP serveur> <WRQ|RRQ> <fichier>\n"
+               "              %s [-f] [-R] [-b blksize] -m manifeste [-j concurrence] [-r tentatives]\n"
+               "  -f : mode rapide (options blksize/windowsize/tsize, blksize %d et windowsize %d par défaut)\n"
+               "  -R : les RRQ reprennent un fichier local partiel là où il s'arrête (option offset)\n"
+               "  -m : lot de transferts, une ligne \"<IP serveur[:port]> <RRQ|WRQ> <fichier> [fichier local]\" par transfert\n"
+               "  -j : transferts simultanés (%d par défaut), -r : tentatives par transfert (%d par défaut)\n",
+               argv[0], argv[0], FAST_BLKSIZE, FAST_WINDOWSIZE, BATCH_CONCURRENCY, BATCH_ATTEMPTS);
         return 1;
     }
+    if (manifest)
+        return run_batch(manifest, &opt, fast, concurrency, attempts);
+    argv += optind - 1;
     
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
@@ -194,9 +818,19 @@ int main(int argc, char *argv[]) {
     set_timeout(sock);
     
     int opcode = (strcmp(argv[2], "WRQ") == 0) ? OP_WRQ : OP_RRQ;
+    struct stat st;
+    if (opcode == OP_RRQ && opt.resume && stat(argv[3], &st) == 0)
+        opt.offset = st.st_size;    // Octets déjà reçus lors d'un transfert interrompu
+    
+    if (fast) {
+        int status = (opcode == OP_WRQ) ? send_data_fast(sock, &server_addr, argv[3], opt)
+                                        : receive_file_fast(sock, &server_addr, argv[3], opt);
+        close(sock);
+        return status == 0 ? 0 : 1;
+    }
     
     // Envoi de la requête initiale
-    send_request(sock, &server_addr, argv[3], opcode);
+    send_request(sock, &server_addr, argv[3], opcode, opt.offset);
     
     if (opcode == OP_WRQ) {
         // WRQ : envoi du fichier
@@ -209,7 +843,7 @@ int main(int argc, char *argv[]) {
         fclose(file);
     } else {
         // RRQ : réception du fichier
-        receive_file(sock, &server_addr, argv[3]);
+        receive_file(sock, &server_addr, argv[3], opt.offset);
     }
     
     close(sock);
@@ -0,0 +1,168 @@
+/*
+ * Cible de fuzzing de tftp_codec.h.
+ *
+ * Pour chaque entrée : l'analyse ne doit jamais lire hors du paquet, les
+ * chaînes rendues doivent être terminées à l'intérieur, et une requête ou un
+ * OACK reconstruit à partir du résultat doit se relire à l'identique.
+ * Toute violation appelle abort().
+ *
+ * Avec libFuzzer (clang) :
+ *     clang -g -O1 -fsanitize=fuzzer,address,undefined -DFUZZ_LIBFUZZER fuzz_codec.c -o fuzz_codec
+ * Sans libFuzzer, un pilote autonome rejoue les fichiers donnés puis mute
+ * aléatoirement un corpus de paquets valides :
+ *     gcc -g -O1 -fsanitize=address,undefined fuzz_codec.c -o fuzz_codec
+ *     fuzz_codec [-n itérations] [-s graine] [fichier...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "tftp_codec.h"
+
+#define FUZZ_MAX_PACKET 2048
+#define FUZZ_ITERATIONS 1000000L
+
+#define FUZZ_CHECK(cond) do { if (!(cond)) { \
+    fprintf(stderr, "fuzz_codec : %s (ligne %d)\n", #cond, __LINE__); abort(); } } while (0)
+
+// La chaîne s doit commencer dans [b, b + len[ et y être terminée
+static void check_string(const char *s, const uint8_t *b, size_t len) {
+    const uint8_t *u = (const uint8_t *)s;
+    FUZZ_CHECK(u >= b && u < b + len);
+    FUZZ_CHECK(memchr(u, 0, b + len - u) != NULL);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // Copie exacte dans un tas à part : ASan détecte la moindre lecture au-delà
+    uint8_t *b = malloc(size ? size : 1);
+    if (!b)
+        return 0;
+    memcpy(b, data, size);
+
+    tftp_packet_t p;
+    int opcode = tftp_parse(b, size, &p);
+    FUZZ_CHECK(opcode == -1 || (opcode >= OP_RRQ && opcode <= OP_OACK));
+    if (opcode == OP_DATA || opcode == OP_ACK || opcode == OP_ERROR) {
+        FUZZ_CHECK(size >= TFTP_HEADER);
+        FUZZ_CHECK(p.data == b + TFTP_HEADER && p.len <= size - TFTP_HEADER);
+        FUZZ_CHECK(p.block == ((b[2] << 8) | b[3]));
+    }
+    if (opcode == OP_RRQ || opcode == OP_WRQ) {
+        check_string(p.filename, b, size);
+        check_string(p.mode, b, size);
+    }
+    if (opcode == OP_RRQ || opcode == OP_WRQ || opcode == OP_OACK) {
+        FUZZ_CHECK(p.noptions >= 0 && p.noptions <= TFTP_MAX_OPTIONS);
+        for (int i = 0; i < p.noptions; i++) {
+            check_string(p.opt_name[i], b, size);
+            check_string(p.opt_value[i], b, size);
+            FUZZ_CHECK(tftp_option(&p, p.opt_name[i]) != NULL);
+        }
+
+        // Aller-retour : reconstruire, relire, comparer
+        uint8_t out[FUZZ_MAX_PACKET * 2];
+        size_t len = opcode == OP_OACK ? tftp_put_oack(out, sizeof(out))
+                                       : tftp_put_request(out, sizeof(out), opcode, p.filename, p.mode);
+        for (int i = 0; i < p.noptions && len; i++)
+            len = tftp_put_option(out, sizeof(out), len, p.opt_name[i], p.opt_value[i]);
+        if (len) {
+            tftp_packet_t q;
+            FUZZ_CHECK(tftp_parse(out, len, &q) == opcode);
+            FUZZ_CHECK(q.noptions == p.noptions);
+            if (opcode != OP_OACK)
+                FUZZ_CHECK(strcmp(q.filename, p.filename) == 0 && strcmp(q.mode, p.mode) == 0);
+            for (int i = 0; i < q.noptions; i++)
+                FUZZ_CHECK(strcmp(q.opt_name[i], p.opt_name[i]) == 0 && strcmp(q.opt_value[i], p.opt_value[i]) == 0);
+        }
+    }
+    if (opcode == OP_ERROR) {
+        // Message reconstruit : même préfixe jusqu'au premier 0
+        uint8_t out[FUZZ_MAX_PACKET * 2 + TFTP_HEADER + 1];
+        char msg[FUZZ_MAX_PACKET * 2 + 1];
+        size_t n = p.len < sizeof(msg) - 1 ? p.len : sizeof(msg) - 1;
+        memcpy(msg, p.data, n);
+        msg[n] = 0;
+        size_t len = tftp_put_error(out, sizeof(out), p.block, msg);
+        tftp_packet_t q;
+        FUZZ_CHECK(tftp_parse(out, len, &q) == OP_ERROR && q.block == p.block);
+        FUZZ_CHECK(q.len == strlen(msg) && memcmp(q.data, msg, q.len) == 0);
+    }
+    free(b);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+// Corpus de départ : un paquet valide de chaque type
+static size_t fuzz_seed(int i, uint8_t *buf, size_t cap) {
+    size_t len;
+    switch (i % 6) {
+    case 0:
+        len = tftp_put_request(buf, cap, OP_RRQ, "pxelinux.0", "octet");
+        len = tftp_put_option(buf, cap, len, "blksize", "1428");
+        return tftp_put_option(buf, cap, len, "tsize", "0");
+    case 1:
+        return tftp_put_request(buf, cap, OP_WRQ, "a.txt", "netascii");
+    case 2:
+        memset(buf, 'x', 516);
+        return tftp_put_header(buf, OP_DATA, 1) + 512;
+    case 3:
+        return tftp_put_ack(buf, 65535);
+    case 4:
+        return tftp_put_error(buf, cap, 1, "File not found");
+    default:
+        len = tftp_put_oack(buf, cap);
+        return tftp_put_option(buf, cap, len, "windowsize", "16");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long iterations = FUZZ_ITERATIONS;
+    unsigned seed = 1;
+    int c;
+    while ((c = getopt(argc, argv, "n:s:")) != -1) {
+        switch (c) {
+        case 'n': iterations = atol(optarg); break;
+        case 's': seed = strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "Utilisation : %s [-n itérations] [-s graine] [fichier...]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    static uint8_t buf[FUZZ_MAX_PACKET];
+    for (int i = optind; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        if (!fp) {
+            perror(argv[i]);
+            return 2;
+        }
+        size_t n = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+
+    // Mutations : octets aléatoires, 0 insérés (coupures de chaînes), troncature
+    srand(seed);
+    for (long it = 0; it < iterations; it++) {
+        size_t len = fuzz_seed(rand(), buf, sizeof(buf));
+        int mutations = 1 + rand() % 8;
+        for (int m = 0; m < mutations; m++) {
+            size_t pos = len ? rand() % len : 0;
+            switch (rand() % 4) {
+            case 0: buf[pos] = rand(); break;
+            case 1: buf[pos] = 0; break;
+            case 2: len = pos; break;
+            default:
+                if (len < sizeof(buf))
+                    buf[len++] = rand() % 3 ? 'a' + rand() % 26 : 0;
+                break;
+            }
+        }
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("%ld entrées mutées, aucune anomalie (graine %u)\n", iterations, seed);
+    return 0;
+}
+#endif
@@ -0,0 +1,423 @@
+/*
+ * Rejoue une trace enregistrée par un serveur (option -T de server, ServerS ou
+ * ServerT) contre un serveur TFTP, en respectant ou en dilatant les intervalles
+ * d'arrivée des requêtes.
+ *
+ * Chaque pair (adresse:port) de la trace devient une session cliente : sa
+ * requête part à la date enregistrée, ses retransmissions de requête aussi
+ * (tempêtes de réessais, sondes de fichiers absents...), puis le transfert est
+ * mené comme par un client normal. Les RRQ sont écrits dans /dev/null ; les WRQ
+ * ne sont rejoués qu'avec -W (ils écrasent les fichiers du serveur visé) et
+ * envoient des données nulles de la taille enregistrée.
+ *
+ * Le bilan donne les latences (première réponse, durée totale) et les
+ * divergences avec la trace (bloc final différent, erreur, etc.) ; le code de
+ * sortie vaut 1 s'il y en a.
+ *
+ * Utilisation : replay [-s facteur] [-j max] [-W] trace [IP[:port]]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+
+#define SERVER_PORT 6969
+#define REPLAY_CONCURRENCY 1000
+#define REPLAY_EVENTS 256
+#define REPLAY_HASH 65536
+#define REPLAY_EXAMPLES 10          // Divergences détaillées dans le bilan
+
+#include "tftp_client.h"
+#include "tftp_trace.h"
+
+typedef struct {
+    uint32_t ip;                    // Pair d'origine dans la trace
+    uint16_t port;
+    int opcode;
+    char name[256];
+    double at;                      // Date de la première requête (s depuis le début de la trace)
+    int requests;                   // Requêtes enregistrées (1 + retransmissions)
+    int followed;                   // La trace contient des ACK/DATA de ce pair après la requête
+    long long rec_block;            // Dernier bloc enregistré (ACK pour RRQ, DATA pour WRQ)
+    long long rec_bytes;            // WRQ : octets reçus par le serveur
+    int rec_complete;               // WRQ : dernier bloc (court) reçu
+    int hash_next;
+    int skipped;
+    int deferred;                   // Démarrage retardé par la limite -j (file d'attente)
+    transfer_t t;
+} replay_session_t;
+
+typedef struct {
+    double at;
+    int session;
+} replay_event_t;
+
+static int compare_events(const void *a, const void *b) {
+    double x = ((const replay_event_t *)a)->at, y = ((const replay_event_t *)b)->at;
+    return (x > y) - (x < y);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double *v, int n, double p) {
+    if (n == 0)
+        return 0;
+    int i = (int)(p * (n - 1) + 0.5);
+    return v[i];
+}
+
+/*
+ * Lecture de la trace : regroupe les enregistrements par session et produit la
+ * liste des envois de requêtes à rejouer. Retourne le nombre de sessions.
+ */
+int load_trace(const char *path, replay_session_t **sessions, replay_event_t **events, int *nevents) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    unsigned char *data = malloc(size > 0 ? size : 1);
+    if (!data || fread(data, 1, size, f) != (size_t)size || size < 8 || memcmp(data, TRACE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s : trace illisible ou format inconnu\n", path);
+        fclose(f);
+        free(data);
+        return -1;
+    }
+    fclose(f);
+
+    int *heads = malloc(REPLAY_HASH * sizeof(int));
+    for (int i = 0; i < REPLAY_HASH; i++)
+        heads[i] = -1;
+    int n = 0, cap = 0, ne = 0, ecap = 0;
+    *sessions = NULL;
+    *events = NULL;
+    uint64_t t0 = 0;
+    long pos = 8;
+    while (pos + TRACE_RECORD <= size) {
+        const unsigned char *r = data + pos;
+        int name_len = r[15];
+        if (pos + TRACE_RECORD + name_len > size)
+            break;
+        pos += TRACE_RECORD + name_len;
+        uint64_t ts = trace_get(r, 8);
+        if (!t0)
+            t0 = ts;
+        uint32_t ip;
+        memcpy(&ip, r + 8, 4);
+        uint16_t port = trace_get(r + 12, 2);
+        int opcode = r[14];
+        uint16_t block = trace_get(r + 16, 2);
+        int pkt_size = trace_get(r + 18, 2);
+        double at = (double)(ts - t0) / 1e9;
+
+        unsigned h = ((ip * 2654435761u) ^ port) & (REPLAY_HASH - 1);
+        int cur = heads[h];
+        while (cur >= 0 && ((*sessions)[cur].ip != ip || (*sessions)[cur].port != port))
+            cur = (*sessions)[cur].hash_next;
+
+        if (opcode == OP_RRQ || opcode == OP_WRQ) {
+            char name[256];
+            memcpy(name, r + TRACE_RECORD, name_len);
+            name[name_len] = '\0';          // Le mode suit le premier NUL, il est ignoré
+            // Même requête sans réponse du client entre-temps : retransmission
+            if (cur < 0 || (*sessions)[cur].followed || (*sessions)[cur].opcode != opcode ||
+                strcmp((*sessions)[cur].name, name) != 0) {
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 1024;
+                    *sessions = realloc(*sessions, cap * sizeof(replay_session_t));
+                }
+                replay_session_t *s = &(*sessions)[n];
+                memset(s, 0, sizeof(*s));
+                s->ip = ip;
+                s->port = port;
+                s->opcode = opcode;
+                snprintf(s->name, sizeof(s->name), "%s", name);
+                s->at = at;
+                s->hash_next = cur;         // Les sessions plus anciennes du pair restent derrière
+                heads[h] = cur = n++;
+            }
+            (*sessions)[cur].requests++;
+            if (ne == ecap) {
+                ecap = ecap ? ecap * 2 : 1024;
+                *events = realloc(*events, ecap * sizeof(replay_event_t));
+            }
+            (*events)[ne].at = at;
+            (*events)[ne++].session = cur;
+        } else if (cur >= 0) {
+            replay_session_t *s = &(*sessions)[cur];
+            s->followed = 1;
+            // Numéro de bloc absolu (les numéros sur 16 bits reviennent à 0)
+            long long abs_block = s->rec_block + (int16_t)(block - (uint16_t)s->rec_block);
+            if (opcode == OP_ACK && s->opcode == OP_RRQ && abs_block > s->rec_block)
+                s->rec_block = abs_block;
+            else if (opcode == OP_DATA && s->opcode == OP_WRQ && abs_block == s->rec_block + 1) {
+                s->rec_block = abs_block;
+                s->rec_bytes += pkt_size - 4;
+                if (pkt_size - 4 < DATA_SIZE)
+                    s->rec_complete = 1;
+            }
+        }
+    }
+    free(heads);
+    free(data);
+    qsort(*events, ne, sizeof(replay_event_t), compare_events);
+    *nevents = ne;
+    return n;
+}
+
+// Décrit une divergence entre la trace et le rejeu (NULL s'il n'y en a pas)
+const char *divergence(replay_session_t *s, char *buf, size_t cap) {
+    transfer_t *t = &s->t;
+    if (s->opcode == OP_RRQ) {
+        long long got = t->state == T_DONE ? t->block : 0;
+        // La taille du fichier n'est pas dans la trace : on compare le dernier bloc confirmé.
+        // Le serveur ferme souvent la session avant l'ACK final, absent de la trace.
+        if (!s->followed && t->state == T_DONE && got > 1)     // Fichier d'un bloc : seul l'ACK final manque
+            snprintf(buf, cap, "sans réponse dans la trace, %lld blocs au rejeu", got);
+        else if (s->followed && t->state != T_DONE)
+            snprintf(buf, cap, "%lld blocs dans la trace, échec au rejeu (%s)", s->rec_block, t->error);
+        else if (s->followed && (uint16_t)got != (uint16_t)s->rec_block && (uint16_t)got != (uint16_t)(s->rec_block + 1))
+            snprintf(buf, cap, "%lld blocs dans la trace, %lld au rejeu", s->rec_block, got);
+        else
+            return NULL;
+    } else {
+        if (s->rec_complete != (t->state == T_DONE))
+            snprintf(buf, cap, "%s dans la trace, %s au rejeu", s->rec_complete ? "complet" : "incomplet",
+                     t->state == T_DONE ? "complet" : t->error);
+        else
+            return NULL;
+    }
+    return buf;
+}
+
+int main(int argc, char *argv[]) {
+    double scale = 1;
+    int concurrency = REPLAY_CONCURRENCY, with_wrq = 0, c;
+    while ((c = getopt(argc, argv, "s:j:W")) != -1) {
+        switch (c) {
+        case 's': scale = atof(optarg); break;
+        case 'j': concurrency = atoi(optarg); break;
+        case 'W': with_wrq = 1; break;
+        default: argc = 0; break;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2 || concurrency < 1 || scale < 0) {
+        fprintf(stderr, "Utilisation : %s [-s facteur] [-j max] [-W] trace [IP[:port]]\n"
+                        "  -s : facteur appliqué aux intervalles (1 = temps réel, 0 = tout d'un coup)\n"
+                        "  -j : sessions simultanées au plus (%d par défaut)\n"
+                        "  -W : rejoue aussi les WRQ (écrase les fichiers du serveur visé)\n",
+                argv[0], REPLAY_CONCURRENCY);
+        return 2;
+    }
+    struct sockaddr_in server = { .sin_family = AF_INET, .sin_port = htons(SERVER_PORT) };
+    char host[64] = "127.0.0.1";
+    if (argc - optind == 2)
+        snprintf(host, sizeof(host), "%s", argv[optind + 1]);
+    char *colon = strchr(host, ':');
+    if (colon) {
+        *colon = '\0';
+        server.sin_port = htons(atoi(colon + 1));
+    }
+    if (inet_pton(AF_INET, host, &server.sin_addr) != 1) {
+        fprintf(stderr, "Adresse invalide : %s\n", host);
+        return 2;
+    }
+
+    replay_session_t *sessions;
+    replay_event_t *events;
+    int nevents;
+    int n = load_trace(argv[optind], &sessions, &events, &nevents);
+    if (n <= 0) {
+        fprintf(stderr, "Aucune requête dans la trace\n");
+        return 2;
+    }
+
+    // Une socket par session active
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if ((rlim_t)concurrency + 16 > rl.rlim_cur)
+            concurrency = rl.rlim_cur > 32 ? (int)rl.rlim_cur - 16 : 16;
+    }
+
+    // Données des WRQ : fichiers creux de la taille enregistrée
+    char tmpdir[] = "/tmp/replay.XXXXXX";
+    if (with_wrq && !mkdtemp(tmpdir)) {
+        perror("mkdtemp");
+        return 2;
+    }
+    int skipped = 0;
+    for (int i = 0; i < n; i++) {
+        replay_session_t *s = &sessions[i];
+        transfer_t *t = &s->t;
+        t->server = server;
+        t->opcode = s->opcode;
+        t->sock = t->fd = -1;
+        t->state = T_PENDING;
+        snprintf(t->filename, sizeof(t->filename), "%s", s->name);
+        if (s->opcode == OP_RRQ) {
+            snprintf(t->local, sizeof(t->local), "/dev/null");
+        } else if (with_wrq) {
+            snprintf(t->local, sizeof(t->local), "%s/%d", tmpdir, i);
+            int fd = open(t->local, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0 || ftruncate(fd, s->rec_bytes) < 0)
+                perror(t->local);
+            if (fd >= 0)
+                close(fd);
+        } else {
+            s->skipped = 1;
+            skipped++;
+        }
+    }
+
+    int epfd = epoll_create1(0);
+    replay_session_t **active = calloc(concurrency, sizeof(*active));
+    unsigned char *pkt = malloc(MAX_BLKSIZE + 4);
+    options_t opt = { DATA_SIZE, 1, -1, 0, 0 };
+    int nactive = 0, next_event = 0, finished = skipped, deferred = 0;
+    // Sessions retardées par la limite -j, démarrées dans l'ordre dès qu'une place se libère
+    int *waiting = malloc(n * sizeof(int)), waiting_head = 0, waiting_len = 0;
+    double start = mono_now();
+    printf("Rejeu de %d sessions (%d requêtes, %.3f s de trace) vers %s:%d, facteur %.2f\n", n, nevents,
+           nevents ? events[nevents - 1].at : 0, inet_ntoa(server.sin_addr), ntohs(server.sin_port), scale);
+
+    while (finished < n) {
+        double now = mono_now();
+        // Requêtes arrivées à échéance : nouvelle session ou retransmission de la requête
+        while (next_event < nevents && start + events[next_event].at * scale <= now) {
+            replay_session_t *s = &sessions[events[next_event].session];
+            transfer_t *t = &s->t;
+            if (s->skipped) {
+                next_event++;
+                continue;
+            }
+            if (t->state == T_PENDING) {
+                // Pas de place : la session attend son tour sans retenir les événements suivants
+                if (!s->deferred && nactive == concurrency) {
+                    s->deferred = 1;
+                    deferred++;
+                    waiting[waiting_len++] = events[next_event].session;
+                } else if (!s->deferred) {
+                    transfer_begin(t, epfd, &opt, 0, now);
+                    active[nactive++] = s;
+                }
+            } else if (t->state == T_REQUEST) {
+                transfer_send(t, now);      // Retransmission de la requête, comme dans la trace
+            }
+            next_event++;
+        }
+
+        double next = now + TIMEOUT;
+        if (next_event < nevents && start + events[next_event].at * scale < next)
+            next = start + events[next_event].at * scale;
+        for (int i = 0; i < nactive; i++)
+            if (active[i]->t.state <= T_TRANSFER && active[i]->t.deadline < next)
+                next = active[i]->t.deadline;
+        int wait_ms = next > now ? (int)((next - now) * 1000) + 1 : 0;
+        struct epoll_event evs[REPLAY_EVENTS];
+        int ready = epoll_wait(epfd, evs, REPLAY_EVENTS, wait_ms);
+        if (ready < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+
+        now = mono_now();
+        for (int i = 0; i < ready; i++) {
+            transfer_t *t = evs[i].data.ptr;
+            while (t->sock >= 0) {
+                struct sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                int len = recvfrom(t->sock, pkt, MAX_BLKSIZE + 4, 0, (struct sockaddr *)&from, &from_len);
+                if (len < 0)
+                    break;
+                transfer_input(t, pkt, len, &from, now);
+            }
+        }
+        for (int i = 0; i < nactive; i++) {
+            transfer_t *t = &active[i]->t;
+            if (t->state <= T_TRANSFER && t->deadline <= now)
+                transfer_timeout(t, now);
+            if (t->state >= T_DONE) {
+                t->elapsed = now - t->started;
+                active[i--] = active[--nactive];
+                finished++;
+            }
+        }
+        while (nactive < concurrency && waiting_head < waiting_len) {
+            replay_session_t *s = &sessions[waiting[waiting_head++]];
+            transfer_begin(&s->t, epfd, &opt, 0, now);
+            active[nactive++] = s;
+        }
+    }
+    double total = mono_now() - start;
+
+    // Bilan
+    double *first = malloc(n * sizeof(double)), *dur = malloc(n * sizeof(double));
+    int nfirst = 0, ndur = 0, ok = 0, errors = 0, timeouts = 0, diverged = 0;
+    long long bytes = 0;
+    char why[200];
+    for (int i = 0; i < n; i++) {
+        replay_session_t *s = &sessions[i];
+        transfer_t *t = &s->t;
+        if (s->skipped)
+            continue;
+        if (t->first_reply >= 0)
+            first[nfirst++] = t->first_reply;
+        if (t->state == T_DONE) {
+            ok++;
+            bytes += t->bytes;
+            dur[ndur++] = t->elapsed;
+        } else if (t->fatal) {
+            errors++;
+        } else {
+            timeouts++;
+        }
+        if (divergence(s, why, sizeof(why))) {
+            if (diverged++ < REPLAY_EXAMPLES) {
+                struct in_addr a = { s->ip };
+                printf("  divergence : %s %s (pair %s:%d) : %s\n", s->opcode == OP_RRQ ? "RRQ" : "WRQ",
+                       s->name, inet_ntoa(a), s->port, why);
+            }
+        }
+        if (with_wrq && s->opcode == OP_WRQ)
+            unlink(t->local);
+    }
+    if (with_wrq)
+        rmdir(tmpdir);
+    qsort(first, nfirst, sizeof(double), compare_doubles);
+    qsort(dur, ndur, sizeof(double), compare_doubles);
+    printf("\nSessions : %d rejouées, %d réussies, %d erreurs du serveur, %d sans réponse, %d WRQ ignorés\n",
+           n - skipped, ok, errors, timeouts, skipped);
+    printf("Première réponse (ms) : p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+           percentile(first, nfirst, 0.5) * 1e3, percentile(first, nfirst, 0.9) * 1e3,
+           percentile(first, nfirst, 0.99) * 1e3, nfirst ? first[nfirst - 1] * 1e3 : 0);
+    printf("Durée des transferts (ms) : p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+           percentile(dur, ndur, 0.5) * 1e3, percentile(dur, ndur, 0.9) * 1e3,
+           percentile(dur, ndur, 0.99) * 1e3, ndur ? dur[ndur - 1] * 1e3 : 0);
+    printf("Rejeu en %.3f s, %lld octets (%.1f Mo/s), %d démarrages retardés (limite -j %d)\n",
+           total, bytes, total > 0 ? bytes / total / 1e6 : 0, deferred, concurrency);
+    printf("Divergences avec la trace : %d\n", diverged);
+    close(epfd);
+    free(first);
+    free(dur);
+    free(pkt);
+    free(active);
+    free(waiting);
+    free(events);
+    free(sessions);
+    return diverged ? 1 : 0;
+}
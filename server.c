@@ -7,6 +7,19 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
+
+#include "tftp_prof.h"
+#include "tftp_shaper.h"
+#include "tftp_netascii.h"
+#include "tftp_crc32c.h"
+#include "tftp_upload.h"
+#include "tftp_trace.h"
+#include "tftp_codec.h"
+#include "tftp_sockbuf.h"
+#include "tftp_resume.h"
+#include "tftp_image.h"
+#include "tftp_fsm.h"
 
 #define SERVER_PORT 6969
 #define PACKET_SIZE 516
@@ -20,22 +33,275 @@
 #define OP_ACK 4
 #define OP_ERROR 5
 
-#define TIMEOUT 2
-#define MAX_RETRIES 5
+#define ERR_UNKNOWN_TID 5
+
+/*
+ * Tous les transferts sont servis par un seul thread : chacun a sa socket
+ * éphémère (son port est le TID du serveur, RFC 1350) et sa machine à états
+ * (tftp_fsm.h). Une boucle poll() attend à la fois les requêtes sur le port
+ * bien connu, les paquets des transferts en cours et la prochaine échéance
+ * (retransmission ou envoi retenu par le limiteur de débit).
+ */
+typedef struct {
+    int sock;                       // Socket éphémère du transfert
+    struct sockaddr_in client;      // Adresse et TID du client
+    int opcode;
+    int netascii;
+    netascii_t na;
+    fsm_t fsm;
+    double send_at;                 // Bloc retenu par le limiteur de débit : prochain essai (shaper_now)
+    image_reader_t src;             // RRQ : fichier ou image compressée, CRC32C au fil de l'eau
+    long long offset;               // RRQ : reprise, position du bloc 1 dans le fichier
+    upload_t up;                    // WRQ : fichier anonyme mis en place au dernier bloc
+    uint32_t crc;                   // WRQ : CRC32C des données écrites
+    sockbuf_t sb;
+} session_t;
 
-void handle_rrq(int sock, struct sockaddr_in *client, char *filename);
-void handle_wrq(int sock, struct sockaddr_in *client, char *filename);
 void send_error(int sock, struct sockaddr_in *client, int code, char *msg);
 
-int main() {
+shaper_t shaper;    // Limitation de débit des envois DATA
+sockbuf_t sockbuf;  // Pertes noyau de la socket du port bien connu, tampon agrandi au besoin (option -B)
+
+session_t **sessions;   // Transferts en cours
+int session_count, session_cap;
+
+// Lecture du fichier (RRQ), appelée par la machine à états pour chaque nouveau bloc
+size_t session_read(void *ctx, unsigned char *buf, size_t len) {
+    session_t *sess = ctx;
+    PROF_BEGIN(t_read);
+    size_t n = sess->netascii ? netascii_read_block(&sess->na, image_fread, &sess->src, buf, len)
+                              : image_fread(&sess->src, buf, len);
+    PROF_END(PROF_READ, t_read);
+    return n;
+}
+
+// Écriture d'un bloc reçu (WRQ) ; au dernier, le fichier remplace l'ancien et son CRC est mémorisé avec lui
+int session_write(void *ctx, const unsigned char *data, size_t len, int last) {
+    session_t *sess = ctx;
+    int ret = 0;
+    PROF_BEGIN(t_write);
+    if (sess->netascii) {
+        unsigned char text[PACKET_SIZE + 1];
+        size_t n = netascii_decode(&sess->na, data, len, text);
+        if (last)
+            n += netascii_decode_finish(&sess->na, text + n);
+        if (upload_write(&sess->up, text, n) < 0)
+            ret = -1;
+        sess->crc = crc32c(sess->crc, text, n);
+    } else {
+        if (upload_write(&sess->up, data, len) < 0)
+            ret = -1;
+        sess->crc = crc32c(sess->crc, data, len);
+    }
+    PROF_END(PROF_WRITE, t_write);
+    if (ret < 0) {      // Disque plein, préfixe non recopié... : ERROR au client, rien n'est mis en place
+        perror("[ERREUR] Écriture du fichier reçu");
+        return -1;
+    }
+    if (!last)
+        return 0;
+    if (upload_commit(&sess->up) < 0) {
+        perror("[ERREUR] Mise en place du fichier");
+        return -1;
+    }
+    // Le CRC est mémorisé avec le fichier, inutile de le relire plus tard
+    printf("[INFO] Réception terminée, crc32c=%08x (%s)%s.\n", sess->crc,
+           digest_store(sess->up.fd, sess->crc) == 0 ? "mémorisé" : "non mémorisé",
+           sess->up.unchanged ? ", contenu inchangé" : "");
+    return 0;
+}
+
+int session_send(void *ctx, const unsigned char *pkt, size_t len) {
+    session_t *sess = ctx;
+    PROF_BEGIN(t_send);
+    sendto(sess->sock, pkt, len, 0, (struct sockaddr *)&sess->client, sizeof(sess->client));
+    PROF_END(PROF_SEND, t_send);
+    return 0;
+}
+
+static const fsm_ops_t session_ops = { session_read, session_write, session_send, NULL };
+
+// Envoie le bloc prêt (RRQ) si la limitation de débit le permet, sinon note quand réessayer
+void rrq_flush(session_t *sess) {
+    if (image_failed(&sess->src)) {     // Image compressée invalide : erreur plutôt qu'un dernier bloc tronqué
+        fsm_abort(&sess->fsm, 0, "Image compressée invalide");
+        printf("[ERREUR] Image compressée invalide\n");
+        return;
+    }
+    double delay = shaper_reserve(&shaper, sess->client.sin_addr, sess->fsm.out_len);
+    if (delay > 0) {
+        sess->send_at = shaper_now() + delay;
+        return;
+    }
+    fsm_flush(&sess->fsm, shaper_now());
+    printf("Envoi du bloc %d (%ld octets)\n", sess->fsm.block, (long)sess->fsm.out_len - 4);
+}
+
+// Nouvelle requête reçue sur le port bien connu : ouverture du fichier et de la socket du transfert
+void start_session(int sock, unsigned char *buffer, int len, struct sockaddr_in *client) {
+    PROF_BEGIN(t_parse);
+    tftp_packet_t req = {0};
+    int opcode = tftp_parse(buffer, len, &req);    // WRQ ou RRQ, -1 si mal formée
+    int netascii = (opcode == OP_RRQ || opcode == OP_WRQ) && netascii_mode(req.mode);
+    PROF_END(PROF_PARSE, t_parse);
+    if (opcode != OP_RRQ && opcode != OP_WRQ)
+        return;
+
+    if (session_count == session_cap) {
+        session_cap = session_cap ? session_cap * 2 : 16;
+        sessions = realloc(sessions, session_cap * sizeof(*sessions));
+    }
+    session_t *sess = calloc(1, sizeof(*sess));
+    if (!sess || !sessions) {
+        perror("[ERREUR] Mémoire");
+        exit(1);
+    }
+    char path[256];
+    snprintf(path, sizeof(path), "%s%s", SERVER_FOLDER, req.filename);     // Chemin du fichier
+    sess->client = *client;
+    sess->opcode = opcode;
+    sess->netascii = netascii;
+    netascii_init(&sess->na);
+    fsm_ops_t ops = session_ops;
+    ops.ctx = sess;
+
+    if (opcode == OP_RRQ) {
+        printf("Demande de lecture du fichier : %s (%s)\n", req.filename, netascii ? "netascii" : MODE);
+        long long size;     // Le fichier, ou à défaut son image compressée (.gz, .zst)
+        if (image_open(&sess->src, path, &size) < 0) {
+            send_error(sock, client, 1, "Fichier introuvable");
+            free(sess);
+            return;
+        }
+        if (sess->src.img)
+            printf("[INFO] Image compressée '%s' (%lld octets).\n", sess->src.img->path, size);
+        // Reprise (option offset) et taille (tsize) : OACK confirmé par l'ACK 0, puis lecture à partir de offset
+        sess->offset = resume_offset(&req, size, netascii);
+        if (sess->offset && image_seek(&sess->src, sess->offset) == 0)
+            printf("[INFO] Reprise à l'octet %lld.\n", sess->offset);
+        else
+            sess->offset = 0;
+        unsigned char oack[64];
+        size_t oack_len = image_oack(oack, sizeof(oack), &req, size, sess->offset, netascii);
+        fsm_start_rrq(&sess->fsm, &ops, oack, oack_len);
+    } else {
+        printf("Demande d'écriture du fichier: %s (%s)\n", req.filename, netascii ? "netascii" : MODE);
+        // Fichier anonyme mis en place au dernier bloc : les lecteurs gardent l'ancienne version d'ici là
+        const char *tsize = tftp_option(&req, "tsize");
+        if (upload_open(&sess->up, path, tsize ? atoll(tsize) : -1) < 0) {
+            send_error(sock, client, 2, "Impossible de créer le fichier");
+            free(sess);
+            return;
+        }
+        fsm_start_wrq(&sess->fsm, &ops);
+    }
+
+    // Socket éphémère : le port choisi par le noyau est le TID du serveur pour ce transfert
+    struct sockaddr_in any = { .sin_family = AF_INET, .sin_addr.s_addr = INADDR_ANY };
+    sess->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sess->sock < 0 || bind(sess->sock, (struct sockaddr *)&any, sizeof(any)) < 0) {
+        perror("[ERREUR] Socket du transfert");
+        send_error(sock, client, 0, "Serveur surchargé");
+        if (sess->sock >= 0)
+            close(sess->sock);
+        image_close(&sess->src);
+        if (opcode == OP_WRQ)
+            upload_close(&sess->up);
+        free(sess);
+        return;
+    }
+    fcntl(sess->sock, F_SETFL, fcntl(sess->sock, F_GETFL, 0) | O_NONBLOCK);
+    sockbuf_init_peer(&sess->sb, sess->sock, client, SOCKBUF_SESSION);
+    sessions[session_count++] = sess;
+
+    // Premier paquet : bloc 1 ou OACK (RRQ, dès que le débit le permet), ACK 0 (WRQ)
+    if (opcode == OP_RRQ)
+        rrq_flush(sess);
+    else
+        fsm_flush(&sess->fsm, shaper_now());
+}
+
+// Paquets reçus sur la socket d'un transfert
+void session_input(session_t *sess) {
+    unsigned char buffer[PACKET_SIZE];
+    struct sockaddr_in from;
+    while (!fsm_over(&sess->fsm)) {
+        socklen_t from_len = sizeof(from);
+        PROF_BEGIN(t_recv);
+        int n = sockbuf_recvfrom(&sess->sb, buffer, sizeof(buffer), 0, (struct sockaddr *)&from, &from_len);
+        PROF_END(PROF_RECV, t_recv);
+        if (n < 0)
+            break;
+        trace_record(&from, buffer, n);
+        if (from.sin_addr.s_addr != sess->client.sin_addr.s_addr || from.sin_port != sess->client.sin_port) {
+            send_error(sess->sock, &from, ERR_UNKNOWN_TID, "Unknown transfer ID");     // Le transfert continue
+            continue;
+        }
+        if (!fsm_input(&sess->fsm, buffer, n, shaper_now()))
+            continue;
+        if (sess->opcode == OP_WRQ && sess->fsm.state != FSM_FAILED)
+            printf("[INFO] Reçu et confirmé bloc %d\n", sess->fsm.block);
+        if (sess->fsm.pending)
+            rrq_flush(sess);
+    }
+}
+
+// Fin d'un transfert (dernier ACK, abandon ou erreur) : bilan et libération
+void session_end(session_t *sess) {
+    if (sess->fsm.state == FSM_FAILED)
+        printf("[ERREUR] Abandon du transfert %s de %s:%d (bloc %d, %lu retransmissions).\n",
+               sess->opcode == OP_RRQ ? "RRQ" : "WRQ", inet_ntoa(sess->client.sin_addr),
+               ntohs(sess->client.sin_port), sess->fsm.block, sess->fsm.retransmits);
+    else if (sess->opcode == OP_RRQ && sess->offset)     // Le CRC ne couvre que la fin du fichier
+        printf("[INFO] Envoi terminé à partir de l'octet %lld.\n", sess->offset);
+    else if (sess->opcode == OP_RRQ)
+        printf("[INFO] Envoi terminé, crc32c=%08x (%s).\n", sess->src.rd.crc, image_verify(&sess->src));
+    if (sess->opcode == OP_WRQ && !sess->up.committed)
+        printf("[INFO] Réception interrompue, fichier non modifié.\n");
+    sockbuf_report(&sess->sb);
+    close(sess->sock);
+    image_close(&sess->src);
+    if (sess->opcode == OP_WRQ)
+        upload_close(&sess->up);
+    free(sess);
+}
+
+int main(int argc, char *argv[]) {
+    PROF_INIT();
+    double global_rate = 0, client_rate = 0, subnet_rate = 0;
+    int prefix = 24, opt;
+    while ((opt = getopt(argc, argv, "g:c:n:p:T:B:D")) != -1) {
+        switch (opt) {
+        case 'g': global_rate = shaper_parse_rate(optarg); break;
+        case 'c': client_rate = shaper_parse_rate(optarg); break;
+        case 'n': subnet_rate = shaper_parse_rate(optarg); break;
+        case 'p': prefix = atoi(optarg); break;
+        case 'D': upload_dedup = 1; break;
+        case 'T':
+            if (trace_open(optarg) < 0) {
+                perror(optarg);
+                exit(1);
+            }
+            break;
+        case 'B':
+            if (sockbuf_parse(optarg) < 0) {
+                fprintf(stderr, "Taille de tampon invalide : %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            fprintf(stderr, "Utilisation : %s [-g débit_global] [-c débit_par_client] [-n débit_par_sous_réseau] [-p préfixe] [-T trace] [-B min[:max]] [-D]\n"
+                            "Débits en octets/s, suffixes k/M/G acceptés (ex. -g 100M).\n"
+                            "-T : enregistre les paquets reçus dans une trace (rejouable avec replay).\n"
+                            "-B : tampons des sockets (octets, k/M), agrandis jusqu'à max en cas de pertes.\n"
+                            "-D : fichiers reçus rangés par contenu (serverFolder/.objects), contenus identiques partagés.\n", argv[0]);
+            exit(1);
+        }
+    }
+    shaper_init(&shaper, global_rate, client_rate, subnet_rate, prefix);
     int sock = socket(AF_INET, SOCK_DGRAM, 0);      // Création du socket
-    struct sockaddr_in server_addr = {0}, client_addr;  // Structure pour stocker l'adresse du serveur.
-    socklen_t addr_len = sizeof(client_addr);
-    char buffer[PACKET_SIZE];
-    struct timeval timeout = {TIMEOUT, 0};
+    struct sockaddr_in server_addr = {0};           // Structure pour stocker l'adresse du serveur.
 
-    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    
     server_addr.sin_family = AF_INET;           // IPv4
     server_addr.sin_port = htons(SERVER_PORT);  // Port
     server_addr.sin_addr.s_addr = INADDR_ANY;   // Adresse IP
@@ -44,134 +310,100 @@ int main() {
         perror("Échec du bind");
         exit(1);
     }
-    
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    char name[48];
+    snprintf(name, sizeof(name), "port %d", SERVER_PORT);
+    sockbuf_init(&sockbuf, sock, name, sockbuf_policy.min);
+
     mkdir(SERVER_FOLDER, 0777);     // Création du dossier pour stocker les fichiers
-    
+
     printf("Serveur TFTP en écoute sur le port %d...\n", SERVER_PORT);
-    
+
+    struct pollfd *fds = NULL;
+    int fds_cap = 0;
     while (1) {
-        int len = recvfrom(sock, buffer, PACKET_SIZE, 0, (struct sockaddr *)&client_addr, &addr_len); // Reception de la requête
-        if (len < 4) continue;
-        
-        int opcode = ntohs(*(short *)buffer);   // WRQ ou RRQ
-        char *filename = buffer + 2;
-
-        if (opcode == OP_RRQ) {
-            printf("Demande de lecture du fichier : %s\n", filename);
-            handle_rrq(sock, &client_addr, filename);   // Lecture
-        } else if (opcode == OP_WRQ) {
-            printf("Demande d'écriture du fichier: %s\n", filename);
-            handle_wrq(sock, &client_addr, filename);   // Ecriture
+        // Sockets surveillées : le port bien connu, puis une par transfert
+        if (fds_cap < session_count + 1) {
+            fds_cap = session_cap + 1;
+            if (!(fds = realloc(fds, fds_cap * sizeof(*fds)))) {
+                perror("[ERREUR] Mémoire");
+                exit(1);
+            }
         }
-    }
-    close(sock);
-    return 0;
-}
+        fds[0] = (struct pollfd){ sock, POLLIN, 0 };
+        for (int i = 0; i < session_count; i++)
+            fds[i + 1] = (struct pollfd){ sessions[i]->sock, POLLIN, 0 };
 
-void handle_rrq(int sock, struct sockaddr_in *client, char *filename) {
-    char path[256];
-    sprintf(path, "%s%s", SERVER_FOLDER, filename); // Chemin du fichier
-    
-    int file = open(path, O_RDONLY);
-    if (file < 0) {
-        send_error(sock, client, 1, "Fichier introuvable");
-        return;
-    }
-    
-    char buffer[PACKET_SIZE], ack[4];
-    short block = 1;
-    int len;
-    socklen_t addr_len = sizeof(*client);
-
-    while ((len = read(file, buffer + 4, DATA_SIZE)) > 0) {
-        *(short *)buffer = htons(OP_DATA);      // OP_Data
-        *(short *)(buffer + 2) = htons(block);  // nb Bloc
-        
-        int retries = 0;
-        while (retries < MAX_RETRIES) {
-            printf("Envoi du bloc %d (%d octets)\n", block, len);
-            sendto(sock, buffer, len + 4, 0, (struct sockaddr *)client, addr_len);      // Signal pour recevoir un packet
-            
-            if (recvfrom(sock, ack, 4, 0, (struct sockaddr *)client, &addr_len) < 0) {  // Si erreur de receptio
-                if (errno == EWOULDBLOCK || errno == EAGAIN) {      // Si timeout
-                    printf("Timeout. Bloc %d (%d/%d)\n", block, retries + 1, MAX_RETRIES);  
-                    retries++;
-                    continue;
-                } else {    // Si autre source d'erreur
-                    perror("recvfrom");
-                    close(file);
-                    return;
-                }
-            }
+        // Attente jusqu'à la prochaine échéance : envoi retenu par le limiteur ou retransmission
+        double wait = FSM_TIMEOUT, now = shaper_now();
+        for (int i = 0; i < session_count; i++) {
+            double at = sessions[i]->fsm.pending ? sessions[i]->send_at : fsm_deadline(&sessions[i]->fsm);
+            if (at >= 0 && at - now < wait)
+                wait = at - now > 0 ? at - now : 0;
+        }
+        wait = trace_wait(wait);        // Trace (-T) écrite même sans trafic
+        PROF_BEGIN(t_wait);
+        int ready = poll(fds, session_count + 1, (int)(wait * 1000) + (wait > 0));     // Arrondi au-dessus
+        PROF_END(PROF_WAIT, t_wait);
+        sockbuf_poll(&sockbuf);     // Pertes survenues après le dernier paquet reçu
+        trace_tick();
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
             break;
         }
-        if (retries == MAX_RETRIES) {   // Si plus de tentative possibles
-            printf("Abandon après %d tentatives.\n", MAX_RETRIES);
-            close(file);
-            return;
+
+        // Paquets des transferts en cours, puis leurs échéances : blocs retenus par le limiteur,
+        // retransmissions, abandon après FSM_RETRIES essais
+        int count = session_count;
+        now = shaper_now();
+        for (int i = 0; i < count; i++) {
+            session_t *sess = sessions[i];
+            if (fds[i + 1].revents)
+                session_input(sess);
+            if (fsm_over(&sess->fsm))
+                continue;
+            if (sess->fsm.pending && now >= sess->send_at)
+                rrq_flush(sess);
+            double at = fsm_deadline(&sess->fsm);
+            if (at >= 0 && now >= at && fsm_timeout(&sess->fsm, now))
+                printf("Timeout. Bloc %d (%d/%d)\n", sess->fsm.block, sess->fsm.retries, FSM_RETRIES);
         }
-        block++;    // Bloc suivant
-    }
-    printf("[INFO] Envoi terminé.\n");
-    close(file);
-}
 
-void handle_wrq(int sock, struct sockaddr_in *client, char *filename) {
-    char path[256];
-    sprintf(path, "%s%s", SERVER_FOLDER, filename);
-    
-    int file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (file < 0) {
-        send_error(sock, client, 2, "Impossible de créer le fichier");
-        return;
-    }
-    
-    char buffer[PACKET_SIZE];
-    short block = 0;
-    socklen_t addr_len = sizeof(*client);
-    
-    *(short *)buffer = htons(OP_ACK);
-    *(short *)(buffer + 2) = htons(block);
-    sendto(sock, buffer, 4, 0, (struct sockaddr *)client, addr_len);    // Envois du signal pour commencer à envoyer/recevoir
-    
-    while (1) {
-        int retries = 0, len;
-        while (retries < MAX_RETRIES) {
-            len = recvfrom(sock, buffer, PACKET_SIZE, 0, (struct sockaddr *)client, &addr_len);     // Reception du packet
-            if (len < 4) {  // Si problème
-                printf("[ATTENTION] Timeout ! Réessai... (%d/%d)\n", retries + 1, MAX_RETRIES);
-                retries++;
+        // Nouvelles requêtes : chacune ouvre son transfert, sans attendre la fin des autres
+        while (fds[0].revents) {
+            unsigned char buffer[PACKET_SIZE];
+            struct sockaddr_in client_addr;
+            socklen_t addr_len = sizeof(client_addr);
+            PROF_BEGIN(t_recv);
+            int len = sockbuf_recvfrom(&sockbuf, buffer, PACKET_SIZE, 0, (struct sockaddr *)&client_addr, &addr_len);
+            PROF_END(PROF_RECV, t_recv);
+            if (len < 0)
+                break;
+            if (len < 4)
                 continue;
-            }
-            break;
+            trace_record(&client_addr, buffer, len);
+            start_session(sock, buffer, len, &client_addr);
         }
-        if (retries == MAX_RETRIES) {
-            printf("[ERREUR] Abandon après %d tentatives.\n", MAX_RETRIES);
-            close(file);
-            return;
+
+        // Transferts terminés
+        for (int i = 0; i < session_count;) {
+            if (fsm_over(&sessions[i]->fsm)) {
+                session_end(sessions[i]);
+                sessions[i] = sessions[--session_count];
+            } else {
+                i++;
+            }
         }
-        
-        if (ntohs(*(short *)buffer) != OP_DATA || ntohs(*(short *)(buffer + 2)) != block + 1) break;
-        
-        write(file, buffer + 4, len - 4);
-        block++;    // Bloc suivant
-        
-        *(short *)buffer = htons(OP_ACK);
-        *(short *)(buffer + 2) = htons(block);
-        sendto(sock, buffer, 4, 0, (struct sockaddr *)client, addr_len);    // Informe que le client peut envoyer le packet suivant
-        printf("[INFO] Reçu et confirmé bloc %d\n", block);
-        
-        if (len < PACKET_SIZE) break;   // Si plus rien dans le fichier, on arrête
     }
-    printf("[INFO] Réception terminée.\n");
-    close(file);
+    close(sock);
+    return 0;
 }
 
 void send_error(int sock, struct sockaddr_in *client, int code, char *msg) {
-    char buffer[PACKET_SIZE];
-    *(short *)buffer = htons(OP_ERROR);
-    *(short *)(buffer + 2) = htons(code);
-    strcpy(buffer + 4, msg);
-    sendto(sock, buffer, 4 + strlen(msg) + 1, 0, (struct sockaddr *)client, sizeof(*client));
+    unsigned char buffer[PACKET_SIZE];
+    sendto(sock, buffer, tftp_put_error(buffer, sizeof(buffer), code, msg), 0, (struct sockaddr *)client, sizeof(*client));
     printf("[ERREUR] %s\n", msg);
 }
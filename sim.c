@@ -0,0 +1,570 @@
+/*
+ * Simulateur déterministe de transferts TFTP, dans un seul processus.
+ *
+ * Les deux extrémités sont les vraies machines à états : tftp_client.h côté
+ * client (celle du mode lot de client.c), tftp_fsm.h côté serveur (celle des
+ * sessions de ServerS.c). Elles s'échangent leurs paquets par un réseau simulé
+ * (délai, pertes, réordonnancement et duplication tirés d'un générateur
+ * pseudo-aléatoire initialisé par la graine) et vivent sur une horloge
+ * virtuelle qui saute d'un événement au suivant : un timeout de 2 s ne coûte
+ * rien, et des millions de transferts passent en quelques secondes.
+ *
+ * Vérifications :
+ * - RRQ terminée côté client : fichier reçu identique à la source ;
+ * - WRQ : le serveur écrit exactement les données envoyées, dans l'ordre, et
+ *   met le fichier en place une seule fois, complet ; un client qui a reçu le
+ *   dernier ACK implique un fichier mis en place ; un client qui échoue sur
+ *   un fichier mis en place doit avoir perdu toutes ses répétitions du dernier
+ *   bloc, pas trouvé la session serveur déjà terminée ;
+ * - toute session serveur finit par se terminer ;
+ * - sans pertes, aucun transfert n'échoue.
+ * Une même graine rejoue exactement la même exécution : l'empreinte affichée
+ * (paquets livrés et leurs dates) permet de le vérifier.
+ *
+ * Compilation : gcc -O2 sim.c -o sim
+ * Utilisation : sim [-n transferts] [-j simultanés] [-s graine] [-l perte] [-r réordonnancement]
+ *                   [-u duplication] [-d délai_ms] [-z taille_max] [-w proportion_wrq] [-m transferts/s_min]
+ * Code de sortie 1 si une vérification échoue ou si le débit est sous le seuil -m.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "tftp_client.h"
+#include "tftp_fsm.h"
+
+#define SIM_PORT 69
+#define SIM_TID_BASE 1024           // Port de la session serveur i : SIM_TID_BASE + i
+#define SIM_MAX_SESSIONS 60000
+#define SIM_PACKET 600              // Requête ou DATA de 516 octets
+#define SIM_POOL (1 << 20)          // Contenu des fichiers simulés
+#define SIM_TRANSFERS 100000
+#define SIM_CONCURRENCY 32
+#define SIM_SIZE_MAX 4096
+#define SIM_MAX_REPORTS 10          // Anomalies détaillées, les suivantes sont seulement comptées
+
+// Générateur pseudo-aléatoire (splitmix64)
+static uint64_t sim_rng;
+
+static inline uint64_t sim_mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint64_t sim_next(void) {
+    return sim_mix(sim_rng += 0x9e3779b97f4a7c15ULL);
+}
+
+static inline double sim_uniform(void) {
+    return (sim_next() >> 11) * 0x1.0p-53;
+}
+
+typedef struct {
+    double at;
+    uint64_t seq;                   // Départage les livraisons simultanées : ordre d'envoi
+    int to_server;
+    int dest;                       // Vers le serveur : session (-1 = port bien connu) ; sinon client
+    unsigned gen;                   // Vers un client : tentative à laquelle le paquet est destiné
+    int from;                       // Client ou session émetteur
+    unsigned from_gen;
+    int len;
+    unsigned char data[SIM_PACKET];
+} sim_packet_t;
+
+typedef struct {
+    fsm_t fsm;
+    int index;                      // Port SIM_TID_BASE + index
+    unsigned gen;                   // Incrémenté à chaque réattribution du port
+    int in_use;
+    int client;                     // Client (et sa tentative) servi par la session
+    unsigned client_gen;
+    const unsigned char *src;       // RRQ : source ; WRQ : contenu attendu
+    size_t size, pos;
+} sim_session_t;
+
+typedef struct {
+    transfer_t t;
+    int busy;
+    unsigned gen;                   // Incrémenté à chaque transfert : les paquets en retard sont ignorés
+    int id;
+    int memfd;                      // Fichier local du client, en mémoire
+    const unsigned char *src;
+    size_t size;
+    int commits;                    // WRQ : mises en place par le serveur pour cette tentative
+    int session;                    // WRQ : session qui a mis le fichier en place (et sa génération)
+    unsigned session_gen;
+} sim_client_t;
+
+// Paramètres
+static double sim_loss, sim_reorder, sim_dup, sim_delay = 0.001;
+static size_t sim_size_max = SIM_SIZE_MAX;
+static uint64_t sim_seed = 1;
+
+// Réseau : tas de paquets en vol, ordonné par (at, seq)
+static sim_packet_t **heap;
+static int heap_len, heap_cap;
+static sim_packet_t *free_packets;
+static uint64_t sim_seq;
+
+static sim_session_t **sessions;
+static int nsessions, live_sessions;
+static int *free_sessions, nfree_sessions;
+
+/*
+ * Timers des sessions. Toute échéance vaut now + FSM_TIMEOUT et l'horloge ne
+ * recule pas : une simple file suffit, dans l'ordre des échéances. Une entrée
+ * est ajoutée à chaque réarmement ; celles devenues caduques (session finie
+ * ou réarmée depuis) sont ignorées au passage.
+ */
+typedef struct {
+    double at;
+    int index;
+    unsigned gen;
+} sim_timer_t;
+
+static sim_timer_t *timers;
+static size_t timers_head, timers_len, timers_cap;
+static sim_client_t *clients;
+static unsigned char *pool, *check;
+static struct in_addr server_ip, client_ip;
+
+// Compteurs
+static unsigned long long sent, lost, duplicated, delivered, fingerprint = 0xcbf29ce484222325ULL;
+static unsigned long long client_retransmits, server_retransmits, bytes_done;
+static int violations;
+
+static void sim_violation(int id, const char *fmt, const char *detail) {
+    if (violations++ < SIM_MAX_REPORTS) {
+        printf("ANOMALIE transfert %d (graine %llu) : ", id, (unsigned long long)sim_seed);
+        printf(fmt, detail);
+        printf("\n");
+    }
+}
+
+// Fichier simulé n° id : taille (multiple de 512 une fois sur quatre) et contenu dans le pool
+static void sim_file(int id, const unsigned char **src, size_t *size) {
+    uint64_t h = sim_mix(sim_seed ^ ((uint64_t)id * 0x9e3779b97f4a7c15ULL));
+    if ((h & 3) == 0)
+        *size = ((h >> 2) % (sim_size_max / FSM_BLOCK + 1)) * FSM_BLOCK;
+    else
+        *size = (h >> 2) % (sim_size_max + 1);
+    *src = pool + (h >> 32) % (SIM_POOL - sim_size_max);
+}
+
+static int heap_before(const sim_packet_t *a, const sim_packet_t *b) {
+    return a->at < b->at || (a->at == b->at && a->seq < b->seq);
+}
+
+static void heap_push(sim_packet_t *p) {
+    if (heap_len == heap_cap) {
+        heap_cap = heap_cap ? heap_cap * 2 : 1024;
+        heap = realloc(heap, heap_cap * sizeof(*heap));
+    }
+    int i = heap_len++;
+    while (i > 0 && heap_before(p, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = p;
+}
+
+static sim_packet_t *heap_pop(void) {
+    sim_packet_t *top = heap[0], *last = heap[--heap_len];
+    int i = 0;
+    while (2 * i + 1 < heap_len) {
+        int c = 2 * i + 1;
+        if (c + 1 < heap_len && heap_before(heap[c + 1], heap[c]))
+            c++;
+        if (!heap_before(heap[c], last))
+            break;
+        heap[i] = heap[c];
+        i = c;
+    }
+    if (heap_len)
+        heap[i] = last;
+    return top;
+}
+
+static sim_packet_t *packet_alloc(void) {
+    sim_packet_t *p = free_packets;
+    if (p)
+        free_packets = *(sim_packet_t **)p;
+    else if (!(p = malloc(sizeof(*p)))) {
+        perror("malloc");
+        exit(2);
+    }
+    return p;
+}
+
+static void packet_free(sim_packet_t *p) {
+    *(sim_packet_t **)p = free_packets;
+    free_packets = p;
+}
+
+// Émission d'un paquet : perdu, retardé (parfois beaucoup plus : réordonnancement), parfois dupliqué
+static double sim_now;
+
+static void net_send(int to_server, int dest, unsigned gen, int from, unsigned from_gen,
+                     const unsigned char *data, size_t len) {
+    sent++;
+    int copies = 1 + (sim_dup > 0 && sim_uniform() < sim_dup);
+    duplicated += copies - 1;
+    for (int c = 0; c < copies; c++) {
+        if (sim_loss > 0 && sim_uniform() < sim_loss) {
+            lost++;
+            continue;
+        }
+        sim_packet_t *p = packet_alloc();
+        double delay = sim_delay * (1 + 0.1 * sim_uniform());
+        if (sim_reorder > 0 && sim_uniform() < sim_reorder)
+            delay += sim_delay * 5 * sim_uniform();
+        p->at = sim_now + delay;
+        p->seq = sim_seq++;
+        p->to_server = to_server;
+        p->dest = dest;
+        p->gen = gen;
+        p->from = from;
+        p->from_gen = from_gen;
+        p->len = len < SIM_PACKET ? len : SIM_PACKET;
+        memcpy(p->data, data, p->len);
+        heap_push(p);
+    }
+}
+
+// Côté client : vers le port bien connu ou le port de la session
+static void client_send(void *ctx, const struct sockaddr_in *to, const unsigned char *pkt, size_t len) {
+    sim_client_t *c = ctx;
+    int port = ntohs(to->sin_port);
+    net_send(1, port == SIM_PORT ? -1 : port - SIM_TID_BASE, 0, c - clients, c->gen, pkt, len);
+}
+
+// Côté serveur : opérations de la machine à états
+static size_t session_read(void *ctx, unsigned char *buf, size_t len) {
+    sim_session_t *s = ctx;
+    size_t n = s->size - s->pos < len ? s->size - s->pos : len;
+    memcpy(buf, s->src + s->pos, n);
+    s->pos += n;
+    return n;
+}
+
+static int session_write(void *ctx, const unsigned char *data, size_t len, int last) {
+    sim_session_t *s = ctx;
+    sim_client_t *c = &clients[s->client];
+    if (s->pos + len > s->size || memcmp(s->src + s->pos, data, len) != 0)
+        sim_violation(c->id, "%s", "WRQ : données écrites différentes de celles envoyées");
+    s->pos += len;
+    if (last) {
+        if (s->pos != s->size)
+            sim_violation(c->id, "%s", "WRQ : fichier mis en place incomplet");
+        if (c->gen == s->client_gen) {
+            c->commits++;
+            c->session = s->index;
+            c->session_gen = s->gen;
+        }
+    }
+    return 0;
+}
+
+static int session_send(void *ctx, const unsigned char *pkt, size_t len) {
+    sim_session_t *s = ctx;
+    net_send(0, s->client, s->client_gen, s->index, 0, pkt, len);
+    return 0;
+}
+
+static const fsm_ops_t sim_ops = { session_read, session_write, session_send, NULL };
+
+// Après chaque événement d'une session : timer réarmé ou session libérée
+static void session_update(sim_session_t *s) {
+    if (fsm_over(&s->fsm)) {
+        s->in_use = 0;
+        live_sessions--;
+        free_sessions[nfree_sessions++] = s->index;
+        return;
+    }
+    double d = fsm_deadline(&s->fsm);
+    if (d < 0 || (timers_len > timers_head && timers[timers_len - 1].index == s->index &&
+                  timers[timers_len - 1].gen == s->gen && timers[timers_len - 1].at == d))
+        return;
+    if (timers_len == timers_cap) {
+        if (timers_head > timers_cap / 2) {
+            memmove(timers, timers + timers_head, (timers_len - timers_head) * sizeof(*timers));
+            timers_len -= timers_head;
+            timers_head = 0;
+        } else {
+            timers_cap = timers_cap ? timers_cap * 2 : 1024;
+            if (!(timers = realloc(timers, timers_cap * sizeof(*timers)))) {
+                perror("realloc");
+                exit(2);
+            }
+        }
+    }
+    timers[timers_len++] = (sim_timer_t){ d, s->index, s->gen };
+}
+
+// Première échéance encore valable, NULL si aucune
+static sim_session_t *timers_front(double *at) {
+    while (timers_head < timers_len) {
+        sim_timer_t *e = &timers[timers_head];
+        sim_session_t *s = sessions[e->index];
+        if (s->in_use && s->gen == e->gen && fsm_deadline(&s->fsm) == e->at) {
+            *at = e->at;
+            return s;
+        }
+        timers_head++;
+    }
+    return NULL;
+}
+
+// Requête reçue sur le port bien connu : nouvelle session (comme ServerS, une par requête reçue)
+static void server_request(const sim_packet_t *p) {
+    tftp_packet_t req;
+    int opcode = tftp_parse(p->data, p->len, &req);
+    sim_client_t *c = &clients[p->from];
+    if ((opcode != OP_RRQ && opcode != OP_WRQ) || req.filename[0] != 'f') {
+        sim_violation(c->id, "%s", "requête mal formée");
+        return;
+    }
+    int idx;
+    if (nfree_sessions) {
+        idx = free_sessions[--nfree_sessions];
+    } else {
+        if (nsessions == SIM_MAX_SESSIONS) {
+            sim_violation(c->id, "%s", "trop de sessions serveur simultanées");
+            return;
+        }
+        idx = nsessions++;
+        sessions = realloc(sessions, nsessions * sizeof(*sessions));
+        free_sessions = realloc(free_sessions, nsessions * sizeof(*free_sessions));
+        if (!(sessions[idx] = malloc(sizeof(sim_session_t)))) {
+            perror("malloc");
+            exit(2);
+        }
+        sessions[idx]->index = idx;
+        sessions[idx]->gen = 0;
+    }
+    sim_session_t *s = sessions[idx];
+    s->gen++;
+    s->in_use = 1;
+    s->client = p->from;
+    s->client_gen = p->from_gen;
+    s->pos = 0;
+    sim_file(atoi(req.filename + 1), &s->src, &s->size);
+    live_sessions++;
+    fsm_ops_t ops = sim_ops;
+    ops.ctx = s;
+    if (opcode == OP_RRQ)
+        fsm_start_rrq(&s->fsm, &ops, NULL, 0);
+    else
+        fsm_start_wrq(&s->fsm, &ops);
+    fsm_flush(&s->fsm, sim_now);
+    session_update(s);
+}
+
+static void deliver(sim_packet_t *p) {
+    delivered++;
+    uint64_t at;
+    memcpy(&at, &p->at, sizeof(at));
+    fingerprint = (fingerprint ^ at ^ ((uint64_t)p->dest << 32) ^ p->len) * 0x100000001b3ULL;
+
+    if (p->to_server) {
+        if (p->dest < 0) {
+            server_request(p);
+            return;
+        }
+        sim_session_t *s = p->dest < nsessions ? sessions[p->dest] : NULL;
+        // Session terminée, ou port réattribué à un autre client : paquet sans destinataire
+        if (!s || !s->in_use || s->client != p->from || s->client_gen != p->from_gen)
+            return;
+        if (fsm_input(&s->fsm, p->data, p->len, sim_now) && s->fsm.pending)
+            fsm_flush(&s->fsm, sim_now);    // Pas de limiteur de débit : le bloc suivant part aussitôt
+        session_update(s);
+        return;
+    }
+    sim_client_t *c = &clients[p->dest];
+    if (!c->busy || c->gen != p->gen || c->t.state >= T_DONE)
+        return;
+    struct sockaddr_in from = { .sin_family = AF_INET, .sin_port = htons(SIM_TID_BASE + p->from), .sin_addr = server_ip };
+    transfer_input(&c->t, p->data, p->len, &from, sim_now);
+}
+
+static int started, finished, failures, wrq_count;
+static double sim_wrq = 0.5;
+
+static void client_start(sim_client_t *c) {
+    static const options_t opt = { DATA_SIZE, 1, -1, 0, 0 };
+    transfer_t *t = &c->t;
+    c->busy = 1;
+    c->gen++;
+    c->id = started++;
+    c->commits = 0;
+    sim_file(c->id, &c->src, &c->size);
+    memset(t, 0, sizeof(*t));
+    t->server.sin_family = AF_INET;
+    t->server.sin_port = htons(SIM_PORT);
+    t->server.sin_addr = server_ip;
+    t->opcode = sim_uniform() < sim_wrq ? OP_WRQ : OP_RRQ;
+    wrq_count += t->opcode == OP_WRQ;
+    snprintf(t->filename, sizeof(t->filename), "f%d", c->id);
+    t->sock = -1;
+    t->send = client_send;
+    t->send_ctx = c;
+    transfer_reset(t, &opt, 0, sim_now);
+    if (ftruncate(c->memfd, 0) < 0 || lseek(c->memfd, 0, SEEK_SET) < 0 ||
+        (t->opcode == OP_WRQ && pwrite(c->memfd, c->src, c->size, 0) != (ssize_t)c->size)) {
+        perror("memfd");
+        exit(2);
+    }
+    t->fd = dup(c->memfd);          // Fermé par transfer_close()
+    t->out = malloc(PACKET_SIZE);
+    if (t->fd < 0 || !t->out) {
+        perror("dup");
+        exit(2);
+    }
+    transfer_request(t, &opt, 0, sim_now);
+}
+
+// Transfert terminé côté client : vérifications
+static void client_end(sim_client_t *c) {
+    transfer_t *t = &c->t;
+    c->busy = 0;
+    finished++;
+    if (t->state == T_FAILED) {
+        failures++;
+        if (sim_loss == 0)
+            sim_violation(c->id, "échec sans pertes : %s", t->error);
+        else if (c->commits && !(sessions[c->session]->in_use && sessions[c->session]->gen == c->session_gen))
+            sim_violation(c->id, "%s", "WRQ : échec du client sur un fichier mis en place, session serveur déjà terminée");
+        transfer_close(t);
+        return;
+    }
+    bytes_done += c->size;
+    if (t->opcode == OP_RRQ) {
+        ssize_t n = pread(c->memfd, check, c->size + 1, 0);
+        if (n != (ssize_t)c->size || memcmp(check, c->src, c->size) != 0)
+            sim_violation(c->id, "%s", "RRQ : fichier reçu différent de la source");
+    } else if (c->commits != 1) {
+        sim_violation(c->id, "%s", c->commits ? "WRQ : fichier mis en place plusieurs fois"
+                                              : "WRQ : dernier ACK reçu sans fichier mis en place");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int n = SIM_TRANSFERS, concurrency = SIM_CONCURRENCY, c;
+    double min_rate = 0;
+    while ((c = getopt(argc, argv, "n:j:s:l:r:u:d:z:w:m:")) != -1) {
+        switch (c) {
+        case 'n': n = atoi(optarg); break;
+        case 'j': concurrency = atoi(optarg); break;
+        case 's': sim_seed = strtoull(optarg, NULL, 0); break;
+        case 'l': sim_loss = atof(optarg); break;
+        case 'r': sim_reorder = atof(optarg); break;
+        case 'u': sim_dup = atof(optarg); break;
+        case 'd': sim_delay = atof(optarg) / 1000; break;
+        case 'z': sim_size_max = strtoul(optarg, NULL, 0); break;
+        case 'w': sim_wrq = atof(optarg); break;
+        case 'm': min_rate = atof(optarg); break;
+        default: n = -1; break;
+        }
+    }
+    if (n < 0 || concurrency < 1 || sim_loss < 0 || sim_loss >= 1 || sim_delay <= 0 ||
+        sim_size_max > SIM_POOL / 2) {
+        fprintf(stderr, "Utilisation : %s [-n transferts] [-j simultanés] [-s graine] [-l perte] [-r réordonnancement]\n"
+                        "          [-u duplication] [-d délai_ms] [-z taille_max] [-w proportion_wrq] [-m transferts/s_min]\n"
+                        "Probabilités entre 0 et 1 ; taille_max au plus %d octets.\n", argv[0], SIM_POOL / 2);
+        return 2;
+    }
+
+    sim_rng = sim_seed;
+    pool = malloc(SIM_POOL);
+    check = malloc(sim_size_max + 1);
+    clients = calloc(concurrency, sizeof(*clients));
+    if (!pool || !check || !clients) {
+        perror("malloc");
+        return 2;
+    }
+    for (size_t i = 0; i < SIM_POOL; i += 8) {
+        uint64_t v = sim_next();
+        memcpy(pool + i, &v, 8);
+    }
+    for (int i = 0; i < concurrency; i++) {
+        clients[i].memfd = syscall(SYS_memfd_create, "sim", 0);
+        if (clients[i].memfd < 0) {
+            perror("memfd_create");
+            return 2;
+        }
+    }
+    inet_pton(AF_INET, "10.0.0.1", &server_ip);
+    inet_pton(AF_INET, "10.0.0.2", &client_ip);
+
+    double wall = mono_now();
+    while (finished < n || live_sessions > 0) {
+        for (int i = 0; i < concurrency && started < n; i++)
+            if (!clients[i].busy)
+                client_start(&clients[i]);
+
+        // Prochain événement : livraison d'un paquet ou timer d'un client ou d'une session
+        double next = heap_len ? heap[0]->at : -1;
+        for (int i = 0; i < concurrency; i++) {
+            transfer_t *t = &clients[i].t;
+            if (clients[i].busy && t->state <= T_TRANSFER && (next < 0 || t->deadline < next))
+                next = t->deadline;
+        }
+        double at;
+        if (timers_front(&at) && (next < 0 || at < next))
+            next = at;
+        if (next < 0) {
+            sim_violation(started, "%s", "plus aucun événement : transferts ou sessions bloqués");
+            break;
+        }
+        if (next > sim_now)
+            sim_now = next;
+
+        while (heap_len && heap[0]->at <= sim_now) {
+            sim_packet_t *p = heap_pop();
+            deliver(p);
+            packet_free(p);
+        }
+        for (int i = 0; i < concurrency; i++) {
+            transfer_t *t = &clients[i].t;
+            if (clients[i].busy && t->state <= T_TRANSFER && t->deadline <= sim_now) {
+                transfer_timeout(t, sim_now);
+                client_retransmits += t->state <= T_TRANSFER;
+            }
+            if (clients[i].busy && t->state >= T_DONE)
+                client_end(&clients[i]);
+        }
+        sim_session_t *s;
+        while ((s = timers_front(&at)) && at <= sim_now) {
+            server_retransmits += fsm_timeout(&s->fsm, sim_now);
+            session_update(s);
+        }
+    }
+    wall = mono_now() - wall;
+
+    printf("Simulation : %d transferts (%d RRQ, %d WRQ), %d simultanés, graine %llu\n",
+           started, started - wrq_count, wrq_count, concurrency, (unsigned long long)sim_seed);
+    printf("Réseau : délai %.3f ms, perte %.3f, réordonnancement %.3f, duplication %.3f\n",
+           sim_delay * 1000, sim_loss, sim_reorder, sim_dup);
+    printf("Résultat : %d réussis, %d abandonnés ; %llu paquets envoyés, %llu perdus, %llu dupliqués, %llu livrés\n",
+           finished - failures, failures, sent, lost, duplicated, delivered);
+    printf("Retransmissions : %llu client, %llu serveur ; %d sessions serveur au plus\n",
+           client_retransmits, server_retransmits, nsessions);
+    printf("Temps virtuel %.3f s (%.2f Mo/s) ; temps réel %.3f s : %.0f transferts/s, %.0f paquets/s\n",
+           sim_now, sim_now > 0 ? bytes_done / sim_now / 1e6 : 0, wall,
+           wall > 0 ? finished / wall : 0, wall > 0 ? delivered / wall : 0);
+    printf("Empreinte : %016llx\n", fingerprint);
+    if (violations) {
+        printf("%d anomalie(s)\n", violations);
+        return 1;
+    }
+    printf("Aucune anomalie\n");
+    if (min_rate > 0 && finished < min_rate * wall) {
+        printf("Seuil dépassé : %.0f transferts/s < %.0f\n", finished / wall, min_rate);
+        return 1;
+    }
+    return 0;
+}
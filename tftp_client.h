@@ -0,0 +1,374 @@
+#ifndef TFTP_CLIENT_H
+#define TFTP_CLIENT_H
+
+/*
+ * Côté client : options (RFC 2347/2348/2349/7440, reprise "offset" de
+ * tftp_resume.h) et machine à états d'un
+ * transfert non bloquant, partagées par client.c (mode lot) et replay.c.
+ *
+ * Un transfert a sa propre socket UDP non bloquante ; l'appelant lui passe les
+ * paquets reçus (transfer_input) et l'expiration de son timer (transfer_timeout),
+ * la boucle d'événements (epoll) reste chez lui. Le temps est toujours passé en
+ * paramètre (now) : sim.c fait tourner la même machine à états sans socket
+ * (t->send) sur un réseau simulé à horloge virtuelle.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+
+#include "tftp_codec.h"
+#include "tftp_resume.h"
+
+#ifndef PACKET_SIZE
+#define PACKET_SIZE 516
+#endif
+#ifndef DATA_SIZE
+#define DATA_SIZE 512
+#endif
+#ifndef MAX_BLKSIZE
+#define MAX_BLKSIZE 65464
+#endif
+#ifndef MAX_RETRIES
+#define MAX_RETRIES 5
+#endif
+#ifndef TIMEOUT
+#define TIMEOUT 2
+#endif
+
+// Options demandées puis négociées
+typedef struct {
+    int blksize;
+    int windowsize;
+    long long tsize;    // -1 si inconnue
+    long long offset;   // Reprise : octets déjà présents localement (RRQ), 0 sinon
+    int resume;         // -R : les RRQ reprennent les fichiers locaux partiels
+} options_t;
+
+// Construit une requête avec options, retourne sa longueur
+static inline int build_request(char *buffer, size_t cap, int opcode, const char *filename, const options_t *opt) {
+    unsigned char *b = (unsigned char *)buffer;
+    char blksize[12], windowsize[12], tsize[24];
+    snprintf(blksize, sizeof(blksize), "%d", opt->blksize);
+    snprintf(windowsize, sizeof(windowsize), "%d", opt->windowsize);
+    snprintf(tsize, sizeof(tsize), "%lld", opt->tsize < 0 ? 0 : opt->tsize);
+    size_t len = tftp_put_request(b, cap, opcode, filename, "octet");
+    len = tftp_put_option(b, cap, len, "blksize", blksize);
+    len = tftp_put_option(b, cap, len, "windowsize", windowsize);
+    len = tftp_put_option(b, cap, len, "tsize", tsize);
+    if (opt->offset > 0) {
+        char offset[24];
+        snprintf(offset, sizeof(offset), "%lld", opt->offset);
+        len = tftp_put_option(b, cap, len, RESUME_OPTION, offset);
+    }
+    return len > 0 ? (int)len : -1;
+}
+
+// Options d'un OACK déjà analysé : les options absentes gardent leur valeur par défaut
+static inline void options_from_oack(const tftp_packet_t *pkt, options_t *opt) {
+    const char *v;
+    opt->blksize = (v = tftp_option(pkt, "blksize")) ? atoi(v) : DATA_SIZE;
+    opt->windowsize = (v = tftp_option(pkt, "windowsize")) ? atoi(v) : 1;
+    opt->tsize = (v = tftp_option(pkt, "tsize")) ? atoll(v) : -1;
+    opt->offset = (v = tftp_option(pkt, RESUME_OPTION)) ? atoll(v) : 0;
+    if (opt->blksize < 8 || opt->blksize > MAX_BLKSIZE)
+        opt->blksize = DATA_SIZE;
+    if (opt->windowsize < 1)
+        opt->windowsize = 1;
+}
+
+enum { T_PENDING, T_REQUEST, T_TRANSFER, T_DONE, T_FAILED };
+
+typedef struct {
+    struct sockaddr_in server;      // Adresse du port bien connu
+    struct sockaddr_in peer;        // Adresse du serveur pour ce transfert (TID), connue à la 1re réponse
+    int opcode;
+    char filename[256];
+    char local[256];
+    char part[272];                 // RRQ sans reprise : reçu sous ce nom, renommé en local au succès (vide sinon)
+    int state;
+    int sock, fd;
+    int blksize;
+    uint16_t block;                 // RRQ : dernier bloc reçu ; WRQ : dernier bloc envoyé
+    int final_sent;                 // WRQ : le dernier bloc envoyé était le dernier du fichier
+    unsigned char *out;             // Dernier paquet envoyé, pour la retransmission
+    size_t out_len;
+    double deadline;
+    double attempt_start;           // Date d'envoi de la requête (tentative en cours)
+    int retries, attempts, fatal;
+    long long bytes;
+    long long offset;               // RRQ : reprise demandée, puis acceptée (0 si le transfert part du début)
+    long long tsize;                // RRQ : taille annoncée dans l'OACK, -1 si inconnue
+    double started, elapsed;
+    double first_reply;             // Délai entre la requête et la première réponse (-1 si aucune)
+    char error[128];
+    // Envoi sans socket (sock < 0) : fourni par le simulateur
+    void (*send)(void *ctx, const struct sockaddr_in *to, const unsigned char *pkt, size_t len);
+    void *send_ctx;
+} transfer_t;
+
+static inline double mono_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// (Re)envoie le dernier paquet et réarme le timer
+static inline void transfer_send(transfer_t *t, double now) {
+    struct sockaddr_in *to = t->state == T_REQUEST ? &t->server : &t->peer;
+    if (t->send)
+        t->send(t->send_ctx, to, t->out, t->out_len);
+    else
+        sendto(t->sock, t->out, t->out_len, 0, (struct sockaddr *)to, sizeof(*to));
+    t->deadline = now + TIMEOUT;
+}
+
+static inline void transfer_close(transfer_t *t) {
+    if (t->sock >= 0)
+        close(t->sock);     // Retire aussi la socket de l'epoll
+    if (t->fd >= 0)
+        close(t->fd);
+    t->sock = t->fd = -1;
+    free(t->out);
+    t->out = NULL;
+}
+
+static inline void transfer_fail(transfer_t *t, int fatal, const char *fmt, const char *detail) {
+    snprintf(t->error, sizeof(t->error), fmt, detail);
+    t->fatal = fatal;
+    t->state = T_FAILED;
+    transfer_close(t);
+    if (t->part[0]) {
+        unlink(t->part);    // Le fichier local d'origine, s'il existait, n'a pas été touché
+        t->part[0] = '\0';
+    }
+}
+
+// Transfert réussi ; une RRQ reçue sous un nom temporaire prend la place du fichier local
+static inline void transfer_done(transfer_t *t) {
+    if (t->opcode == OP_RRQ && t->tsize >= 0 && t->offset + t->bytes != t->tsize) {
+        transfer_fail(t, 0, "%s", "taille reçue différente de tsize");   // Reprise sur un fichier local faux...
+        return;
+    }
+    t->state = T_DONE;
+    transfer_close(t);
+    if (t->part[0] && rename(t->part, t->local) < 0)
+        transfer_fail(t, 1, "fichier local : %s", strerror(errno));
+    t->part[0] = '\0';
+}
+
+// Nouvelle tentative : compteurs remis à zéro
+static inline void transfer_reset(transfer_t *t, const options_t *opt, int fast, double now) {
+    t->attempts++;
+    t->retries = 0;
+    t->block = 0;
+    t->final_sent = 0;
+    t->bytes = 0;
+    t->fatal = 0;
+    t->error[0] = '\0';
+    t->first_reply = -1;
+    t->attempt_start = now;
+    t->blksize = fast ? opt->blksize : DATA_SIZE;
+    if (t->attempts == 1)
+        t->started = now;
+    t->offset = 0;
+    t->tsize = -1;
+}
+
+/*
+ * Envoie la requête ; le fichier local (t->fd) et le tampon d'envoi (t->out,
+ * au moins PACKET_SIZE octets et blksize + 4) sont prêts.
+ */
+static inline int transfer_request(transfer_t *t, const options_t *opt, int fast, double now) {
+    int len;
+    struct stat st;
+    if (fast) {
+        // Options sans fenêtre : la machine à états avance bloc par bloc
+        options_t req = { opt->blksize, 1, -1, t->offset, 0 };
+        if (t->opcode == OP_WRQ && fstat(t->fd, &st) == 0)
+            req.tsize = st.st_size;
+        len = build_request((char *)t->out, PACKET_SIZE, t->opcode, t->filename, &req);
+    } else {
+        len = tftp_put_request(t->out, PACKET_SIZE, t->opcode, t->filename, "octet");
+        if (t->offset > 0) {
+            char offset[24];
+            snprintf(offset, sizeof(offset), "%lld", t->offset);
+            len = tftp_put_option(t->out, PACKET_SIZE, len, RESUME_OPTION, offset);
+            len = tftp_put_option(t->out, PACKET_SIZE, len, "tsize", "0");    // Taille finale vérifiée
+        }
+        len = len > 0 ? len : -1;
+    }
+    if (len < 0) {
+        transfer_fail(t, 1, "%s", "nom de fichier trop long");
+        return -1;
+    }
+    t->out_len = len;
+    t->state = T_REQUEST;
+    transfer_send(t, now);
+    return 0;
+}
+
+/*
+ * Démarre (ou redémarre) un transfert : ouverture, socket, envoi de la requête.
+ * La socket est ajoutée à l'epoll epfd (si epfd >= 0) avec le transfert en data.ptr.
+ */
+static inline int transfer_begin(transfer_t *t, int epfd, const options_t *opt, int fast, double now) {
+    transfer_reset(t, opt, fast, now);
+
+    // Reprise : le fichier local partiel est gardé, sa taille est demandée comme offset
+    int resume = t->opcode == OP_RRQ && opt->resume;
+    struct stat st;
+    if (t->opcode == OP_RRQ && !resume && (stat(t->local, &st) < 0 ? errno == ENOENT : S_ISREG(st.st_mode))) {
+        // Sans reprise : réception sous un nom temporaire, le fichier local existant reste intact jusqu'au succès
+        snprintf(t->part, sizeof(t->part), "%s.XXXXXX", t->local);
+        t->fd = mkstemp(t->part);
+        if (t->fd >= 0)
+            fchmod(t->fd, 0644);    // mkstemp crée en 0600
+        else
+            t->part[0] = '\0';
+    } else {
+        t->fd = t->opcode == OP_RRQ ? open(t->local, O_WRONLY | O_CREAT | (resume ? 0 : O_TRUNC), 0644)
+                                    : open(t->local, O_RDONLY);
+    }
+    if (t->fd < 0) {
+        transfer_fail(t, 1, "fichier local : %s", strerror(errno));
+        return -1;
+    }
+    t->offset = resume && fstat(t->fd, &st) == 0 ? st.st_size : 0;
+    t->out = malloc(t->blksize + 4 > PACKET_SIZE ? t->blksize + 4 : PACKET_SIZE);
+    t->sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = t };
+    if (!t->out || t->sock < 0 || (epfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, t->sock, &ev) < 0)) {
+        transfer_fail(t, 0, "socket : %s", strerror(errno));
+        return -1;
+    }
+    return transfer_request(t, opt, fast, now);
+}
+
+// WRQ : envoie le bloc suivant (lu avec pread à sa position)
+static inline void transfer_next_block(transfer_t *t, double now) {
+    uint16_t block = t->block + 1;
+    ssize_t n = pread(t->fd, t->out + 4, t->blksize, (off_t)t->bytes);
+    if (n < 0) {
+        transfer_fail(t, 0, "lecture : %s", strerror(errno));
+        return;
+    }
+    tftp_put_header(t->out, OP_DATA, block);
+    t->out_len = n + 4;
+    t->block = block;
+    t->final_sent = n < t->blksize;
+    t->bytes += n;
+    t->retries = 0;
+    transfer_send(t, now);
+}
+
+static inline void transfer_ack(transfer_t *t, uint16_t block, double now) {
+    t->out_len = tftp_put_ack(t->out, block);
+    t->retries = 0;
+    transfer_send(t, now);
+}
+
+/*
+ * RRQ : position de départ acceptée par le serveur (0 s'il a ignoré l'option).
+ * Le fichier local est placé à cette position, ou vidé si le transfert repart
+ * du début. Retourne 0 si le transfert a échoué.
+ */
+static inline int transfer_resume(transfer_t *t, long long offset) {
+    if (t->offset == 0)
+        return 1;               // Pas de reprise demandée : fichier déjà vide
+    if (offset != t->offset)
+        offset = 0;             // Autre position que celle demandée : on ne s'y fie pas
+    t->offset = offset;
+    if (offset ? lseek(t->fd, offset, SEEK_SET) != offset : ftruncate(t->fd, 0) < 0) {
+        transfer_fail(t, 0, "fichier local : %s", strerror(errno));
+        return 0;
+    }
+    return 1;
+}
+
+// Traite un paquet reçu par le transfert
+static inline void transfer_input(transfer_t *t, const unsigned char *pkt, int n, const struct sockaddr_in *from, double now) {
+    if (n < 4 || from->sin_addr.s_addr != t->server.sin_addr.s_addr)
+        return;
+    if (t->state == T_REQUEST) {
+        t->first_reply = now - t->attempt_start;
+        t->peer = *from;            // Le serveur répond depuis le port dédié au transfert
+        t->state = T_TRANSFER;
+    } else if (from->sin_port != t->peer.sin_port) {
+        return;                     // Autre TID : paquet égaré
+    }
+    tftp_packet_t p;
+    int opcode = tftp_parse(pkt, n, &p);
+    uint16_t block = p.block;
+
+    if (opcode == OP_ERROR) {
+        char msg[100];
+        snprintf(msg, sizeof(msg), "%.*s", (int)p.len, (const char *)p.data);
+        transfer_fail(t, 1, "erreur du serveur : %s", msg);
+        return;
+    }
+    if (opcode == OP_OACK && t->block == 0 && t->bytes == 0) {
+        options_t got;
+        options_from_oack(&p, &got);
+        t->blksize = got.blksize;
+        t->tsize = got.tsize;
+        if (t->opcode == OP_RRQ && !transfer_resume(t, got.offset))
+            return;
+        if (t->opcode == OP_RRQ)
+            transfer_ack(t, 0, now);
+        else
+            transfer_next_block(t, now);
+        return;
+    }
+
+    if (t->opcode == OP_RRQ && opcode == OP_DATA) {
+        if (t->block == 0 && t->bytes == 0 && t->out[1] != OP_ACK) {
+            t->blksize = DATA_SIZE;     // Réponse directe par DATA : options ignorées par le serveur
+            if (!transfer_resume(t, 0))
+                return;
+        }
+        if (block == (uint16_t)(t->block + 1)) {
+            int len = p.len;
+            if (write(t->fd, p.data, len) != len) {
+                transfer_fail(t, 0, "écriture : %s", strerror(errno));
+                return;
+            }
+            t->block = block;
+            t->bytes += len;
+            transfer_ack(t, block, now);
+            if (len < t->blksize)
+                transfer_done(t);
+        } else if (block == t->block) {
+            transfer_ack(t, block, now);    // Notre ACK s'est perdu
+        }
+    } else if (t->opcode == OP_WRQ && opcode == OP_ACK && block == t->block) {
+        if (t->final_sent) {
+            transfer_done(t);
+        } else {
+            if (block == 0)
+                t->blksize = DATA_SIZE;     // ACK 0 : pas d'options
+            transfer_next_block(t, now);
+        }
+    }
+}
+
+// Timer expiré : retransmission ou abandon
+static inline void transfer_timeout(transfer_t *t, double now) {
+    if (++t->retries > MAX_RETRIES) {
+        transfer_fail(t, 0, "%s", t->state == T_REQUEST ? "pas de réponse du serveur" : "timeout");
+        return;
+    }
+    transfer_send(t, now);
+}
+
+#endif
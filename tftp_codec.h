@@ -0,0 +1,196 @@
+#ifndef TFTP_CODEC_H
+#define TFTP_CODEC_H
+
+/*
+ * Lecture et construction des paquets TFTP (RRQ, WRQ, DATA, ACK, ERROR, OACK),
+ * communes aux serveurs et aux clients.
+ *
+ * tftp_parse() ne copie rien : le résultat pointe dans le tampon reçu, qui doit
+ * donc rester valide tant qu'on s'en sert. Toutes les longueurs sont vérifiées ;
+ * les chaînes (nom, mode, options) ne sont acceptées que terminées par un 0 à
+ * l'intérieur du paquet, on peut donc les utiliser directement comme chaînes C.
+ *
+ * Côté envoi, les en-têtes sont écrits dans un petit tableau fourni par
+ * l'appelant et les données restent où elles sont (iovec pour writev/sendmsg).
+ *
+ * bench_codec.c mesure le coût par paquet, fuzz_codec.c vérifie la robustesse.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/uio.h>
+
+#ifndef OP_RRQ
+#define OP_RRQ 1
+#define OP_WRQ 2
+#define OP_DATA 3
+#define OP_ACK 4
+#define OP_ERROR 5
+#endif
+#ifndef OP_OACK
+#define OP_OACK 6
+#endif
+
+#define TFTP_HEADER 4               // Opcode + bloc (ou code d'erreur)
+#define TFTP_MAX_OPTIONS 8          // Options au-delà ignorées
+
+typedef struct {
+    int opcode;
+    uint16_t block;                 // DATA/ACK : numéro de bloc ; ERROR : code d'erreur
+    const unsigned char *data;      // DATA : données ; ERROR : message (pas forcément terminé par 0)
+    size_t len;
+    const char *filename;           // RRQ/WRQ
+    const char *mode;
+    int noptions;                   // RRQ/WRQ/OACK
+    const char *opt_name[TFTP_MAX_OPTIONS];
+    const char *opt_value[TFTP_MAX_OPTIONS];
+} tftp_packet_t;
+
+// Chaîne terminée par 0 commençant à *pos, avant end ; NULL sinon
+static inline const char *tftp_string(const unsigned char **pos, const unsigned char *end) {
+    const unsigned char *s = *pos;
+    const unsigned char *z = s < end ? memchr(s, 0, end - s) : NULL;
+    if (!z)
+        return NULL;
+    *pos = z + 1;
+    return (const char *)s;
+}
+
+// Paires nom/valeur jusqu'à la fin du paquet ; une paire incomplète en fin de paquet est ignorée
+static inline void tftp_parse_options(tftp_packet_t *p, const unsigned char *pos, const unsigned char *end) {
+    p->noptions = 0;
+    while (pos < end && p->noptions < TFTP_MAX_OPTIONS) {
+        const char *name = tftp_string(&pos, end);
+        const char *value = name ? tftp_string(&pos, end) : NULL;
+        if (!value)
+            break;
+        p->opt_name[p->noptions] = name;
+        p->opt_value[p->noptions] = value;
+        p->noptions++;
+    }
+}
+
+/*
+ * Analyse un paquet de len octets. Retourne son opcode, -1 s'il est mal formé
+ * (opcode inconnu, trop court, nom ou mode non terminé).
+ */
+static inline int tftp_parse(const void *buf, size_t len, tftp_packet_t *p) {
+    const unsigned char *b = buf, *end = b + len;
+    p->block = 0;
+    if (len < 2 || b[0] != 0)
+        return -1;
+    p->opcode = b[1];
+    // Cas courant d'un transfert, traité avant le reste
+    if (__builtin_expect((p->opcode == OP_DATA || p->opcode == OP_ACK) && len >= TFTP_HEADER, 1)) {
+        p->block = (b[2] << 8) | b[3];
+        p->data = b + TFTP_HEADER;
+        p->len = len - TFTP_HEADER;
+        return p->opcode;
+    }
+    switch (p->opcode) {
+    case OP_ERROR:
+        if (len < TFTP_HEADER)
+            return -1;
+        p->block = (b[2] << 8) | b[3];
+        p->data = b + TFTP_HEADER;
+        p->len = len - TFTP_HEADER;
+        if (p->len > 0 && b[len - 1] == 0)
+            p->len--;
+        return p->opcode;
+    case OP_RRQ:
+    case OP_WRQ: {
+        const unsigned char *pos = b + 2;
+        p->filename = tftp_string(&pos, end);
+        p->mode = p->filename ? tftp_string(&pos, end) : NULL;
+        if (!p->mode)
+            return -1;
+        tftp_parse_options(p, pos, end);
+        return p->opcode;
+    }
+    case OP_OACK:
+        tftp_parse_options(p, b + 2, end);
+        return p->opcode;
+    }
+    return -1;
+}
+
+// Valeur d'une option (nom sans casse), NULL si absente
+static inline const char *tftp_option(const tftp_packet_t *p, const char *name) {
+    for (int i = 0; i < p->noptions; i++)
+        if (strcasecmp(p->opt_name[i], name) == 0)
+            return p->opt_value[i];
+    return NULL;
+}
+
+// En-tête de 4 octets : opcode et bloc (ou code d'erreur)
+static inline size_t tftp_put_header(unsigned char *buf, int opcode, uint16_t block) {
+    buf[0] = 0;
+    buf[1] = opcode;
+    buf[2] = block >> 8;
+    buf[3] = block & 0xFF;
+    return TFTP_HEADER;
+}
+
+static inline size_t tftp_put_ack(unsigned char *buf, uint16_t block) {
+    return tftp_put_header(buf, OP_ACK, block);
+}
+
+// DATA sans copie : iov[0] = en-tête écrit dans hdr, iov[1] = données. Retourne le nombre d'iovec.
+static inline int tftp_data_iov(struct iovec iov[2], unsigned char hdr[TFTP_HEADER], uint16_t block,
+                                const void *data, size_t len) {
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = tftp_put_header(hdr, OP_DATA, block);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    return 2;
+}
+
+// Ajoute une chaîne (0 compris) à len octets déjà écrits ; 0 si elle ne tient pas dans cap
+static inline size_t tftp_put_string(unsigned char *buf, size_t cap, size_t len, const char *s) {
+    size_t n = strlen(s) + 1;
+    if (len == 0 || n > cap - len)
+        return 0;
+    memcpy(buf + len, s, n);
+    return len + n;
+}
+
+// ERROR dans un tampon (message tronqué si besoin) ; retourne la longueur
+static inline size_t tftp_put_error(unsigned char *buf, size_t cap, uint16_t code, const char *msg) {
+    if (cap < TFTP_HEADER + 1)
+        return 0;
+    tftp_put_header(buf, OP_ERROR, code);
+    size_t n = 0;
+    while (n < cap - TFTP_HEADER - 1 && msg[n])
+        n++;
+    memcpy(buf + TFTP_HEADER, msg, n);
+    buf[TFTP_HEADER + n] = 0;
+    return TFTP_HEADER + n + 1;
+}
+
+// RRQ/WRQ sans options ; retourne la longueur, 0 si le tampon est trop petit
+static inline size_t tftp_put_request(unsigned char *buf, size_t cap, int opcode, const char *filename, const char *mode) {
+    if (cap < 2)
+        return 0;
+    buf[0] = 0;
+    buf[1] = opcode;
+    size_t len = tftp_put_string(buf, cap, 2, filename);
+    return tftp_put_string(buf, cap, len, mode);
+}
+
+// OACK vide, à compléter par tftp_put_option
+static inline size_t tftp_put_oack(unsigned char *buf, size_t cap) {
+    if (cap < 2)
+        return 0;
+    buf[0] = 0;
+    buf[1] = OP_OACK;
+    return 2;
+}
+
+// Ajoute une option à une requête ou un OACK de len octets ; 0 si elle ne tient pas
+static inline size_t tftp_put_option(unsigned char *buf, size_t cap, size_t len, const char *name, const char *value) {
+    len = tftp_put_string(buf, cap, len, name);
+    return tftp_put_string(buf, cap, len, value);
+}
+
+#endif
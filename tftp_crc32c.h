@@ -0,0 +1,132 @@
+#ifndef TFTP_CRC32C_H
+#define TFTP_CRC32C_H
+
+/*
+ * CRC32C (Castagnoli) calculé au fil du transfert, et cache du résultat dans
+ * un attribut étendu du fichier ("user.tftp.crc32c").
+ *
+ * Le calcul utilise l'instruction crc32 de SSE4.2 quand le processeur l'a
+ * (détection à l'exécution), sinon une table. L'attribut mémorise aussi la
+ * taille et la date de modification : un fichier modifié depuis invalide le
+ * cache, un fichier inchangé n'a jamais besoin d'être relu pour être vérifié.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define CRC32C_XATTR "user.tftp.crc32c"
+
+static inline uint32_t crc32c_sw(uint32_t crc, const unsigned char *p, size_t len) {
+    static uint32_t table[256];
+    static int ready = 0;
+    if (!ready) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c >> 1) ^ (0x82F63B78u & -(c & 1));
+            table[i] = c;
+        }
+        ready = 1;
+    }
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+    for (; len; p++, len--)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+#endif
+
+// Même convention que crc32() de zlib : démarrer avec crc = 0
+static inline uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static int has_sse42 = -1;
+    if (has_sse42 < 0)
+        has_sse42 = __builtin_cpu_supports("sse4.2");
+    crc = has_sse42 ? crc32c_hw(crc, buf, len) : crc32c_sw(crc, buf, len);
+#else
+    crc = crc32c_sw(crc, buf, len);
+#endif
+    return ~crc;
+}
+
+// Lecteur qui met à jour le CRC des octets lus (interface de netascii_reader_t)
+typedef struct {
+    FILE *fp;
+    uint32_t crc;
+} crc32c_reader_t;
+
+static inline size_t crc32c_fread(void *ctx, unsigned char *buf, size_t len) {
+    crc32c_reader_t *r = ctx;
+    size_t n = fread(buf, 1, len, r->fp);
+    r->crc = crc32c(r->crc, buf, n);
+    return n;
+}
+
+/*
+ * Lit le CRC mémorisé pour le fichier ouvert sur fd.
+ * Retourne 1 si le cache existe et correspond encore au fichier (taille, mtime).
+ */
+static inline int digest_lookup(int fd, uint32_t *crc) {
+    char value[128];
+    struct stat st;
+    ssize_t n = fgetxattr(fd, CRC32C_XATTR, value, sizeof(value) - 1);
+    if (n <= 0 || fstat(fd, &st) < 0)
+        return 0;
+    value[n] = '\0';
+    unsigned c;
+    long long size, sec;
+    long nsec;
+    if (sscanf(value, "%x %lld %lld.%ld", &c, &size, &sec, &nsec) != 4)
+        return 0;
+    if (size != (long long)st.st_size || sec != (long long)st.st_mtim.tv_sec || nsec != st.st_mtim.tv_nsec)
+        return 0;
+    *crc = c;
+    return 1;
+}
+
+// Mémorise le CRC du fichier ouvert sur fd (après la dernière écriture)
+static inline int digest_store(int fd, uint32_t crc) {
+    char value[128];
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -1;
+    int n = snprintf(value, sizeof(value), "%08x %lld %lld.%09ld", crc, (long long)st.st_size,
+                     (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+    return fsetxattr(fd, CRC32C_XATTR, value, n, 0);
+}
+
+/*
+ * Fin d'un envoi complet : compare le CRC calculé au cache ou l'y enregistre.
+ * Retourne un texte pour le journal de fin de transfert.
+ */
+static inline const char *digest_verify(int fd, uint32_t crc) {
+    uint32_t cached;
+    if (digest_lookup(fd, &cached))
+        return cached == crc ? "vérifié" : "ÉCHEC de vérification (contenu différent du cache)";
+    if (digest_store(fd, crc) < 0)
+        return errno == ENOTSUP ? "non mémorisé (xattr non supporté)" : "non mémorisé";
+    return "mémorisé";
+}
+
+#endif
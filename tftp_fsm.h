@@ -0,0 +1,207 @@
+#ifndef TFTP_FSM_H
+#define TFTP_FSM_H
+
+/*
+ * Machine à états d'une session serveur (RRQ ou WRQ), sans entrées/sorties.
+ *
+ * La session ne connaît ni socket, ni fichier, ni horloge : les paquets du
+ * client lui sont passés (fsm_input), le temps aussi (now, en secondes), et
+ * elle agit par trois fonctions de l'appelant (lecture du fichier, écriture
+ * des données reçues, envoi d'un paquet). ServerS.c la branche sur ses
+ * sockets, AF_XDP et le limiteur de débit ; server.c sur une boucle poll()
+ * à une socket par transfert ; sim.c sur un réseau simulé à horloge
+ * virtuelle.
+ *
+ * - RRQ : un bloc à la fois. Le bloc suivant est lu à l'ACK du bloc en vol,
+ *   puis envoyé par fsm_flush() (que l'appelant peut différer). Un ACK
+ *   dupliqué ne provoque pas de renvoi (syndrome de l'apprenti sorcier,
+ *   RFC 1123 4.2.3.1). La session se termine à l'ACK du dernier bloc.
+ * - WRQ : chaque bloc attendu est écrit puis confirmé ; un bloc déjà reçu est
+ *   confirmé à nouveau (notre ACK s'est perdu). Après le dernier bloc, la
+ *   session reste (FSM_RETRIES + 1) × FSM_TIMEOUT pour confirmer encore ses
+ *   répétitions : tout le budget de retransmissions du client, dont la
+ *   dernière répétition arrive sinon après la fin de la session (le client
+ *   échouerait alors sur un fichier déjà mis en place). L'attente avance par
+ *   pas de FSM_TIMEOUT : toute échéance reste now + FSM_TIMEOUT.
+ * - Sans nouvelle du client pendant FSM_TIMEOUT, le dernier paquet envoyé est
+ *   répété, FSM_RETRIES fois au plus, puis la session est abandonnée.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "tftp_codec.h"
+
+#ifndef FSM_TIMEOUT
+#define FSM_TIMEOUT 2.0
+#endif
+#ifndef FSM_RETRIES
+#define FSM_RETRIES 5
+#endif
+#define FSM_BLOCK 512
+#define FSM_PACKET (TFTP_HEADER + FSM_BLOCK)
+
+enum { FSM_ACTIVE, FSM_DALLY, FSM_DONE, FSM_FAILED };
+
+typedef struct {
+    size_t (*read)(void *ctx, unsigned char *buf, size_t len);     // RRQ : suite du fichier
+    int (*write)(void *ctx, const unsigned char *data, size_t len, int last);  // WRQ : bloc reçu, -1 si erreur
+    int (*send)(void *ctx, const unsigned char *pkt, size_t len);  // -1 : envoi à refaire plus tard
+    void *ctx;
+} fsm_ops_t;
+
+typedef struct {
+    int opcode;
+    int state;
+    uint16_t block;                 // RRQ : bloc en vol (ou prêt) ; WRQ : dernier bloc reçu
+    int pending;                    // Paquet prêt, pas encore envoyé (fsm_flush)
+    int last;                       // Le dernier bloc (court) a été lu ou reçu
+    int retries;
+    double deadline;                // Prochaine retransmission (ou fin d'attente après le dernier bloc)
+    unsigned long long bytes;       // Octets de données lus (RRQ) ou reçus (WRQ)
+    unsigned long retransmits;
+    fsm_ops_t ops;
+    unsigned char out[FSM_PACKET];  // Dernier paquet envoyé : DATA ou OACK (RRQ), ACK (WRQ)
+    size_t out_len;
+} fsm_t;
+
+static inline int fsm_over(const fsm_t *f) {
+    return f->state >= FSM_DONE;
+}
+
+// Date du prochain appel utile à fsm_timeout() ; -1 si aucun (envoi en attente ou session finie)
+static inline double fsm_deadline(const fsm_t *f) {
+    return f->pending || fsm_over(f) ? -1 : f->deadline;
+}
+
+// Envoie le paquet prêt et arme le timer ; -1 si l'envoi est à refaire plus tard
+static inline int fsm_flush(fsm_t *f, double now) {
+    if (f->ops.send(f->ops.ctx, f->out, f->out_len) < 0)
+        return -1;
+    f->pending = 0;
+    f->deadline = now + FSM_TIMEOUT;
+    return 0;
+}
+
+// RRQ : lit le bloc suivant, qui attend fsm_flush()
+static inline void fsm_load(fsm_t *f) {
+    size_t n = f->ops.read(f->ops.ctx, f->out + TFTP_HEADER, FSM_BLOCK);
+    f->block++;
+    tftp_put_header(f->out, OP_DATA, f->block);
+    f->out_len = TFTP_HEADER + n;
+    f->last = n < FSM_BLOCK;
+    f->bytes += n;
+    f->retries = 0;
+    f->pending = 1;
+}
+
+static inline void fsm_init(fsm_t *f, int opcode, const fsm_ops_t *ops) {
+    f->opcode = opcode;
+    f->state = FSM_ACTIVE;
+    f->block = 0;
+    f->pending = f->last = f->retries = 0;
+    f->deadline = 0;
+    f->bytes = 0;
+    f->retransmits = 0;
+    f->ops = *ops;
+    f->out_len = 0;
+}
+
+/*
+ * Démarre une RRQ : le bloc 1 est prêt. Avec un OACK (options acceptées),
+ * c'est lui qui part d'abord, le bloc 1 suivra l'ACK 0.
+ */
+static inline void fsm_start_rrq(fsm_t *f, const fsm_ops_t *ops, const unsigned char *oack, size_t oack_len) {
+    fsm_init(f, OP_RRQ, ops);
+    if (oack_len && oack_len <= sizeof(f->out)) {
+        memcpy(f->out, oack, oack_len);
+        f->out_len = oack_len;
+        f->pending = 1;
+    } else {
+        fsm_load(f);
+    }
+}
+
+// Démarre une WRQ : l'ACK 0 est prêt
+static inline void fsm_start_wrq(fsm_t *f, const fsm_ops_t *ops) {
+    fsm_init(f, OP_WRQ, ops);
+    f->out_len = tftp_put_ack(f->out, 0);
+    f->pending = 1;
+}
+
+// Abandon à l'initiative du serveur (écriture impossible, fichier illisible) : ERROR au client
+static inline void fsm_abort(fsm_t *f, uint16_t code, const char *msg) {
+    f->out_len = tftp_put_error(f->out, sizeof(f->out), code, msg);
+    f->ops.send(f->ops.ctx, f->out, f->out_len);
+    f->pending = 0;
+    f->state = FSM_FAILED;
+}
+
+// Paquet du client ; retourne 1 si la session a avancé (bloc suivant prêt, bloc reçu ou fin)
+static inline int fsm_input(fsm_t *f, const unsigned char *pkt, size_t n, double now) {
+    tftp_packet_t p;
+    int opcode = tftp_parse(pkt, n, &p);
+    if (fsm_over(f))
+        return 0;
+    if (opcode == OP_ERROR) {
+        f->state = FSM_FAILED;
+        return 1;
+    }
+    if (f->opcode == OP_RRQ) {
+        if (opcode != OP_ACK || p.block != f->block || f->pending)
+            return 0;
+        if (f->last)
+            f->state = FSM_DONE;
+        else
+            fsm_load(f);
+        return 1;
+    }
+
+    if (opcode != OP_DATA)
+        return 0;
+    if (p.block == f->block) {
+        f->ops.send(f->ops.ctx, f->out, f->out_len);    // Notre ACK s'est perdu
+        f->retransmits++;
+        return 0;
+    }
+    if (p.block != (uint16_t)(f->block + 1) || f->state != FSM_ACTIVE)
+        return 0;
+    int last = p.len < FSM_BLOCK;
+    if (f->ops.write(f->ops.ctx, p.data, p.len, last) < 0) {
+        fsm_abort(f, 0, "Write failed");
+        return 1;
+    }
+    f->block = p.block;
+    f->bytes += p.len;
+    f->last = last;
+    f->retries = 0;
+    f->out_len = tftp_put_ack(f->out, f->block);
+    f->ops.send(f->ops.ctx, f->out, f->out_len);
+    f->deadline = now + FSM_TIMEOUT;
+    if (last)
+        f->state = FSM_DALLY;
+    return 1;
+}
+
+// Timer expiré (now >= fsm_deadline()) : répétition, fin de l'attente ou abandon ; retourne 1 si répété
+static inline int fsm_timeout(fsm_t *f, double now) {
+    if (f->pending || fsm_over(f) || now < f->deadline)
+        return 0;
+    if (f->state == FSM_DALLY) {
+        if (++f->retries > FSM_RETRIES)
+            f->state = FSM_DONE;
+        else
+            f->deadline = now + FSM_TIMEOUT;
+        return 0;
+    }
+    if (++f->retries > FSM_RETRIES) {
+        f->state = FSM_FAILED;
+        return 0;
+    }
+    f->ops.send(f->ops.ctx, f->out, f->out_len);
+    f->retransmits++;
+    f->deadline = now + FSM_TIMEOUT;
+    return 1;
+}
+
+#endif
@@ -0,0 +1,581 @@
+#ifndef TFTP_IMAGE_H
+#define TFTP_IMAGE_H
+
+/*
+ * Images compressées servies à la volée (RRQ).
+ *
+ * Une RRQ de "foo.bin" absent du dossier est servie depuis "foo.bin.zst"
+ * (compilé avec -DHAVE_ZSTD et -lzstd) ou "foo.bin.gz" s'il existe : le
+ * dépôt n'a pas à garder de copie décompressée des noyaux, initrd et
+ * firmwares.
+ *
+ * Le contenu décompressé est découpé en fenêtres de IMAGE_WINDOW octets,
+ * gardées dans un cache partagé par tous les transferts (et tous les threads)
+ * dans la limite de IMAGE_CACHE_MAX octets : les clients simultanés d'une même
+ * image ne la décompressent qu'une fois. Chaque image garde son décodeur, qui
+ * avance d'une fenêtre à la fois au gré du lecteur le plus en avance. Une
+ * fenêtre évincée puis redemandée oblige à repartir du début du flux (ni gzip
+ * ni zstd ne permettent d'y entrer ailleurs).
+ *
+ * La taille (option tsize, reprise, ordonnancement) vient des métadonnées du
+ * fichier compressé, sans rien décompresser : champ ISIZE de la fin d'un gzip
+ * (moins de 4 Gio), taille du contenu dans l'en-tête de trame zstd. Un gzip
+ * de plusieurs membres (fichiers concaténés) est décodé membre après membre,
+ * CRC-32 et taille vérifiés à la fin de chacun ; son ISIZE n'est que celui du
+ * dernier membre : la taille réelle le remplace dès le deuxième membre
+ * rencontré, et un transfert parti sur l'ancienne finit en erreur plutôt que
+ * sur un fichier d'une autre taille que celle annoncée.
+ *
+ * image_reader_t est la source des RRQ dans les serveurs : fichier ordinaire
+ * ou image, lu par image_fread() (interface de netascii_reader_t, CRC32C des
+ * octets lus comme crc32c_fread()).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "tftp_codec.h"
+#include "tftp_crc32c.h"
+#include "tftp_inflate.h"
+#include "tftp_resume.h"
+
+#define IMAGE_WINDOW (256 * 1024)
+#ifndef IMAGE_CACHE_MAX
+#define IMAGE_CACHE_MAX (64 << 20)
+#endif
+#define IMAGE_MAX 32                // Images gardées ouvertes (avec leurs fenêtres)
+
+enum { IMAGE_GZIP, IMAGE_ZSTD };
+
+typedef struct image {
+    char path[320];                 // Fichier compressé
+    int kind;
+    dev_t dev;                      // Identité du fichier : une nouvelle version est une autre image
+    ino_t ino;
+    off_t csize;
+    struct timespec mtime;
+    const unsigned char *map;       // Fichier compressé projeté en mémoire
+    size_t map_len;
+    long long size;                 // Taille décompressée d'après les métadonnées, -1 si inconnue
+    long long decoded;              // Position du décodeur dans le flux décompressé
+    int eof;                        // Le décodeur a atteint la fin du flux
+    long long end;                  // Taille réelle, connue à la fin du flux (-1 avant)
+    const char *error;              // Flux invalide : plus aucune lecture
+    uint32_t crc;                   // CRC-32 gzip des octets décodés
+    inflate_t z;
+    unsigned char *out;             // gzip : INFLATE_HISTORY octets d'historique + une fenêtre
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zs;
+    ZSTD_inBuffer zin;
+#endif
+    unsigned char **windows;        // Fenêtre i : octets [i * IMAGE_WINDOW, (i + 1) * IMAGE_WINDOW)
+    unsigned long *stamp;           // Dernier accès, pour l'éviction
+    size_t nwindows;
+    int refs;                       // Lecteurs ouverts
+    int stale;                      // Retirée de la table (fichier modifié) : libérée au dernier lecteur
+    unsigned long used;
+    struct image *next;             // Chaîne de toutes les images vivantes, retirées de la table comprises
+} image_t;
+
+static pthread_mutex_t image_mutex = PTHREAD_MUTEX_INITIALIZER;
+static image_t *image_table[IMAGE_MAX];
+static image_t *image_all;          // Toutes les images dont les fenêtres comptent dans image_cache_bytes
+static size_t image_cache_bytes;
+static unsigned long image_tick;
+
+static inline void image_drop_window(image_t *img, size_t w) {
+    free(img->windows[w]);
+    img->windows[w] = NULL;
+    image_cache_bytes -= IMAGE_WINDOW;
+}
+
+static inline void image_free(image_t *img) {
+    for (image_t **p = &image_all; *p; p = &(*p)->next)
+        if (*p == img) {
+            *p = img->next;
+            break;
+        }
+    for (size_t w = 0; w < img->nwindows; w++)
+        if (img->windows[w])
+            image_drop_window(img, w);
+    free(img->windows);
+    free(img->stamp);
+    free(img->out);
+#ifdef HAVE_ZSTD
+    if (img->zs)
+        ZSTD_freeDStream(img->zs);
+#endif
+    munmap((void *)img->map, img->map_len);
+    free(img);
+}
+
+/*
+ * Évince les fenêtres les moins récemment lues jusqu'à repasser sous
+ * IMAGE_CACHE_MAX, sauf la fenêtre keep_w de keep qu'on vient de décoder.
+ * Les images retirées de la table (fichier remplacé) sont évincées comme les
+ * autres : leurs fenêtres comptent dans le budget tant qu'un lecteur les tient.
+ */
+static inline void image_evict(const image_t *keep, size_t keep_w) {
+    while (image_cache_bytes > IMAGE_CACHE_MAX) {
+        image_t *victim = NULL;
+        size_t vw = 0;
+        for (image_t *img = image_all; img; img = img->next) {
+            for (size_t w = 0; w < img->nwindows; w++)
+                if (img->windows[w] && !(img == keep && w == keep_w) &&
+                    (!victim || img->stamp[w] < victim->stamp[vw])) {
+                    victim = img;
+                    vw = w;
+                }
+        }
+        if (!victim)
+            return;
+        image_drop_window(victim, vw);
+    }
+}
+
+// Taille décompressée d'après les métadonnées du fichier compressé ouvert sur fd ; -2 si format invalide
+static inline long long image_probe(int fd, int kind, off_t csize) {
+    unsigned char buf[18];
+    if (pread(fd, buf, sizeof(buf), 0) != (ssize_t)sizeof(buf))
+        return -2;
+#ifdef HAVE_ZSTD
+    if (kind == IMAGE_ZSTD) {
+        unsigned long long size = ZSTD_getFrameContentSize(buf, sizeof(buf));
+        if (size == ZSTD_CONTENTSIZE_ERROR)
+            return -2;
+        return size == ZSTD_CONTENTSIZE_UNKNOWN ? -1 : (long long)size;
+    }
+#endif
+    if (kind != IMAGE_GZIP || buf[0] != 0x1f || buf[1] != 0x8b || buf[2] != 8 ||
+        pread(fd, buf, 4, csize - 4) != 4)
+        return -2;
+    return gzip_le32(buf);   // ISIZE
+}
+
+// Fichier compressé de path : retourne le descripteur ouvert (et son type), -1 si aucun
+static inline int image_find(const char *path, char *cpath, size_t cap, int *kind, struct stat *st) {
+    static const struct { const char *suffix; int kind; } formats[] = {
+#ifdef HAVE_ZSTD
+        { ".zst", IMAGE_ZSTD },
+#endif
+        { ".gz", IMAGE_GZIP },
+    };
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        snprintf(cpath, cap, "%s%s", path, formats[i].suffix);
+        int fd = open(cpath, O_RDONLY);
+        if (fd < 0)
+            continue;
+        if (fstat(fd, st) == 0 && S_ISREG(st->st_mode)) {
+            *kind = formats[i].kind;
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+// Remet le décodeur au début du flux
+static inline int image_rewind(image_t *img) {
+    img->decoded = 0;
+    img->eof = 0;
+    img->crc = 0;
+#ifdef HAVE_ZSTD
+    if (img->kind == IMAGE_ZSTD) {
+        if (!img->zs && !(img->zs = ZSTD_createDStream()))
+            return -1;
+        ZSTD_initDStream(img->zs);
+        img->zin = (ZSTD_inBuffer){ img->map, img->map_len, 0 };
+        return 0;
+    }
+#endif
+    long start = gzip_header(img->map, img->map_len);
+    if (start < 0) {
+        img->error = "en-tête gzip invalide";
+        return -1;
+    }
+    if (!img->out && !(img->out = malloc(INFLATE_HISTORY + IMAGE_WINDOW)))
+        return -1;
+    inflate_init(&img->z, img->map + start, img->map_len - start);
+    return 0;
+}
+
+// Décode la fenêtre suivante dans win ; retourne sa taille (moins de IMAGE_WINDOW : fin du flux), -1 si erreur
+static inline long image_decode(image_t *img, unsigned char *win) {
+#ifdef HAVE_ZSTD
+    if (img->kind == IMAGE_ZSTD) {
+        ZSTD_outBuffer out = { win, IMAGE_WINDOW, 0 };
+        while (out.pos < out.size) {
+            size_t r = ZSTD_decompressStream(img->zs, &out, &img->zin);
+            if (ZSTD_isError(r)) {
+                img->error = ZSTD_getErrorName(r);
+                return -1;
+            }
+            if (img->zin.pos == img->zin.size) {
+                if (r != 0 && out.pos < out.size) {
+                    img->error = "flux tronqué";
+                    return -1;
+                }
+                if (r == 0)
+                    break;
+            }
+        }
+        return out.pos;
+    }
+#endif
+    size_t pos = INFLATE_HISTORY;
+    for (;;) {
+        size_t start = pos;
+        int r = inflate_run(&img->z, img->out, &pos, INFLATE_HISTORY + IMAGE_WINDOW);
+        img->crc = gzip_crc32(img->crc, img->out + start, pos - start);
+        if (r < 0) {
+            img->error = img->z.error;
+            return -1;
+        }
+        if (pos == INFLATE_HISTORY + IMAGE_WINDOW)
+            break;
+        // Fin d'un membre : CRC-32 et taille de fin de membre
+        const unsigned char *tail = img->z.in + img->z.in_pos - img->z.nbits / 8;
+        const unsigned char *end = img->map + img->map_len;
+        if (tail + 8 > end) {
+            img->error = "fin de fichier gzip tronquée";
+            return -1;
+        }
+        if (gzip_le32(tail) != img->crc) {
+            img->error = "CRC-32 incorrect";
+            return -1;
+        }
+        if (gzip_le32(tail + 4) != (uint32_t)img->z.total) {
+            img->error = "taille décompressée incorrecte";
+            return -1;
+        }
+        tail += 8;
+        if (tail == end)
+            break;                  // Fin du flux
+        // Membre suivant (gzip concaténés) : nouveau flux DEFLATE, sans historique commun
+        long start_next = gzip_header(tail, end - tail);
+        if (start_next < 0) {
+            img->error = "données invalides après un membre gzip";
+            return -1;
+        }
+        if (img->end < 0 && img->size >= 0) {
+            printf("Image '%s' : plusieurs membres gzip, taille réelle inconnue jusqu'à la fin du flux\n", img->path);
+            img->size = -1;         // ISIZE du dernier membre seulement
+        }
+        inflate_init(&img->z, tail + start_next, end - tail - start_next);
+        img->crc = 0;
+    }
+    long n = pos - INFLATE_HISTORY;
+    memcpy(win, img->out + INFLATE_HISTORY, n);
+    if (n == IMAGE_WINDOW)
+        memmove(img->out, img->out + IMAGE_WINDOW, INFLATE_HISTORY);   // Historique pour la fenêtre suivante
+    return n;
+}
+
+// Décode jusqu'à disposer de la fenêtre w (ou atteindre la fin du flux) ; -1 si erreur
+static inline int image_fill(image_t *img, size_t w) {
+    if (img->decoded > (long long)w * IMAGE_WINDOW) {
+        printf("Image '%s' : fenêtre %zu évincée du cache, décompression reprise au début\n", img->path, w);
+        if (image_rewind(img) < 0)
+            return -1;
+    }
+    while (!img->error && !img->eof && img->decoded <= (long long)w * IMAGE_WINDOW) {
+        size_t i = img->decoded / IMAGE_WINDOW;
+        if (i >= img->nwindows) {
+            size_t n = i + 1 > img->nwindows * 2 ? i + 1 : img->nwindows * 2;
+            unsigned char **windows = realloc(img->windows, n * sizeof(*windows));
+            if (!windows)
+                return -1;
+            img->windows = windows;
+            unsigned long *stamp = realloc(img->stamp, n * sizeof(*stamp));
+            if (!stamp)
+                return -1;
+            img->stamp = stamp;
+            memset(img->windows + img->nwindows, 0, (n - img->nwindows) * sizeof(*windows));
+            img->nwindows = n;
+        }
+        unsigned char *win = malloc(IMAGE_WINDOW);
+        if (!win)
+            return -1;
+        long n = image_decode(img, win);
+        if (n < 0) {
+            free(win);
+            printf("Image '%s' invalide : %s\n", img->path, img->error);
+            return -1;
+        }
+        img->decoded += n;
+        if (n < IMAGE_WINDOW) {
+            img->eof = 1;
+            img->end = img->decoded;
+            img->size = img->end;   // Exacte désormais, même si les métadonnées se trompaient
+        }
+        if (n == 0 || img->windows[i]) {    // Fenêtre vide (fin du flux) ou encore en cache
+            free(win);
+        } else {
+            img->windows[i] = win;
+            img->stamp[i] = ++image_tick;
+            image_cache_bytes += IMAGE_WINDOW;
+            image_evict(img, i);
+        }
+    }
+    return img->error ? -1 : 0;
+}
+
+// Copie len octets de l'image à partir de pos ; retourne le nombre copié (0 en fin d'image), -1 si erreur
+static inline long image_read(image_t *img, long long pos, unsigned char *buf, size_t len) {
+    size_t copied = 0;
+    pthread_mutex_lock(&image_mutex);
+    while (copied < len && !(img->end >= 0 && pos >= img->end)) {
+        size_t w = pos / IMAGE_WINDOW;
+        if ((w >= img->nwindows || !img->windows[w]) && image_fill(img, w) < 0) {
+            pthread_mutex_unlock(&image_mutex);
+            return copied ? (long)copied : -1;
+        }
+        if (img->end >= 0 && pos >= img->end)
+            break;                  // Fin du flux atteinte par ce décodage
+        if (w >= img->nwindows || !img->windows[w]) {
+            pthread_mutex_unlock(&image_mutex);     // Ne doit pas arriver : jamais un octet manquant pris pour la fin
+            printf("Image '%s' : fenêtre %zu absente après décodage\n", img->path, w);
+            return copied ? (long)copied : -1;
+        }
+        long long wend = (long long)(w + 1) * IMAGE_WINDOW;
+        if (img->end >= 0 && img->end < wend)
+            wend = img->end;
+        size_t n = wend - pos < (long long)(len - copied) ? (size_t)(wend - pos) : len - copied;
+        memcpy(buf + copied, img->windows[w] + (pos - (long long)w * IMAGE_WINDOW), n);
+        img->stamp[w] = ++image_tick;
+        copied += n;
+        pos += n;
+    }
+    pthread_mutex_unlock(&image_mutex);
+    return copied;
+}
+
+// Image de path, partagée (une référence de plus) ; NULL si aucune version compressée
+static inline image_t *image_get(const char *path) {
+    char cpath[320];
+    struct stat st;
+    int kind;
+    int fd = image_find(path, cpath, sizeof(cpath), &kind, &st);
+    if (fd < 0)
+        return NULL;
+    pthread_mutex_lock(&image_mutex);
+    int slot = -1;
+    for (int i = 0; i < IMAGE_MAX; i++) {
+        image_t *img = image_table[i];
+        if (!img) {
+            if (slot < 0)
+                slot = i;
+            continue;
+        }
+        if (strcmp(img->path, cpath) != 0)
+            continue;
+        if (img->dev == st.st_dev && img->ino == st.st_ino && img->csize == st.st_size &&
+            img->mtime.tv_sec == st.st_mtim.tv_sec && img->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+            img->refs++;
+            img->used = ++image_tick;
+            pthread_mutex_unlock(&image_mutex);
+            close(fd);
+            return img;
+        }
+        // Fichier remplacé : l'ancienne image reste aux lecteurs en cours
+        image_table[i] = NULL;
+        if (img->refs)
+            img->stale = 1;
+        else
+            image_free(img);
+        if (slot < 0)
+            slot = i;
+    }
+    image_t *img = calloc(1, sizeof(*img));
+    long long size = image_probe(fd, kind, st.st_size);
+    void *map = size >= -1 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (!img || map == MAP_FAILED) {
+        if (size < -1)
+            printf("Image '%s' invalide : format non reconnu\n", cpath);
+        free(img);
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        pthread_mutex_unlock(&image_mutex);
+        return NULL;
+    }
+    snprintf(img->path, sizeof(img->path), "%s", cpath);
+    img->kind = kind;
+    img->dev = st.st_dev;
+    img->ino = st.st_ino;
+    img->csize = st.st_size;
+    img->mtime = st.st_mtim;
+    img->map = map;
+    img->map_len = st.st_size;
+    img->size = size;
+    img->end = -1;
+    img->refs = 1;
+    img->used = ++image_tick;
+    img->next = image_all;
+    image_all = img;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    if (image_rewind(img) < 0) {
+        printf("Image '%s' invalide : %s\n", cpath, img->error ? img->error : "mémoire insuffisante");
+        image_free(img);
+        pthread_mutex_unlock(&image_mutex);
+        return NULL;
+    }
+    // Table pleine : on remplace l'image inutilisée la plus ancienne, sinon celle-ci ne sera pas partagée
+    for (int i = 0; slot < 0 && i < IMAGE_MAX; i++)
+        if (!image_table[i]->refs && (slot < 0 || image_table[i]->used < image_table[slot]->used))
+            slot = i;
+    if (slot >= 0 && image_table[slot])
+        image_free(image_table[slot]);
+    if (slot >= 0)
+        image_table[slot] = img;
+    else
+        img->stale = 1;
+    pthread_mutex_unlock(&image_mutex);
+    return img;
+}
+
+static inline void image_put(image_t *img) {
+    pthread_mutex_lock(&image_mutex);
+    if (--img->refs == 0 && img->stale)
+        image_free(img);
+    pthread_mutex_unlock(&image_mutex);
+}
+
+// Taille du fichier path ou de son image compressée (métadonnées), -1 si inconnue
+static inline long long image_size(const char *path) {
+    char cpath[320];
+    struct stat st;
+    int kind;
+    if (stat(path, &st) == 0)
+        return st.st_size;
+    int fd = image_find(path, cpath, sizeof(cpath), &kind, &st);
+    if (fd < 0)
+        return -1;
+    long long size = -2;
+    pthread_mutex_lock(&image_mutex);   // Image déjà ouverte : sa taille réelle peut corriger les métadonnées
+    for (int i = 0; i < IMAGE_MAX; i++) {
+        image_t *img = image_table[i];
+        if (img && strcmp(img->path, cpath) == 0 && img->dev == st.st_dev && img->ino == st.st_ino &&
+            img->csize == st.st_size && img->mtime.tv_sec == st.st_mtim.tv_sec &&
+            img->mtime.tv_nsec == st.st_mtim.tv_nsec)
+            size = img->size;
+    }
+    pthread_mutex_unlock(&image_mutex);
+    if (size == -2)
+        size = image_probe(fd, kind, st.st_size);
+    close(fd);
+    return size < 0 ? -1 : size;
+}
+
+// Source d'une RRQ : fichier ordinaire (rd.fp) ou image compressée (img)
+typedef struct {
+    crc32c_reader_t rd;             // CRC32C des octets lus
+    image_t *img;
+    long long pos;                  // Position dans l'image
+    long long size;                 // Taille donnée à l'ouverture (tsize, reprise), -1 si inconnue
+    int failed;                     // Lecture de l'image en échec (mémoire, cache)
+} image_reader_t;
+
+/*
+ * Ouvre path en lecture : le fichier lui-même s'il existe, sinon son image
+ * compressée. *size reçoit la taille (décompressée), -1 si inconnue.
+ * Retourne -1 (errno positionné) si ni l'un ni l'autre n'existe.
+ */
+static inline int image_open(image_reader_t *r, const char *path, long long *size) {
+    struct stat st;
+    memset(r, 0, sizeof(*r));
+    if ((r->rd.fp = fopen(path, "rb"))) {
+        *size = fstat(fileno(r->rd.fp), &st) == 0 ? st.st_size : -1;
+        return 0;
+    }
+    if (errno != ENOENT)
+        return -1;
+    if (!(r->img = image_get(path))) {
+        errno = ENOENT;
+        return -1;
+    }
+    pthread_mutex_lock(&image_mutex);
+    *size = r->size = r->img->size;
+    pthread_mutex_unlock(&image_mutex);
+    return 0;
+}
+
+// Lecteur (interface de netascii_reader_t) : image ou fichier, CRC32C au fil de l'eau
+static inline size_t image_fread(void *ctx, unsigned char *buf, size_t len) {
+    image_reader_t *r = ctx;
+    if (!r->img)
+        return crc32c_fread(&r->rd, buf, len);
+    long n = image_read(r->img, r->pos, buf, len);
+    if (n < 0)
+        r->failed = 1;
+    if (n <= 0)
+        return 0;
+    r->pos += n;
+    r->rd.crc = crc32c(r->rd.crc, buf, n);
+    return n;
+}
+
+/*
+ * Image invalide (flux corrompu ou tronqué), lecture en échec, ou taille
+ * réelle autre que celle annoncée à l'ouverture : le transfert doit finir en
+ * erreur, pas sur un bloc court.
+ */
+static inline int image_failed(const image_reader_t *r) {
+    if (!r->img)
+        return 0;
+    pthread_mutex_lock(&image_mutex);
+    int failed = r->failed || r->img->error || (r->size >= 0 && r->img->end >= 0 && r->img->end != r->size);
+    pthread_mutex_unlock(&image_mutex);
+    return failed;
+}
+
+static inline int image_seek(image_reader_t *r, long long offset) {
+    if (!r->img)
+        return fseeko(r->rd.fp, offset, SEEK_SET);
+    r->pos = offset;
+    return 0;
+}
+
+// Fin d'un envoi complet : digest_verify() pour un fichier ; une image est déjà vérifiée par son format
+static inline const char *image_verify(image_reader_t *r) {
+    return r->img ? "image décompressée" : digest_verify(fileno(r->rd.fp), r->rd.crc);
+}
+
+static inline void image_close(image_reader_t *r) {
+    if (r->img)
+        image_put(r->img);
+    else if (r->rd.fp)
+        fclose(r->rd.fp);
+    r->img = NULL;
+    r->rd.fp = NULL;
+}
+
+/*
+ * OACK d'une RRQ : reprise à offset (0 si aucune) et taille si le client la
+ * demande (option tsize, RFC 2349 ; pas en netascii, où la taille transférée
+ * diffère). Retourne 0 s'il n'y a aucune option à confirmer.
+ */
+static inline size_t image_oack(unsigned char *buf, size_t cap, const tftp_packet_t *req,
+                                long long size, long long offset, int netascii) {
+    size_t len = offset ? resume_oack(buf, cap, offset) : 0;
+    if (tftp_option(req, "tsize") && size >= 0 && !netascii) {
+        char value[24];
+        snprintf(value, sizeof(value), "%lld", size);
+        len = tftp_put_option(buf, cap, len ? len : tftp_put_oack(buf, cap), "tsize", value);
+    }
+    return len;
+}
+
+#endif
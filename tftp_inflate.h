@@ -0,0 +1,346 @@
+#ifndef TFTP_INFLATE_H
+#define TFTP_INFLATE_H
+
+/*
+ * Décompression DEFLATE (RFC 1951) et gzip (RFC 1952), sans dépendance.
+ *
+ * L'entrée compressée est entièrement en mémoire (fichier projeté) ; la
+ * sortie est produite par tranches, à la demande : inflate_run() s'arrête
+ * exactement quand le tampon de sortie est plein, au milieu d'une copie ou
+ * d'un bloc stocké s'il le faut, et reprend au même endroit à l'appel suivant.
+ * Le tampon de sortie doit garder devant la position d'écriture les
+ * INFLATE_HISTORY derniers octets produits (distance maximale des copies).
+ *
+ * Décodage des codes de Huffman à la manière de puff (zlib/contrib) : simple
+ * et sûr, sans tables d'accélération.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#define INFLATE_HISTORY 32768
+
+enum { INFLATE_BLOCK, INFLATE_STORED, INFLATE_CODES, INFLATE_END };
+
+typedef struct {
+    short count[16];                // Nombre de codes par longueur
+    short symbol[288];              // Symboles dans l'ordre canonique
+} inflate_huff_t;
+
+typedef struct {
+    const unsigned char *in;
+    size_t in_len, in_pos;
+    uint64_t bits;                  // Bits d'entrée pas encore consommés
+    int nbits;
+    int mode;
+    int final;                      // Le bloc en cours est le dernier
+    size_t stored;                  // Bloc stocké : octets restants
+    unsigned copy_len, copy_dist;   // Copie interrompue par la fin du tampon de sortie
+    unsigned long long total;       // Octets produits depuis le début du flux
+    const char *error;              // NULL tant que le flux est valide
+    inflate_huff_t lens, dists;
+} inflate_t;
+
+static inline void inflate_init(inflate_t *z, const unsigned char *in, size_t len) {
+    memset(z, 0, sizeof(*z));
+    z->in = in;
+    z->in_len = len;
+    z->mode = INFLATE_BLOCK;
+}
+
+// Garantit n bits disponibles (n <= 32) ; -1 si l'entrée est tronquée
+static inline int inflate_need(inflate_t *z, int n) {
+    while (z->nbits < n) {
+        if (z->in_pos >= z->in_len) {
+            z->error = "flux tronqué";
+            return -1;
+        }
+        z->bits |= (uint64_t)z->in[z->in_pos++] << z->nbits;
+        z->nbits += 8;
+    }
+    return 0;
+}
+
+static inline int inflate_bits(inflate_t *z, int n) {
+    if (inflate_need(z, n) < 0)
+        return -1;
+    int v = (int)(z->bits & ((1u << n) - 1));
+    z->bits >>= n;
+    z->nbits -= n;
+    return v;
+}
+
+// Construit un code canonique ; -1 si sur-souscrit (les codes incomplets sont acceptés)
+static inline int inflate_build(inflate_huff_t *h, const unsigned char *length, int n) {
+    short offs[16];
+    memset(h->count, 0, sizeof(h->count));
+    for (int s = 0; s < n; s++)
+        h->count[length[s]]++;
+    int left = 1;
+    for (int len = 1; len < 16; len++) {
+        left = (left << 1) - h->count[len];
+        if (left < 0)
+            return -1;
+    }
+    offs[1] = 0;
+    for (int len = 1; len < 15; len++)
+        offs[len + 1] = offs[len] + h->count[len];
+    for (int s = 0; s < n; s++)
+        if (length[s])
+            h->symbol[offs[length[s]]++] = s;
+    return 0;
+}
+
+// Symbole suivant ; -1 si code invalide ou entrée tronquée
+static inline int inflate_decode(inflate_t *z, const inflate_huff_t *h) {
+    int code = 0, first = 0, index = 0;
+    for (int len = 1; len < 16; len++) {
+        if (z->nbits == 0 && inflate_need(z, 1) < 0)
+            return -1;
+        code |= (int)(z->bits & 1);
+        z->bits >>= 1;
+        z->nbits--;
+        int count = h->count[len];
+        if (code - count < first)
+            return h->symbol[index + (code - first)];
+        index += count;
+        first = (first + count) << 1;
+        code <<= 1;
+    }
+    z->error = "code de Huffman invalide";
+    return -1;
+}
+
+static inline void inflate_fixed(inflate_t *z) {
+    unsigned char length[288];
+    memset(length, 8, 144);
+    memset(length + 144, 9, 112);
+    memset(length + 256, 7, 24);
+    memset(length + 280, 8, 8);
+    inflate_build(&z->lens, length, 288);
+    memset(length, 5, 30);
+    inflate_build(&z->dists, length, 30);
+}
+
+static inline int inflate_dynamic(inflate_t *z) {
+    static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    unsigned char length[288 + 32];
+    int nlen = inflate_bits(z, 5) + 257, ndist = inflate_bits(z, 5) + 1, ncode = inflate_bits(z, 4) + 4;
+    if (z->error)
+        return -1;
+    if (nlen > 286 || ndist > 30) {
+        z->error = "en-tête de bloc invalide";
+        return -1;
+    }
+    memset(length, 0, 19);
+    for (int i = 0; i < ncode; i++) {
+        int v = inflate_bits(z, 3);
+        if (v < 0)
+            return -1;
+        length[order[i]] = v;
+    }
+    if (inflate_build(&z->lens, length, 19) < 0) {
+        z->error = "code des longueurs invalide";
+        return -1;
+    }
+    for (int i = 0; i < nlen + ndist;) {
+        int sym = inflate_decode(z, &z->lens), len = 0, rep;
+        if (sym < 0)
+            return -1;
+        if (sym < 16) {
+            length[i++] = sym;
+            continue;
+        }
+        if (sym == 16) {
+            if (i == 0) {
+                z->error = "répétition sans longueur précédente";
+                return -1;
+            }
+            len = length[i - 1];
+            rep = 3 + inflate_bits(z, 2);
+        } else {
+            rep = sym == 17 ? 3 + inflate_bits(z, 3) : 11 + inflate_bits(z, 7);
+        }
+        if (z->error)
+            return -1;
+        if (i + rep > nlen + ndist) {
+            z->error = "trop de longueurs";
+            return -1;
+        }
+        while (rep--)
+            length[i++] = len;
+    }
+    if (length[256] == 0 || inflate_build(&z->lens, length, nlen) < 0 ||
+        inflate_build(&z->dists, length + nlen, ndist) < 0) {
+        z->error = "code de Huffman invalide";
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Produit la suite du flux dans out[*pos .. cap) ; retourne -1 si le flux est
+ * invalide (z->error), sinon 0 quand le tampon est plein ou le flux terminé
+ * (z->mode == INFLATE_END).
+ */
+static inline int inflate_run(inflate_t *z, unsigned char *out, size_t *pos, size_t cap) {
+    static const short lbase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                     35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const short lext[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const short dbase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                     513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const short dext[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                                    8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    size_t p = *pos;
+    if (z->error)
+        return -1;
+    while (p < cap && z->mode != INFLATE_END) {
+        if (z->copy_len) {
+            while (z->copy_len && p < cap) {
+                out[p] = out[p - z->copy_dist];
+                p++;
+                z->copy_len--;
+                z->total++;
+            }
+            continue;
+        }
+        if (z->mode == INFLATE_BLOCK) {
+            if (z->final) {
+                z->mode = INFLATE_END;
+                break;
+            }
+            z->final = inflate_bits(z, 1);
+            int type = inflate_bits(z, 2);
+            if (z->error)
+                break;
+            if (type == 0) {
+                z->bits >>= z->nbits & 7;       // Bloc stocké : aligné sur l'octet
+                z->nbits -= z->nbits & 7;
+                int len = inflate_bits(z, 16), nlen = inflate_bits(z, 16);
+                if (z->error)
+                    break;
+                if (len != (~nlen & 0xffff)) {
+                    z->error = "longueur de bloc stocké invalide";
+                    break;
+                }
+                z->stored = len;
+                z->mode = INFLATE_STORED;
+            } else if (type == 1) {
+                inflate_fixed(z);
+                z->mode = INFLATE_CODES;
+            } else if (type == 2) {
+                if (inflate_dynamic(z) < 0)
+                    break;
+                z->mode = INFLATE_CODES;
+            } else {
+                z->error = "type de bloc invalide";
+                break;
+            }
+        } else if (z->mode == INFLATE_STORED) {
+            // Octets encore dans le tampon de bits, puis copie directe de l'entrée
+            while (z->stored && p < cap && z->nbits >= 8) {
+                out[p++] = (unsigned char)z->bits;
+                z->bits >>= 8;
+                z->nbits -= 8;
+                z->stored--;
+                z->total++;
+            }
+            size_t n = z->stored < cap - p ? z->stored : cap - p;
+            if (n > z->in_len - z->in_pos) {
+                z->error = "flux tronqué";
+                break;
+            }
+            memcpy(out + p, z->in + z->in_pos, n);
+            z->in_pos += n;
+            p += n;
+            z->stored -= n;
+            z->total += n;
+            if (z->stored == 0)
+                z->mode = INFLATE_BLOCK;
+        } else {
+            int sym = inflate_decode(z, &z->lens);
+            if (sym < 0)
+                break;
+            if (sym < 256) {
+                out[p++] = sym;
+                z->total++;
+            } else if (sym == 256) {
+                z->mode = INFLATE_BLOCK;
+            } else {
+                sym -= 257;
+                if (sym >= 29) {
+                    z->error = "longueur invalide";
+                    break;
+                }
+                int len = lbase[sym] + inflate_bits(z, lext[sym]);
+                int dsym = inflate_decode(z, &z->dists);
+                if (dsym < 0)
+                    break;
+                if (dsym >= 30) {
+                    z->error = "distance invalide";
+                    break;
+                }
+                int dist = dbase[dsym] + inflate_bits(z, dext[dsym]);
+                if (z->error)
+                    break;
+                if ((unsigned long long)dist > z->total) {
+                    z->error = "distance avant le début du flux";
+                    break;
+                }
+                z->copy_len = len;
+                z->copy_dist = dist;
+            }
+        }
+    }
+    *pos = p;
+    return z->error ? -1 : 0;
+}
+
+// CRC-32 de gzip (polynôme 0xedb88320), même convention que crc32c()
+static inline uint32_t gzip_crc32(uint32_t crc, const unsigned char *buf, size_t len) {
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+/*
+ * En-tête gzip : retourne la position des données DEFLATE, -1 si ce n'est pas
+ * un fichier gzip valide.
+ */
+static inline long gzip_header(const unsigned char *in, size_t len) {
+    if (len < 18 || in[0] != 0x1f || in[1] != 0x8b || in[2] != 8)
+        return -1;
+    int flags = in[3];
+    size_t pos = 10;
+    if (flags & 4) {                // FEXTRA
+        pos += 2 + (in[10] | in[11] << 8);
+    }
+    for (int f = 8; f <= 16; f <<= 1) {     // FNAME, FCOMMENT : chaînes terminées par un zéro
+        if (!(flags & f))
+            continue;
+        while (pos < len && in[pos])
+            pos++;
+        pos++;
+    }
+    if (flags & 2)                  // FHCRC
+        pos += 2;
+    return pos + 8 <= len ? (long)pos : -1;
+}
+
+// Champs de fin de membre gzip : CRC-32 puis ISIZE (taille décompressée modulo 4 Gio), petit-boutistes
+static inline uint32_t gzip_le32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef TFTP_NETASCII_H
+#define TFTP_NETASCII_H
+
+/*
+ * Mode netascii (RFC 764 / RFC 1350) en flux :
+ *   envoi     : LF -> CR LF, CR -> CR NUL
+ *   réception : CR LF -> LF, CR NUL -> CR
+ *
+ * Les séquences coupées entre deux blocs sont gérées par l'état (octet reporté
+ * à l'envoi, CR en attente à la réception). La recherche des CR/LF se fait par
+ * 16 (SSE2) ou 32 (AVX2, détecté à l'exécution) octets à la fois ; les zones
+ * sans fin de ligne sont copiées d'un bloc avec memcpy.
+ */
+
+#include <string.h>
+#include <strings.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define NETASCII_CHUNK 4096         // Taille des lectures disque côté envoi
+
+typedef struct {
+    int carry;                      // Envoi : 2e octet d'une paire qui n'a pas tenu dans le bloc (-1 si aucun)
+    int pending_cr;                 // Réception : le bloc précédent finissait par CR
+    unsigned char in[NETASCII_CHUNK];
+    size_t in_pos, in_len;
+    int eof;
+} netascii_t;
+
+// Lecteur de données brutes (fichier) utilisé pour remplir les blocs, retourne 0 en fin de fichier
+typedef size_t (*netascii_reader_t)(void *ctx, unsigned char *buf, size_t len);
+
+static inline void netascii_init(netascii_t *st) {
+    st->carry = -1;
+    st->pending_cr = 0;
+    st->in_pos = st->in_len = 0;
+    st->eof = 0;
+}
+
+static inline int netascii_mode(const char *mode) {
+    return strcasecmp(mode, "netascii") == 0;
+}
+
+static inline size_t netascii_scan_scalar(const unsigned char *p, size_t n, unsigned char a, unsigned char b) {
+    size_t i = 0;
+    while (i < n && p[i] != a && p[i] != b)
+        i++;
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// SSE2 fait partie de l'ABI x86-64 : pas de détection nécessaire
+__attribute__((target("sse2")))
+static inline size_t netascii_scan_sse2(const unsigned char *p, size_t n, unsigned char a, unsigned char b) {
+    const __m128i va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b);
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + netascii_scan_scalar(p + i, n - i, a, b);
+}
+
+__attribute__((target("avx2")))
+static inline size_t netascii_scan_avx2(const unsigned char *p, size_t n, unsigned char a, unsigned char b) {
+    const __m256i va = _mm256_set1_epi8((char)a), vb = _mm256_set1_epi8((char)b);
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va),
+                                                                       _mm256_cmpeq_epi8(v, vb)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + netascii_scan_sse2(p + i, n - i, a, b);
+}
+#endif
+
+// Position du premier octet égal à a ou b dans p[0..n), n s'il n'y en a pas
+static inline size_t netascii_scan(const unsigned char *p, size_t n, unsigned char a, unsigned char b) {
+#if defined(__x86_64__) || defined(__i386__)
+    static int has_avx2 = -1;
+    if (has_avx2 < 0)
+        has_avx2 = __builtin_cpu_supports("avx2");
+    return has_avx2 ? netascii_scan_avx2(p, n, a, b) : netascii_scan_sse2(p, n, a, b);
+#else
+    return netascii_scan_scalar(p, n, a, b);
+#endif
+}
+
+/*
+ * Encode in[0..inlen) dans out (au plus outcap octets). *consumed reçoit le
+ * nombre d'octets d'entrée utilisés. Retourne le nombre d'octets produits.
+ */
+static inline size_t netascii_encode(netascii_t *st, const unsigned char *in, size_t inlen,
+                                     size_t *consumed, unsigned char *out, size_t outcap) {
+    size_t ip = 0, op = 0;
+    if (st->carry >= 0 && op < outcap) {
+        out[op++] = (unsigned char)st->carry;
+        st->carry = -1;
+    }
+    while (ip < inlen && op < outcap) {
+        size_t room = inlen - ip < outcap - op ? inlen - ip : outcap - op;
+        size_t run = netascii_scan(in + ip, room, '\r', '\n');
+        memcpy(out + op, in + ip, run);
+        ip += run;
+        op += run;
+        if (run == room)
+            break;
+        unsigned char c = in[ip++];
+        out[op++] = '\r';
+        unsigned char second = (c == '\n') ? '\n' : '\0';
+        if (op < outcap)
+            out[op++] = second;
+        else
+            st->carry = second;     // La paire est coupée entre deux blocs
+    }
+    *consumed = ip;
+    return op;
+}
+
+/*
+ * Remplit un bloc de blksize octets encodés en lisant via rd.
+ * Un résultat inférieur à blksize signifie que c'est le dernier bloc.
+ */
+static inline size_t netascii_read_block(netascii_t *st, netascii_reader_t rd, void *ctx,
+                                         unsigned char *out, size_t blksize) {
+    size_t produced = 0;
+    while (produced < blksize) {
+        if (st->in_pos == st->in_len && st->carry < 0) {
+            if (st->eof)
+                break;
+            st->in_len = rd(ctx, st->in, NETASCII_CHUNK);
+            st->in_pos = 0;
+            if (st->in_len == 0) {
+                st->eof = 1;
+                break;
+            }
+        }
+        size_t used;
+        produced += netascii_encode(st, st->in + st->in_pos, st->in_len - st->in_pos, &used,
+                                    out + produced, blksize - produced);
+        st->in_pos += used;
+    }
+    return produced;
+}
+
+/*
+ * Décode in[0..inlen) dans out (capacité inlen + 1 au moins).
+ * Retourne le nombre d'octets produits.
+ */
+static inline size_t netascii_decode(netascii_t *st, const unsigned char *in, size_t inlen, unsigned char *out) {
+    size_t ip = 0, op = 0;
+    while (ip < inlen) {
+        if (st->pending_cr) {
+            st->pending_cr = 0;
+            if (in[ip] == '\n') {
+                out[op++] = '\n';
+                ip++;
+            } else {
+                out[op++] = '\r';   // CR NUL, ou CR isolé toléré
+                if (in[ip] == '\0')
+                    ip++;
+            }
+            continue;
+        }
+        size_t run = netascii_scan(in + ip, inlen - ip, '\r', '\r');
+        memcpy(out + op, in + ip, run);
+        ip += run;
+        op += run;
+        if (ip == inlen)
+            break;
+        ip++;
+        st->pending_cr = 1;
+    }
+    return op;
+}
+
+// Fin de transfert : un CR resté seul en fin de fichier est conservé tel quel
+static inline size_t netascii_decode_finish(netascii_t *st, unsigned char *out) {
+    if (!st->pending_cr)
+        return 0;
+    st->pending_cr = 0;
+    out[0] = '\r';
+    return 1;
+}
+
+#endif
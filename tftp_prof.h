@@ -0,0 +1,225 @@
+#ifndef TFTP_PROF_H
+#define TFTP_PROF_H
+
+/*
+ * Instrumentation des étapes du chemin chaud (réception, analyse, lecture/écriture
+ * disque, envoi, attente dans select).
+ *
+ * Désactivée par défaut : sans -DTFTP_PROFILE toutes les macros sont vides et
+ * le binaire ne contient aucune trace de l'instrumentation.
+ * Avec -DTFTP_PROFILE (et -pthread), chaque thread accumule ses mesures dans son
+ * propre histogramme log-linéaire et un `kill -USR1 <pid>` affiche le tout sur stderr.
+ *
+ * Horloge : TSC (cycles) sur x86, clock_gettime(CLOCK_MONOTONIC) (ns) ailleurs
+ * ou si PROF_CLOCK_GETTIME est défini.
+ */
+
+enum prof_stage {
+    PROF_RECV,      // recvfrom / recv (inclut l'attente dans les serveurs bloquants)
+    PROF_PARSE,     // analyse de la requête (nom de fichier, mode, options)
+    PROF_READ,      // fread / read
+    PROF_WRITE,     // fwrite / write
+    PROF_SEND,      // sendto / send
+    PROF_WAIT,      // attente dans select
+    PROF_NSTAGES
+};
+
+#ifdef TFTP_PROFILE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define PROF_SUB_BITS 2                         // 4 sous-seaux par puissance de 2
+#define PROF_NBUCKETS (64 << PROF_SUB_BITS)
+
+static const char *const prof_stage_names[PROF_NSTAGES] = {
+    "recv", "parse", "read", "write", "send", "wait"
+};
+
+// Histogramme d'un thread
+typedef struct prof_hist {
+    uint64_t count[PROF_NSTAGES][PROF_NBUCKETS];
+    uint64_t sum[PROF_NSTAGES];
+    uint64_t max[PROF_NSTAGES];
+    char name[32];
+    struct prof_hist *next;
+} prof_hist_t;
+
+static pthread_mutex_t prof_mutex = PTHREAD_MUTEX_INITIALIZER;
+static prof_hist_t *prof_threads = NULL;       // Histogrammes des threads vivants
+static prof_hist_t prof_retired = { .name = "threads terminés" };
+static pthread_key_t prof_key;
+static __thread prof_hist_t *prof_tls = NULL;
+static unsigned prof_thread_seq = 0;
+
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(PROF_CLOCK_GETTIME)
+#define PROF_UNIT "cycles"
+static inline uint64_t prof_now(void) {
+    return __rdtsc();
+}
+#else
+#define PROF_UNIT "ns"
+static inline uint64_t prof_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+#endif
+
+// Indice du seau : valeur exacte en dessous de 2^SUB, puis 2^SUB seaux par octave
+static inline unsigned prof_bucket(uint64_t v) {
+    if (v < (1u << PROF_SUB_BITS))
+        return (unsigned)v;
+    unsigned msb = 63 - __builtin_clzll(v);
+    unsigned sub = (v >> (msb - PROF_SUB_BITS)) & ((1u << PROF_SUB_BITS) - 1);
+    return ((msb - PROF_SUB_BITS + 1) << PROF_SUB_BITS) + sub;
+}
+
+// Borne inférieure d'un seau (pour l'affichage)
+static inline uint64_t prof_bucket_low(unsigned b) {
+    if (b < (1u << PROF_SUB_BITS))
+        return b;
+    unsigned msb = (b >> PROF_SUB_BITS) + PROF_SUB_BITS - 1;
+    uint64_t sub = b & ((1u << PROF_SUB_BITS) - 1);
+    return (1ull << msb) | (sub << (msb - PROF_SUB_BITS));
+}
+
+static inline uint64_t prof_load(const uint64_t *p) {
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+// Seul le thread propriétaire écrit : pas besoin d'instruction verrouillée
+static inline void prof_add(uint64_t *p, uint64_t v) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + v, __ATOMIC_RELAXED);
+}
+
+// Fusionne l'histogramme d'un thread qui se termine dans prof_retired
+static void prof_thread_exit(void *arg) {
+    prof_hist_t *h = arg;
+    pthread_mutex_lock(&prof_mutex);
+    prof_hist_t **p = &prof_threads;
+    while (*p && *p != h)
+        p = &(*p)->next;
+    if (*p)
+        *p = h->next;
+    for (int s = 0; s < PROF_NSTAGES; s++) {
+        for (int b = 0; b < PROF_NBUCKETS; b++)
+            prof_add(&prof_retired.count[s][b], h->count[s][b]);
+        prof_add(&prof_retired.sum[s], h->sum[s]);
+        if (h->max[s] > prof_retired.max[s])
+            __atomic_store_n(&prof_retired.max[s], h->max[s], __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&prof_mutex);
+    free(h);
+}
+
+static prof_hist_t *prof_self(void) {
+    if (prof_tls)
+        return prof_tls;
+    prof_hist_t *h = calloc(1, sizeof(*h));
+    if (!h)
+        return NULL;
+    pthread_mutex_lock(&prof_mutex);
+    snprintf(h->name, sizeof(h->name), "thread %u", prof_thread_seq++);
+    h->next = prof_threads;
+    prof_threads = h;
+    pthread_mutex_unlock(&prof_mutex);
+    pthread_setspecific(prof_key, h);
+    prof_tls = h;
+    return h;
+}
+
+static inline void prof_record(int stage, uint64_t delta) {
+    prof_hist_t *h = prof_self();
+    if (!h)
+        return;
+    prof_add(&h->count[stage][prof_bucket(delta)], 1);
+    prof_add(&h->sum[stage], delta);
+    if (delta > h->max[stage])
+        __atomic_store_n(&h->max[stage], delta, __ATOMIC_RELAXED);
+}
+
+// Valeur approchée (borne inférieure du seau) du quantile q
+static uint64_t prof_quantile(const prof_hist_t *h, int s, uint64_t total, double q) {
+    uint64_t target = (uint64_t)(q * (double)total), acc = 0;
+    for (unsigned b = 0; b < PROF_NBUCKETS; b++) {
+        acc += prof_load(&h->count[s][b]);
+        if (acc > target)
+            return prof_bucket_low(b);
+    }
+    return prof_load(&h->max[s]);
+}
+
+static void prof_dump_one(FILE *out, const prof_hist_t *h) {
+    int printed = 0;
+    for (int s = 0; s < PROF_NSTAGES; s++) {
+        uint64_t total = 0;
+        for (unsigned b = 0; b < PROF_NBUCKETS; b++)
+            total += prof_load(&h->count[s][b]);
+        if (total == 0)
+            continue;
+        if (!printed++)
+            fprintf(out, "[PROF] %s\n", h->name);
+        fprintf(out, "[PROF]   %-6s n=%-10llu moy=%-10llu p50=%-10llu p90=%-10llu p99=%-10llu max=%llu %s\n",
+                prof_stage_names[s], (unsigned long long)total,
+                (unsigned long long)(prof_load(&h->sum[s]) / total),
+                (unsigned long long)prof_quantile(h, s, total, 0.50),
+                (unsigned long long)prof_quantile(h, s, total, 0.90),
+                (unsigned long long)prof_quantile(h, s, total, 0.99),
+                (unsigned long long)prof_load(&h->max[s]), PROF_UNIT);
+    }
+}
+
+static void prof_dump(FILE *out) {
+    pthread_mutex_lock(&prof_mutex);
+    for (prof_hist_t *h = prof_threads; h; h = h->next)
+        prof_dump_one(out, h);
+    prof_dump_one(out, &prof_retired);
+    pthread_mutex_unlock(&prof_mutex);
+    fflush(out);
+}
+
+// Thread dédié : attend SIGUSR1 de manière synchrone, aucun appel système
+// des autres threads n'est interrompu (pas d'EINTR).
+static void *prof_signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+    while (sigwait(set, &sig) == 0)
+        prof_dump(stderr);
+    return NULL;
+}
+
+// À appeler au début de main(), avant la création de tout autre thread
+static void prof_init(void) {
+    static sigset_t set;
+    pthread_t tid;
+    pthread_key_create(&prof_key, prof_thread_exit);
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);     // Hérité par tous les threads créés ensuite
+    if (pthread_create(&tid, NULL, prof_signal_thread, &set) == 0)
+        pthread_detach(tid);
+    fprintf(stderr, "[PROF] Instrumentation active (unité : %s), SIGUSR1 pour afficher.\n", PROF_UNIT);
+}
+
+#define PROF_INIT()             prof_init()
+#define PROF_BEGIN(t)           uint64_t t = prof_now()
+#define PROF_END(stage, t)      prof_record((stage), prof_now() - (t))
+
+#else
+
+#define PROF_INIT()             do {} while (0)
+#define PROF_BEGIN(t)           do {} while (0)
+#define PROF_END(stage, t)      do {} while (0)
+
+#endif
+
+#endif
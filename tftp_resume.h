@@ -0,0 +1,50 @@
+#ifndef TFTP_RESUME_H
+#define TFTP_RESUME_H
+
+/*
+ * Reprise d'une lecture interrompue : option "offset" (non standard, négociée
+ * comme les options de la RFC 2347).
+ *
+ * Le client qui possède déjà les N premiers octets du fichier ajoute
+ * "offset N" à sa RRQ. Un serveur qui l'accepte répond par un OACK contenant
+ * "offset N" ; après l'ACK 0 du client, le bloc 1 porte les octets à partir
+ * de N (les blocs sont numérotés depuis la position de reprise). Un serveur
+ * qui ignore l'option répond directement par le bloc 1 du début du fichier :
+ * le client repart alors de zéro.
+ *
+ * La reprise n'a de sens qu'en mode octet (en netascii, les positions du
+ * fichier et du flux converti ne correspondent pas) et que si N est inférieur
+ * à la taille du fichier ; dans les autres cas l'option est ignorée. Un
+ * fichier local déjà de la bonne longueur (complet, ou rempli de zéros par un
+ * client interrompu) est ainsi relu en entier plutôt que validé par un
+ * transfert vide. Le client qui reprend demande aussi "tsize" et compare la
+ * taille finale à celle annoncée dans l'OACK.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tftp_codec.h"
+
+#define RESUME_OPTION "offset"
+
+// Position de reprise demandée par une RRQ et acceptée, 0 si aucune
+static inline long long resume_offset(const tftp_packet_t *req, long long size, int netascii) {
+    const char *v = tftp_option(req, RESUME_OPTION);
+    if (!v || netascii)
+        return 0;
+    char *end;
+    long long offset = strtoll(v, &end, 10);
+    if (*end || offset <= 0 || offset >= size)
+        return 0;
+    return offset;
+}
+
+// OACK confirmant la reprise à offset ; retourne sa longueur (0 si cap trop petit)
+static inline size_t resume_oack(unsigned char *buf, size_t cap, long long offset) {
+    char value[24];
+    snprintf(value, sizeof(value), "%lld", offset);
+    return tftp_put_option(buf, cap, tftp_put_oack(buf, cap), RESUME_OPTION, value);
+}
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef TFTP_SCHED_H
+#define TFTP_SCHED_H
+
+/*
+ * Ordonnancement des envois : classes de priorité et "plus petit reste d'abord".
+ *
+ * Chaque transfert reçoit une classe (0 = la plus prioritaire) d'après des règles
+ * "motif=classe" (motif de nom de fichier, cf. fnmatch) ou "a.b.c.d/n=classe"
+ * (sous-réseau du client), la première règle qui correspond l'emporte.
+ * Le score (plus petit = servi en premier) vaut :
+ *
+ *     classe * SCHED_CLASS_SPAN + octets restants - vieillissement * attente
+ *
+ * où l'attente est le temps écoulé depuis le dernier envoi du transfert : un gros
+ * transfert mis de côté finit toujours par passer devant.
+ *
+ * L'ordre n'a d'effet que lorsque la sortie est contrainte (limitation de débit,
+ * file d'admission) : sinon tout le monde est servi immédiatement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+
+#include "tftp_shaper.h"
+
+#define SCHED_DEFAULT_CLASS 1
+#define SCHED_MAX_CLASS 9
+#define SCHED_CLASS_SPAN (1024.0 * 1024 * 1024)    // Écart de score entre deux classes (1 Gio)
+#define SCHED_DEFAULT_AGING (16.0 * 1024 * 1024)   // Octets de score gagnés par seconde d'attente
+
+typedef struct sched_rule {
+    int is_subnet;
+    char pattern[128];
+    uint32_t net, mask;             // Ordre réseau
+    int cls;
+    struct sched_rule *next;
+} sched_rule_t;
+
+static sched_rule_t *sched_rules = NULL, **sched_rules_tail = &sched_rules;
+static double sched_aging = SCHED_DEFAULT_AGING;
+
+// Ajoute une règle "motif=classe" ou "a.b.c.d/n=classe", retourne -1 si invalide
+static inline int sched_add_rule(const char *spec) {
+    const char *eq = strrchr(spec, '=');
+    if (!eq || eq == spec || (size_t)(eq - spec) >= sizeof(((sched_rule_t *)0)->pattern))
+        return -1;
+    int cls = atoi(eq + 1);
+    if (cls < 0 || cls > SCHED_MAX_CLASS)
+        return -1;
+    sched_rule_t *r = calloc(1, sizeof(*r));
+    if (!r)
+        return -1;
+    memcpy(r->pattern, spec, eq - spec);
+    r->cls = cls;
+
+    // Chiffres et points avant le '/' : c'est un sous-réseau, qui doit être valide (pas un motif de nom)
+    char addr[64];
+    const char *slash = strchr(r->pattern, '/');
+    size_t len = slash ? (size_t)(slash - r->pattern) : 0;
+    if (slash && len && strspn(r->pattern, "0123456789.") == len) {
+        struct in_addr in;
+        char *end;
+        long prefix = strtol(slash + 1, &end, 10);
+        if (len >= sizeof(addr) || slash[1] == '\0' || *end != '\0' || prefix < 0 || prefix > 32) {
+            free(r);
+            return -1;
+        }
+        memcpy(addr, r->pattern, len);
+        addr[len] = '\0';
+        if (inet_pton(AF_INET, addr, &in) != 1) {
+            free(r);
+            return -1;
+        }
+        r->is_subnet = 1;
+        r->mask = prefix == 0 ? 0 : htonl(0xFFFFFFFFu << (32 - prefix));
+        r->net = in.s_addr & r->mask;
+    }
+    *sched_rules_tail = r;
+    sched_rules_tail = &r->next;
+    return 0;
+}
+
+// Classe d'un transfert (filename sans le préfixe du dossier serveur)
+static inline int sched_classify(const char *filename, struct in_addr ip) {
+    for (sched_rule_t *r = sched_rules; r; r = r->next) {
+        if (r->is_subnet ? (ip.s_addr & r->mask) == r->net
+                         : fnmatch(r->pattern, filename, 0) == 0)
+            return r->cls;
+    }
+    return SCHED_DEFAULT_CLASS;
+}
+
+static inline double sched_score(int cls, double remaining, double waited) {
+    return cls * SCHED_CLASS_SPAN + remaining - sched_aging * waited;
+}
+
+/*
+ * Portillon pour les serveurs multi-threads. Un transfert retenu par ses
+ * propres seaux (client, sous-réseau) attend seul, sans gêner personne ; seuls
+ * les jetons du seau global sont partagés, et parmi les transferts prêts par
+ * ailleurs, c'est le meilleur score qui les attend, les autres dormant sur la
+ * condition.
+ */
+typedef struct sched_waiter {
+    int cls;
+    double remaining;
+    double since;                   // Date (shaper_now) du dernier envoi
+    double ready;                   // Date à laquelle ses seaux propres le laissent partir
+    struct sched_waiter *next;
+} sched_waiter_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    sched_waiter_t *waiters;
+} sched_gate_t;
+
+#define SCHED_GATE_INITIALIZER { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL }
+
+// Meilleur score parmi les transferts que leurs seaux propres laissent partir
+static inline sched_waiter_t *sched_gate_best(sched_gate_t *g, double now) {
+    sched_waiter_t *best = NULL;
+    double best_score = 0;
+    for (sched_waiter_t *w = g->waiters; w; w = w->next) {
+        if (w->ready > now)
+            continue;
+        double sc = sched_score(w->cls, w->remaining, now - w->since);
+        if (!best || sc < best_score) {
+            best = w;
+            best_score = sc;
+        }
+    }
+    return best;
+}
+
+// Bloque jusqu'à ce que `bytes` octets puissent partir vers `ip` et que ce soit notre tour
+static inline void sched_gate_send(sched_gate_t *g, shaper_t *sh, struct in_addr ip, size_t bytes,
+                                   int cls, double remaining, double since) {
+    if (!sh->enabled)
+        return;
+    pthread_mutex_lock(&g->lock);
+    if (!sched_gate_best(g, shaper_now()) && shaper_reserve(sh, ip, bytes) == 0) {
+        pthread_mutex_unlock(&g->lock);
+        return;
+    }
+    sched_waiter_t self = { cls, remaining, since, 0, g->waiters };
+    g->waiters = &self;
+    int slept = 0;
+    while (1) {
+        double now = shaper_now();
+        double delay = shaper_peer_delay(sh, ip);
+        self.ready = now + delay;
+        if (delay > 0)
+            pthread_cond_broadcast(&g->cond);   // Plus prêt : un autre peut prendre notre tour
+        if (delay == 0 && sched_gate_best(g, now) != &self) {
+            // Le vieillissement a pu faire passer un autre devant pendant qu'on dormait
+            if (slept)
+                pthread_cond_broadcast(&g->cond);
+            slept = 0;
+            pthread_cond_wait(&g->cond, &g->lock);
+            continue;
+        }
+        // Nos seaux propres sont vides (on attend seul), ou c'est notre tour pour le seau global
+        if (delay == 0 && (delay = shaper_reserve(sh, ip, bytes)) == 0)
+            break;
+        slept = 1;
+        pthread_mutex_unlock(&g->lock);
+        struct timespec ts = { (time_t)delay, (long)((delay - (time_t)delay) * 1e9) };
+        while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+            ;
+        pthread_mutex_lock(&g->lock);
+    }
+    sched_waiter_t **p = &g->waiters;
+    while (*p != &self)
+        p = &(*p)->next;
+    *p = self.next;
+    pthread_cond_broadcast(&g->cond);
+    pthread_mutex_unlock(&g->lock);
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef TFTP_SHAPER_H
+#define TFTP_SHAPER_H
+
+/*
+ * Limitation de débit par seaux à jetons : un seau global, un seau par adresse
+ * IP cliente et un seau par sous-réseau (préfixe configurable).
+ *
+ * Un envoi est autorisé dès que tous les seaux concernés ont un solde positif ;
+ * il est alors débité de la taille du paquet (le solde peut devenir négatif, ce
+ * qui évite de bloquer un paquet plus gros que la rafale autorisée).
+ * Un débit de 0 désactive le seau correspondant.
+ *
+ * Utilisable depuis plusieurs threads (mutex interne).
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#define SHAPER_HASH 256             // Nombre d'entrées des tables client / sous-réseau
+#define SHAPER_BURST 0.1            // Rafale autorisée : 100 ms de débit
+#define SHAPER_MIN_BURST 1500.0     // ... mais au moins un paquet
+#define SHAPER_IDLE 60.0            // Une entrée inutilisée depuis 60 s est libérée
+
+// Seau à jetons (débit et solde en octets)
+typedef struct {
+    double rate;
+    double burst;
+    double tokens;
+    double last;
+} token_bucket_t;
+
+typedef struct shaper_entry {
+    uint32_t key;                   // Adresse IP ou préfixe (ordre réseau)
+    token_bucket_t tb;
+    struct shaper_entry *next;
+} shaper_entry_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int enabled;
+    token_bucket_t global;
+    double client_rate;
+    double subnet_rate;
+    uint32_t subnet_mask;           // Ordre réseau
+    shaper_entry_t *clients[SHAPER_HASH];
+    shaper_entry_t *subnets[SHAPER_HASH];
+    double last_gc;
+} shaper_t;
+
+static inline double shaper_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void tb_init(token_bucket_t *tb, double rate, double now) {
+    tb->rate = rate;
+    tb->burst = rate * SHAPER_BURST;
+    if (tb->burst < SHAPER_MIN_BURST)
+        tb->burst = SHAPER_MIN_BURST;
+    tb->tokens = tb->burst;
+    tb->last = now;
+}
+
+static inline void tb_refill(token_bucket_t *tb, double now) {
+    tb->tokens += (now - tb->last) * tb->rate;
+    if (tb->tokens > tb->burst)
+        tb->tokens = tb->burst;
+    tb->last = now;
+}
+
+// Délai (s) avant que le seau redevienne positif, 0 s'il l'est déjà
+static inline double tb_delay(const token_bucket_t *tb) {
+    return tb->tokens >= 0 ? 0 : -tb->tokens / tb->rate;
+}
+
+// Convertit "500k", "10M", "1G" ou "123456" en octets par seconde
+static inline double shaper_parse_rate(const char *s) {
+    char *end;
+    double v = strtod(s, &end);
+    switch (*end) {
+    case 'k': case 'K': v *= 1e3; break;
+    case 'm': case 'M': v *= 1e6; break;
+    case 'g': case 'G': v *= 1e9; break;
+    }
+    return v < 0 ? 0 : v;
+}
+
+// Débits en octets/s (0 = illimité), prefix : longueur du préfixe des sous-réseaux
+static inline void shaper_init(shaper_t *sh, double global_rate, double client_rate,
+                        double subnet_rate, int prefix) {
+    double now = shaper_now();
+    memset(sh, 0, sizeof(*sh));
+    pthread_mutex_init(&sh->lock, NULL);
+    tb_init(&sh->global, global_rate, now);
+    sh->client_rate = client_rate;
+    sh->subnet_rate = subnet_rate;
+    sh->subnet_mask = prefix <= 0 ? 0 : htonl(prefix >= 32 ? 0xFFFFFFFFu : ~(0xFFFFFFFFu >> prefix));
+    sh->enabled = global_rate > 0 || client_rate > 0 || subnet_rate > 0;
+    sh->last_gc = now;
+}
+
+static inline token_bucket_t *shaper_lookup(shaper_entry_t **table, uint32_t key, double rate, double now) {
+    unsigned h = (ntohl(key) * 2654435761u) >> 24;
+    for (shaper_entry_t *e = table[h]; e; e = e->next)
+        if (e->key == key)
+            return &e->tb;
+    shaper_entry_t *e = malloc(sizeof(*e));
+    if (!e)
+        return NULL;
+    e->key = key;
+    tb_init(&e->tb, rate, now);
+    e->next = table[h];
+    table[h] = e;
+    return &e->tb;
+}
+
+// Libère les entrées inactives (leur seau est forcément plein)
+static inline void shaper_gc(shaper_entry_t **table, double now) {
+    for (int i = 0; i < SHAPER_HASH; i++) {
+        shaper_entry_t **p = &table[i];
+        while (*p) {
+            shaper_entry_t *e = *p;
+            if (now - e->tb.last > SHAPER_IDLE) {
+                *p = e->next;
+                free(e);
+            } else {
+                p = &e->next;
+            }
+        }
+    }
+}
+
+// Seaux concernés par un envoi vers ip (le global si with_global), remplis jusqu'à now ; sous sh->lock
+static inline int shaper_buckets(shaper_t *sh, struct in_addr ip, double now, int with_global, token_bucket_t **tbs) {
+    token_bucket_t *tb;
+    int n = 0;
+    if (with_global && sh->global.rate > 0)
+        tbs[n++] = &sh->global;
+    if (sh->client_rate > 0 && (tb = shaper_lookup(sh->clients, ip.s_addr, sh->client_rate, now)))
+        tbs[n++] = tb;
+    if (sh->subnet_rate > 0 &&
+        (tb = shaper_lookup(sh->subnets, ip.s_addr & sh->subnet_mask, sh->subnet_rate, now)))
+        tbs[n++] = tb;
+    for (int i = 0; i < n; i++)
+        tb_refill(tbs[i], now);
+    return n;
+}
+
+/*
+ * Demande l'autorisation d'envoyer `bytes` octets vers `ip`.
+ * Retourne 0 si l'envoi est autorisé (les seaux sont débités), sinon le délai
+ * en secondes après lequel redemander.
+ */
+static inline double shaper_reserve(shaper_t *sh, struct in_addr ip, size_t bytes) {
+    if (!sh->enabled)
+        return 0;
+    pthread_mutex_lock(&sh->lock);
+    double now = shaper_now();
+    token_bucket_t *tbs[3];
+    int n = shaper_buckets(sh, ip, now, 1, tbs);
+    double delay = 0;
+    for (int i = 0; i < n; i++) {
+        double d = tb_delay(tbs[i]);
+        if (d > delay)
+            delay = d;
+    }
+    if (delay == 0)
+        for (int i = 0; i < n; i++)
+            tbs[i]->tokens -= bytes;
+
+    if (now - sh->last_gc > SHAPER_IDLE) {
+        shaper_gc(sh->clients, now);
+        shaper_gc(sh->subnets, now);
+        sh->last_gc = now;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return delay;
+}
+
+// Délai avant que les seaux propres à `ip` (client, sous-réseau) autorisent un envoi, sans rien débiter
+static inline double shaper_peer_delay(shaper_t *sh, struct in_addr ip) {
+    if (!sh->enabled)
+        return 0;
+    pthread_mutex_lock(&sh->lock);
+    token_bucket_t *tbs[3];
+    int n = shaper_buckets(sh, ip, shaper_now(), 0, tbs);
+    double delay = 0;
+    for (int i = 0; i < n; i++) {
+        double d = tb_delay(tbs[i]);
+        if (d > delay)
+            delay = d;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return delay;
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef TFTP_SOCKBUF_H
+#define TFTP_SOCKBUF_H
+
+/*
+ * Tampons des sockets UDP : taille initiale, comptage des pertes du noyau et
+ * agrandissement automatique.
+ *
+ * Quand la file de réception d'une socket est pleine, le noyau jette les
+ * paquets sans rien dire ; le client ne s'en aperçoit qu'à l'expiration de son
+ * timer. Avec SO_RXQ_OVFL, chaque paquet reçu porte le compteur cumulé des
+ * pertes de sa socket : sockbuf_recvfrom() le relève, le journalise, et double
+ * le tampon de réception (dans la limite max) dès que des pertes apparaissent.
+ * Le compteur étant daté de la mise en file, des pertes survenues après le
+ * dernier paquet reçu n'apparaissent qu'avec le suivant : sockbuf_poll() le
+ * relit directement (SO_MEMINFO) pendant les périodes calmes.
+ *
+ * Les limites se règlent avec -B min[:max] (octets, suffixes k/M). Le noyau
+ * plafonne SO_RCVBUF à net.core.rmem_max : SO_RCVBUFFORCE est essayé d'abord
+ * (CAP_NET_ADMIN), sinon la valeur réellement obtenue est affichée.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+#ifndef SO_RCVBUFFORCE
+#define SO_RCVBUFFORCE 33
+#endif
+#ifndef SO_SNDBUFFORCE
+#define SO_SNDBUFFORCE 32
+#endif
+#ifndef SO_MEMINFO
+#define SO_MEMINFO 55
+#endif
+#define SOCKBUF_MEMINFO_DROPS 8         // SK_MEMINFO_DROPS (linux/sock_diag.h)
+#define SOCKBUF_MEMINFO_VARS 9
+
+#define SOCKBUF_MIN (1 << 20)           // Socket du port bien connu
+#define SOCKBUF_MAX (16 << 20)
+#define SOCKBUF_SESSION (256 << 10)     // Sockets de session (bornées par max)
+#define SOCKBUF_GROW_INTERVAL 0.5       // Un agrandissement au plus par intervalle (s)
+#define SOCKBUF_POLL_INTERVAL 1.0       // Relevé direct du compteur (sockbuf_poll)
+
+typedef struct {
+    int min, max;
+} sockbuf_policy_t;
+
+static sockbuf_policy_t sockbuf_policy = { SOCKBUF_MIN, SOCKBUF_MAX };
+
+typedef struct {
+    int fd;
+    char name[48];                  // Pour les messages ("port 6969", "session 10.0.0.2:1234"...)
+    int rcvbuf;                     // Taille demandée
+    uint32_t last_count;            // Dernier compteur SO_RXQ_OVFL vu
+    unsigned long long drops;
+    double last_grow;
+    double last_poll;
+} sockbuf_t;
+
+static inline double sockbuf_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline long sockbuf_parse_size(const char *s, char **end) {
+    double v = strtod(s, end);
+    switch (**end) {
+    case 'k': case 'K': v *= 1024; (*end)++; break;
+    case 'm': case 'M': v *= 1024 * 1024; (*end)++; break;
+    }
+    return (long)v;
+}
+
+// Option -B min[:max] ; retourne -1 si invalide
+static inline int sockbuf_parse(const char *arg) {
+    char *end;
+    long min = sockbuf_parse_size(arg, &end), max = sockbuf_policy.max;
+    if (*end == ':')
+        max = sockbuf_parse_size(end + 1, &end);
+    if (*end || min <= 0 || max < min || max > (1L << 30))
+        return -1;
+    sockbuf_policy.min = min;
+    sockbuf_policy.max = max;
+    return 0;
+}
+
+// Taille effective d'un tampon (le noyau double la valeur demandée)
+static inline int sockbuf_get(int fd, int opt) {
+    int v = 0;
+    socklen_t len = sizeof(v);
+    getsockopt(fd, SOL_SOCKET, opt, &v, &len);
+    return v / 2;
+}
+
+static inline void sockbuf_set(int fd, int force, int opt, int size) {
+    if (setsockopt(fd, SOL_SOCKET, force, &size, sizeof(size)) < 0)
+        setsockopt(fd, SOL_SOCKET, opt, &size, sizeof(size));
+}
+
+/*
+ * Prend en charge la socket fd : tampons à size octets (bornés par la
+ * politique) et comptage des pertes.
+ */
+static inline void sockbuf_init(sockbuf_t *sb, int fd, const char *name, int size) {
+    memset(sb, 0, sizeof(*sb));
+    sb->fd = fd;
+    snprintf(sb->name, sizeof(sb->name), "%s", name);
+    if (size > sockbuf_policy.max)
+        size = sockbuf_policy.max;
+    sb->rcvbuf = size;
+    sockbuf_set(fd, SO_RCVBUFFORCE, SO_RCVBUF, size);
+    sockbuf_set(fd, SO_SNDBUFFORCE, SO_SNDBUF, size);
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) < 0)
+        perror("SO_RXQ_OVFL");
+}
+
+// Socket dédiée à un client : nommée d'après lui (inet_ntop, utilisable depuis plusieurs threads)
+static inline void sockbuf_init_peer(sockbuf_t *sb, int fd, const struct sockaddr_in *peer, int size) {
+    char ip[INET_ADDRSTRLEN], name[48];
+    inet_ntop(AF_INET, &peer->sin_addr, ip, sizeof(ip));
+    snprintf(name, sizeof(name), "session %s:%d", ip, ntohs(peer->sin_port));
+    sockbuf_init(sb, fd, name, size);
+}
+
+// Nouveau relevé du compteur de pertes ; agrandit le tampon s'il a augmenté
+static inline void sockbuf_account(sockbuf_t *sb, uint32_t count) {
+    uint32_t lost = count - sb->last_count;
+    if (lost == 0)
+        return;
+    sb->last_count = count;
+    sb->drops += lost;
+    double now = sockbuf_now();
+    if (sb->rcvbuf >= sockbuf_policy.max || now - sb->last_grow < SOCKBUF_GROW_INTERVAL) {
+        printf("[sockbuf] %s : %u paquets perdus par le noyau (%llu au total)\n", sb->name, lost, sb->drops);
+        return;
+    }
+    sb->rcvbuf = sb->rcvbuf > sockbuf_policy.max / 2 ? sockbuf_policy.max : sb->rcvbuf * 2;
+    sb->last_grow = now;
+    sockbuf_set(sb->fd, SO_RCVBUFFORCE, SO_RCVBUF, sb->rcvbuf);
+    printf("[sockbuf] %s : %u paquets perdus par le noyau (%llu au total), tampon de réception porté à %d octets (obtenu %d)\n",
+           sb->name, lost, sb->drops, sb->rcvbuf, sockbuf_get(sb->fd, SO_RCVBUF));
+}
+
+// recvfrom() qui relève au passage le compteur de pertes de la socket
+static inline ssize_t sockbuf_recvfrom(sockbuf_t *sb, void *buf, size_t len, int flags,
+                                       struct sockaddr *from, socklen_t *fromlen) {
+    struct iovec iov = { buf, len };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(uint32_t))];
+    } ctrl;
+    struct msghdr msg = {0};
+    msg.msg_name = from;
+    msg.msg_namelen = fromlen ? *fromlen : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = sizeof(ctrl.buf);
+    ssize_t n = recvmsg(sb->fd, &msg, flags);
+    if (n < 0)
+        return n;
+    if (fromlen)
+        *fromlen = msg.msg_namelen;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t count;
+            memcpy(&count, CMSG_DATA(c), sizeof(count));
+            sockbuf_account(sb, count);
+        }
+    return n;
+}
+
+// Relevé direct du compteur de pertes, au plus une fois par SOCKBUF_POLL_INTERVAL
+static inline void sockbuf_poll(sockbuf_t *sb) {
+    double now = sockbuf_now();
+    if (now - sb->last_poll < SOCKBUF_POLL_INTERVAL)
+        return;
+    sb->last_poll = now;
+    uint32_t mem[SOCKBUF_MEMINFO_VARS];
+    socklen_t len = sizeof(mem);
+    if (getsockopt(sb->fd, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0 && len > SOCKBUF_MEMINFO_DROPS * sizeof(uint32_t))
+        sockbuf_account(sb, mem[SOCKBUF_MEMINFO_DROPS]);
+}
+
+// Bilan à la fermeture d'une socket (rien si aucune perte)
+static inline void sockbuf_report(const sockbuf_t *sb) {
+    if (sb->drops)
+        printf("[sockbuf] %s : %llu paquets perdus par le noyau, tampon final %d octets\n",
+               sb->name, sb->drops, sb->rcvbuf);
+}
+
+#endif
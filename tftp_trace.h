@@ -0,0 +1,176 @@
+#ifndef TFTP_TRACE_H
+#define TFTP_TRACE_H
+
+/*
+ * Enregistrement compact des paquets reçus par un serveur (option -T fichier),
+ * rejoué ensuite par replay.c.
+ *
+ * Format : en-tête TRACE_MAGIC (8 octets) puis une suite d'enregistrements,
+ * entiers en petit-boutiste :
+ *
+ *     u64 date (ns, CLOCK_REALTIME)
+ *     u32 adresse IPv4 du pair (ordre réseau, tel quel)
+ *     u16 port du pair
+ *     u8  opcode
+ *     u8  longueur du nom (RRQ/WRQ : "fichier\0mode", 0 sinon)
+ *     u16 numéro de bloc (DATA/ACK/ERROR)
+ *     u16 taille du paquet
+ *     [nom]
+ *
+ * Les enregistrements sont tamponnés. Ils sont écrits au paquet suivant s'il
+ * arrive TRACE_FLUSH après la dernière écriture, sinon par trace_tick(), que la
+ * boucle du serveur appelle au plus tard TRACE_FLUSH plus tard (trace_wait()
+ * borne son attente) : un serveur inactif n'en garde pas indéfiniment.
+ * SIGINT/SIGTERM ne font que noter l'arrêt ; trace_tick() écrit le reste puis
+ * termine le processus (pas d'écriture depuis le gestionnaire, qui pourrait
+ * interrompre la copie d'un enregistrement). Utilisable depuis plusieurs
+ * threads.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#define TRACE_MAGIC "TFTPTRC1"
+#define TRACE_RECORD 20             // Taille fixe d'un enregistrement (sans le nom)
+#define TRACE_BUFFER 65536
+#define TRACE_FLUSH 0.1             // Délai (s) entre deux écritures sur disque
+
+typedef struct {
+    FILE *fp;
+    pthread_mutex_t lock;
+    unsigned char buf[TRACE_BUFFER];
+    size_t len;
+    double last_flush;
+    unsigned long long records;
+} trace_t;
+
+// Trace globale du processus, inactive tant que trace_open() n'a pas réussi
+static trace_t tftp_trace = { NULL, PTHREAD_MUTEX_INITIALIZER, {0}, 0, 0, 0 };
+
+static inline double trace_clock(struct timespec *ts) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+// Signal d'arrêt reçu, traité par trace_tick()
+static volatile sig_atomic_t trace_signal;
+
+static inline void trace_on_signal(int sig) {
+    trace_signal = sig;
+}
+
+static inline int trace_open(const char *path) {
+    tftp_trace.fp = fopen(path, "wb");
+    if (!tftp_trace.fp)
+        return -1;
+    setvbuf(tftp_trace.fp, NULL, _IONBF, 0);    // Le tampon est le nôtre
+    fwrite(TRACE_MAGIC, 1, 8, tftp_trace.fp);
+    signal(SIGINT, trace_on_signal);
+    signal(SIGTERM, trace_on_signal);
+    return 0;
+}
+
+static inline void trace_put(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = (v >> (8 * i)) & 0xFF;
+}
+
+static inline uint64_t trace_get(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+// Enregistre un paquet reçu de peer
+static inline void trace_record(const struct sockaddr_in *peer, const unsigned char *pkt, int n) {
+    if (!tftp_trace.fp || n < 2)
+        return;
+    struct timespec ts;
+    double now = trace_clock(&ts);
+    int opcode = pkt[1];
+    int name_len = 0, block = 0;
+    if ((opcode == 1 || opcode == 2) && n > 2) {
+        // Nom et mode, bornés à 255 octets
+        name_len = n - 2 > 255 ? 255 : n - 2;
+        while (name_len > 0 && pkt[2 + name_len - 1] == 0)
+            name_len--;
+        const unsigned char *mode_end = memchr(pkt + 2, 0, name_len);
+        if (mode_end)
+            mode_end = memchr(mode_end + 1, 0, pkt + 2 + name_len - (mode_end + 1));
+        if (mode_end)
+            name_len = mode_end - (pkt + 2);       // Les options ne sont pas conservées
+    } else if (n >= 4) {
+        block = (pkt[2] << 8) | pkt[3];
+    }
+
+    pthread_mutex_lock(&tftp_trace.lock);
+    if (tftp_trace.len + TRACE_RECORD + name_len > TRACE_BUFFER) {
+        fwrite(tftp_trace.buf, 1, tftp_trace.len, tftp_trace.fp);
+        tftp_trace.len = 0;
+        tftp_trace.last_flush = now;
+    }
+    unsigned char *r = tftp_trace.buf + tftp_trace.len;
+    trace_put(r, (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec, 8);
+    memcpy(r + 8, &peer->sin_addr.s_addr, 4);
+    trace_put(r + 12, ntohs(peer->sin_port), 2);
+    r[14] = opcode;
+    r[15] = name_len;
+    trace_put(r + 16, block, 2);
+    trace_put(r + 18, n > 0xFFFF ? 0xFFFF : n, 2);
+    memcpy(r + TRACE_RECORD, pkt + 2, name_len);
+    tftp_trace.len += TRACE_RECORD + name_len;
+    tftp_trace.records++;
+    if (now - tftp_trace.last_flush >= TRACE_FLUSH) {
+        fwrite(tftp_trace.buf, 1, tftp_trace.len, tftp_trace.fp);
+        tftp_trace.len = 0;
+        tftp_trace.last_flush = now;
+    }
+    pthread_mutex_unlock(&tftp_trace.lock);
+}
+
+/*
+ * Boucle du serveur (après chaque attente) : écrit les enregistrements en
+ * attente depuis TRACE_FLUSH, et termine le processus après SIGINT/SIGTERM une
+ * fois la trace complète.
+ */
+static inline void trace_tick(void) {
+    if (!tftp_trace.fp)
+        return;
+    struct timespec ts;
+    double now = trace_clock(&ts);
+    int sig = trace_signal;
+    pthread_mutex_lock(&tftp_trace.lock);
+    if (tftp_trace.len && (sig || now - tftp_trace.last_flush >= TRACE_FLUSH)) {
+        fwrite(tftp_trace.buf, 1, tftp_trace.len, tftp_trace.fp);
+        tftp_trace.len = 0;
+        tftp_trace.last_flush = now;
+    }
+    pthread_mutex_unlock(&tftp_trace.lock);
+    if (sig) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+// Attente maximale (s) de la boucle du serveur pour que trace_tick() passe à temps
+static inline double trace_wait(double wait) {
+    if (!tftp_trace.fp)
+        return wait;
+    struct timespec ts;
+    double now = trace_clock(&ts);
+    pthread_mutex_lock(&tftp_trace.lock);
+    double due = tftp_trace.len || trace_signal ? tftp_trace.last_flush + TRACE_FLUSH - now : wait;
+    pthread_mutex_unlock(&tftp_trace.lock);
+    if (due < 0)
+        due = 0;
+    return due < wait ? due : wait;
+}
+
+#endif
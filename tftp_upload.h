@@ -0,0 +1,364 @@
+#ifndef TFTP_UPLOAD_H
+#define TFTP_UPLOAD_H
+
+/*
+ * Réception atomique des fichiers (WRQ).
+ *
+ * Les données sont écrites dans un fichier anonyme (O_TMPFILE) du dossier de
+ * destination, qui n'apparaît sous son nom qu'une fois le dernier bloc reçu :
+ * il est alors lié sous un nom temporaire (linkat) puis renommé par-dessus
+ * l'ancienne version (rename, atomique). Un lecteur voit donc toujours soit
+ * l'ancienne version complète, soit la nouvelle, sans verrou ; un transfert
+ * interrompu ne laisse rien derrière lui.
+ *
+ * Si le système de fichiers ne connaît pas O_TMPFILE, un fichier caché
+ * ".<nom>.XXXXXX" tient le même rôle (supprimé en cas d'abandon).
+ *
+ * Quand le client annonce la taille (option tsize, RFC 2349), l'espace est
+ * réservé d'avance (fallocate sans changer la taille) pour limiter la
+ * fragmentation des gros fichiers.
+ *
+ * Stockage dédupliqué (upload_dedup, option -D des serveurs) : chaque contenu
+ * reçu est haché (SHA-256) au fil de l'eau et rangé une seule fois sous
+ * "<dossier>/.objects/ab/cdef..." ; les noms de fichiers sont
+ * des liens physiques vers ces objets. Tant que les blocs reçus sont identiques
+ * à la version actuelle du fichier, rien n'est écrit : une sauvegarde inchangée
+ * depuis la veille ne coûte aucune écriture. Un contenu déjà présent sous un
+ * autre nom est simplement lié, et toutes les lectures (RRQ) d'un même contenu
+ * partagent un seul inode, donc une seule copie en cache. Un objet qui n'est
+ * plus référencé par aucun nom est supprimé.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+
+#include "tftp_sha256.h"
+
+#ifndef O_TMPFILE
+#define O_TMPFILE (020000000 | O_DIRECTORY)
+#endif
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01
+#endif
+
+#define UPLOAD_BUFFER 65536             // Écritures regroupées par blocs de cette taille
+#define UPLOAD_OBJECTS ".objects"       // Stockage dédupliqué, dans le dossier de destination
+#define UPLOAD_XATTR "user.tftp.sha256" // Empreinte d'un objet (partagée par tous ses noms)
+
+static int upload_dedup = 0;
+
+typedef struct {
+    int fd;
+    char path[300];                 // Nom définitif
+    char tmp_path[320];             // Nom temporaire (repli sans O_TMPFILE), vide sinon
+    int committed;
+    unsigned char *buf;             // Données pas encore écrites
+    size_t buf_len;
+    long long received;             // Octets reçus
+    long long tsize;                // Taille annoncée (-1 si inconnue), réservée au premier octet écrit
+    int prev_fd;                    // Dédup : version actuelle, comparée au fil de l'eau (-1 sinon)
+    int diverged;                   // Dédup : le contenu reçu diffère de la version actuelle
+    int unchanged;                  // Dédup : contenu identique, rien n'a été écrit
+    int failed;                     // Une écriture a échoué : le fichier ne doit pas être mis en place
+    sha256_t sha;
+} upload_t;
+
+/*
+ * Prépare la réception de `path` (taille annoncée tsize, -1 si inconnue).
+ * Retourne le descripteur du fichier anonyme, -1 en cas d'erreur (errno).
+ * Les données passent ensuite par upload_write().
+ */
+static inline int upload_open(upload_t *u, const char *path, long long tsize) {
+    memset(u, 0, sizeof(*u));
+    u->prev_fd = -1;
+    u->tsize = tsize;
+    snprintf(u->path, sizeof(u->path), "%s", path);
+    char dir[300];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    int base = slash ? (int)(slash + 1 - dir) : 0;     // Début du nom dans path
+    if (slash)
+        slash[slash == dir ? 1 : 0] = '\0';
+    else
+        snprintf(dir, sizeof(dir), ".");
+
+    u->buf = malloc(UPLOAD_BUFFER);
+    if (!u->buf)
+        return u->fd = -1;
+    u->fd = open(dir, O_TMPFILE | O_WRONLY, 0666);
+    if (u->fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL)) {
+        // Repli : fichier temporaire visible mais caché, dans le même dossier
+        int len = snprintf(u->tmp_path, sizeof(u->tmp_path), "%.*s.%s.XXXXXX", base, path, path + base);
+        u->fd = len < (int)sizeof(u->tmp_path) ? mkstemp(u->tmp_path) : -1;
+        if (u->fd >= 0)
+            fchmod(u->fd, 0644);    // mkstemp crée en 0600
+        else
+            u->tmp_path[0] = '\0';
+    }
+    if (u->fd < 0) {
+        free(u->buf);
+        u->buf = NULL;
+        return -1;
+    }
+    if (upload_dedup) {
+        sha256_init(&u->sha);
+        u->prev_fd = open(path, O_RDONLY);  // Pas de version actuelle : tout sera écrit
+    }
+    return u->fd;
+}
+
+static inline int upload_flush(upload_t *u) {
+    size_t done = 0;
+    while (done < u->buf_len) {
+        ssize_t n = write(u->fd, u->buf + done, u->buf_len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        done += n;
+    }
+    u->buf_len = 0;
+    return 0;
+}
+
+/*
+ * Dédup : le contenu reçu s'écarte de la version actuelle après `received`
+ * octets identiques. Ce préfixe est recopié de l'ancienne version (dans le
+ * noyau, sans passer par le processus), puis les écritures reprennent.
+ */
+static inline int upload_diverge(upload_t *u) {
+    u->diverged = 1;
+    // Appel système direct : fallocate() n'est déclarée qu'avec _GNU_SOURCE. Un échec n'est pas grave.
+    if (u->tsize > 0)
+        syscall(SYS_fallocate, u->fd, FALLOC_FL_KEEP_SIZE, (off_t)0, (off_t)u->tsize);
+    if (u->prev_fd < 0)
+        return 0;
+    loff_t in = 0, out = 0;
+    while (in < u->received) {
+        ssize_t n = syscall(SYS_copy_file_range, u->prev_fd, &in, u->fd, &out, (size_t)(u->received - in), 0);
+        if (n > 0)
+            continue;
+        if (n == 0)
+            return -1;          // Ancienne version tronquée entre-temps
+        // Pas de copy_file_range (noyau ancien, systèmes de fichiers différents) : copie classique
+        ssize_t r = pread(u->prev_fd, u->buf, u->received - in < UPLOAD_BUFFER ? u->received - in : UPLOAD_BUFFER, in);
+        if (r <= 0 || pwrite(u->fd, u->buf, r, out) != r)
+            return -1;
+        in += r;
+        out += r;
+    }
+    if (lseek(u->fd, out, SEEK_SET) < 0)
+        return -1;
+    close(u->prev_fd);
+    u->prev_fd = -1;
+    return 0;
+}
+
+/*
+ * Données reçues, dans l'ordre ; retourne -1 en cas d'erreur d'écriture
+ * (errno) ou de recopie du préfixe de la version actuelle. Après un échec,
+ * upload_commit() refuse de mettre le fichier en place.
+ */
+static inline int upload_write(upload_t *u, const void *data, size_t len) {
+    if (u->failed)
+        return -1;
+    if (upload_dedup)
+        sha256_update(&u->sha, data, len);
+    if (!u->diverged) {
+        if (u->prev_fd >= 0 && len <= UPLOAD_BUFFER) {
+            // Le tampon d'écriture est vide tant qu'on n'a pas divergé : il sert à la comparaison
+            ssize_t n = pread(u->prev_fd, u->buf, len, u->received);
+            if (n == (ssize_t)len && memcmp(u->buf, data, len) == 0) {
+                u->received += len;
+                return 0;
+            }
+        }
+        if (upload_diverge(u) < 0) {
+            u->failed = 1;
+            return -1;
+        }
+    }
+    u->received += len;
+    if ((u->buf_len + len > UPLOAD_BUFFER && upload_flush(u) < 0) ||
+        (len > UPLOAD_BUFFER && write(u->fd, data, len) != (ssize_t)len)) {
+        u->failed = 1;
+        return -1;
+    }
+    if (len > UPLOAD_BUFFER)
+        return 0;
+    memcpy(u->buf + u->buf_len, data, len);
+    u->buf_len += len;
+    return 0;
+}
+
+// Lie src (suivi s'il s'agit de /proc/self/fd/N) sous un nom temporaire, puis le renomme en dst
+static inline int upload_place(const char *src, const char *dst) {
+    // linkat refuse d'écraser : lien sous un nom temporaire, puis rename par-dessus l'ancien fichier
+    char tmp[340];
+    for (int attempt = 0; attempt < 100; attempt++) {
+        snprintf(tmp, sizeof(tmp), "%s.%d.%d.tmp", dst, (int)getpid(), rand());
+        if (linkat(AT_FDCWD, src, AT_FDCWD, tmp, AT_SYMLINK_FOLLOW) == 0) {
+            int r = rename(tmp, dst);
+            unlink(tmp);        // Reste si dst était déjà ce même fichier (rename ne fait alors rien)
+            return r;
+        }
+        if (errno != EEXIST)
+            return -1;
+    }
+    return -1;
+}
+
+// Chemin de l'objet d'empreinte hex, et crée son sous-dossier si besoin
+static inline void upload_object_path(const upload_t *u, const char *hex, char *obj, size_t cap) {
+    const char *slash = strrchr(u->path, '/');
+    int dir = slash ? (int)(slash + 1 - u->path) : 0;
+    snprintf(obj, cap, "%.*s" UPLOAD_OBJECTS, dir, u->path);
+    mkdir(obj, 0755);
+    snprintf(obj, cap, "%.*s" UPLOAD_OBJECTS "/%.2s", dir, u->path, hex);
+    mkdir(obj, 0755);
+    snprintf(obj, cap, "%.*s" UPLOAD_OBJECTS "/%.2s/%s", dir, u->path, hex, hex + 2);
+}
+
+// L'ancienne version (old_fd) n'est plus nommée que par son objet : on supprime l'objet
+static inline void upload_release(const upload_t *u, int old_fd) {
+    struct stat st;
+    char hex[2 * SHA256_SIZE + 1], obj[400];
+    if (fstat(old_fd, &st) < 0 || st.st_nlink != 1)
+        return;
+    ssize_t n = fgetxattr(old_fd, UPLOAD_XATTR, hex, sizeof(hex) - 1);
+    if (n != 2 * SHA256_SIZE)
+        return;
+    hex[n] = '\0';
+    upload_object_path(u, hex, obj, sizeof(obj));
+    struct stat ost;
+    if (stat(obj, &ost) == 0 && ost.st_ino == st.st_ino && ost.st_dev == st.st_dev)
+        unlink(obj);
+}
+
+/*
+ * Dédup : range le contenu reçu dans le stockage (sauf s'il y est déjà) et
+ * fait pointer le nom définitif dessus. Le descripteur devient celui de
+ * l'objet, ouvert en lecture.
+ */
+static inline int upload_commit_dedup(upload_t *u) {
+    unsigned char digest[SHA256_SIZE];
+    char hex[2 * SHA256_SIZE + 1], obj[400], proc[64];
+    sha256_final(&u->sha, digest);
+    for (int i = 0; i < SHA256_SIZE; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    upload_object_path(u, hex, obj, sizeof(obj));
+
+    int old_fd = open(u->path, O_RDONLY);
+    int placed = upload_place(obj, u->path) == 0;
+    if (!placed) {
+        // Contenu nouveau : le fichier reçu devient l'objet (un upload concurrent a pu le créer entre-temps)
+        fsetxattr(u->fd, UPLOAD_XATTR, hex, 2 * SHA256_SIZE, 0);
+        int linked;
+        if (u->tmp_path[0]) {
+            linked = link(u->tmp_path, obj) == 0 || errno == EEXIST;
+        } else {
+            snprintf(proc, sizeof(proc), "/proc/self/fd/%d", u->fd);
+            linked = linkat(AT_FDCWD, proc, AT_FDCWD, obj, AT_SYMLINK_FOLLOW) == 0 || errno == EEXIST;
+        }
+        placed = linked && upload_place(obj, u->path) == 0;
+    }
+    if (!placed) {
+        if (old_fd >= 0)
+            close(old_fd);
+        return -1;
+    }
+    if (old_fd >= 0) {
+        upload_release(u, old_fd);
+        close(old_fd);
+    }
+    if (u->tmp_path[0]) {
+        unlink(u->tmp_path);
+        u->tmp_path[0] = '\0';
+    }
+    int fd = open(obj, O_RDONLY);
+    if (fd >= 0) {
+        close(u->fd);
+        u->fd = fd;
+    }
+    u->committed = 1;
+    return 0;
+}
+
+/*
+ * Dernier bloc reçu : le fichier prend sa place sous son nom définitif. Le
+ * descripteur reste ouvert (en dédup, c'est celui du contenu final).
+ */
+static inline int upload_commit(upload_t *u) {
+    if (u->failed) {
+        errno = EIO;
+        return -1;
+    }
+    if (upload_dedup && !u->diverged && u->prev_fd >= 0) {
+        struct stat st;
+        if (fstat(u->prev_fd, &st) == 0 && st.st_size == u->received) {
+            // Identique à la version actuelle : rien à écrire ni à renommer
+            close(u->fd);
+            u->fd = u->prev_fd;
+            u->prev_fd = -1;
+            if (u->tmp_path[0]) {
+                unlink(u->tmp_path);
+                u->tmp_path[0] = '\0';
+            }
+            u->unchanged = u->committed = 1;
+            return 0;
+        }
+    }
+    if (!u->diverged && upload_diverge(u) < 0)     // Version actuelle plus longue : recopie du préfixe
+        return -1;
+    if (upload_flush(u) < 0)
+        return -1;
+    // Libère ce qui a été réservé au-delà de la taille réelle
+    off_t size = lseek(u->fd, 0, SEEK_END);
+    if (size >= 0)
+        ftruncate(u->fd, size);
+    if (upload_dedup)
+        return upload_commit_dedup(u);
+    if (u->tmp_path[0]) {
+        if (rename(u->tmp_path, u->path) < 0)
+            return -1;
+        u->tmp_path[0] = '\0';
+        u->committed = 1;
+        return 0;
+    }
+    char proc[64];
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", u->fd);
+    if (upload_place(proc, u->path) < 0)
+        return -1;
+    u->committed = 1;
+    return 0;
+}
+
+// Transfert abandonné : rien n'apparaît (à appeler avant de fermer le descripteur)
+static inline void upload_discard(upload_t *u) {
+    if (!u->committed && u->tmp_path[0]) {
+        unlink(u->tmp_path);
+        u->tmp_path[0] = '\0';
+    }
+}
+
+// Fin de session, mise en place ou non : libère tout
+static inline void upload_close(upload_t *u) {
+    upload_discard(u);
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->prev_fd >= 0)
+        close(u->prev_fd);
+    free(u->buf);
+    u->fd = u->prev_fd = -1;
+    u->buf = NULL;
+}
+
+#endif
@@ -0,0 +1,594 @@
+#ifndef TFTP_XDP_H
+#define TFTP_XDP_H
+
+/*
+ * Chemin de données AF_XDP pour les transferts RRQ (DATA sortants, ACK entrants).
+ *
+ * Un petit programme XDP, attaché en mode générique (SKB) pour fonctionner sur
+ * n'importe quelle interface, veth comprises, redirige vers une socket AF_XDP
+ * les datagrammes UDP/IPv4 adressés à l'interface dont le port destination est
+ * attribué à une session : la plage [XDP_PORT_BASE, XDP_PORT_BASE + XDP_PORT_COUNT)
+ * est doublée d'une table noyau des ports actifs, mise à jour à l'ouverture et à
+ * la fermeture des sessions, et le reste du trafic (autres adresses, ports libres)
+ * suit la pile réseau. Chaque session RRQ reçoit un port de cette plage comme
+ * TID : ses trames DATA sont construites directement dans l'UMEM (Ethernet +
+ * IPv4 + UDP) et ses ACK y sont lus sur place, sans passer par la pile réseau.
+ * Les requêtes RRQ/WRQ restent sur les sockets.
+ *
+ * Limites : clients sur le même segment uniquement (l'adresse MAC est prise
+ * dans la table ARP du noyau, puis gardée en cache XDP_ARP_TTL secondes), pas
+ * d'options IP ni de fragments. Sans entrée ARP, la session utilise une socket
+ * classique (et la résolution qu'elle déclenche profite aux transferts suivants).
+ * Seule la file liée à la socket est dans XSKMAP : les interfaces à plusieurs
+ * files de réception sont refusées, les ACK répartis sur une autre file seraient
+ * perdus.
+ *
+ * Pas de dépendance à libbpf : le programme est assemblé ici et chargé par
+ * l'appel système bpf(), l'attachement utilise un lien BPF (noyau >= 5.9), qui
+ * est détaché automatiquement à la fin du processus.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <linux/if_ether.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define XDP_NUM_FRAMES 4096         // Moitié pour la réception (fill ring), moitié pour l'envoi
+#define XDP_FRAME_SIZE 2048
+#define XDP_RING_SIZE 2048
+#define XDP_RX_BATCH 64
+#ifndef XDP_PORT_BASE
+#define XDP_PORT_BASE 20000         // Plage des TID servis par AF_XDP, hors ports éphémères
+#endif
+#ifndef XDP_PORT_COUNT
+#define XDP_PORT_COUNT 1024
+#endif
+
+#define XDP_HDR_LEN (14 + 20 + 8)   // Ethernet + IPv4 sans options + UDP
+#define XDP_ARP_CACHE 64            // Entrées du cache d'adresses MAC
+#define XDP_ARP_TTL 60              // Durée de validité d'une entrée (s)
+
+// Anneau partagé avec le noyau (producteur/consommateur)
+typedef struct {
+    uint32_t *producer, *consumer;
+    void *desc;
+    uint32_t size;
+    void *map;
+    size_t map_len;
+} xdp_ring_t;
+
+// Adresse MAC d'un client, relue dans /proc/net/arp après expiration
+typedef struct {
+    struct in_addr ip;
+    unsigned char mac[ETH_ALEN];
+    time_t expires;
+} xdp_neigh_t;
+
+typedef struct {
+    int fd;                         // Socket AF_XDP, -1 si le moteur est désactivé
+    int map_fd, ports_fd, prog_fd, link_fd;
+    char ifname[IF_NAMESIZE];
+    int ifindex;
+    unsigned queue;
+    unsigned char *umem;
+    xdp_ring_t fill, comp, rx, tx;
+    uint64_t free_frames[XDP_NUM_FRAMES / 2];   // Trames libres pour l'envoi
+    int nfree;
+    unsigned char mac[ETH_ALEN];
+    struct in_addr ip;
+    uint16_t ip_id;
+    unsigned char ports[XDP_PORT_COUNT];        // 1 = port attribué à une session (copie de ports_fd)
+    xdp_neigh_t neigh[XDP_ARP_CACHE];           // Cache ARP, indexé par l'adresse IPv4
+    unsigned next_port;
+    unsigned long long tx_packets, rx_packets, tx_busy;
+} xdp_engine_t;
+
+#define XDP_ENGINE_INITIALIZER { .fd = -1, .map_fd = -1, .ports_fd = -1, .prog_fd = -1, .link_fd = -1 }
+
+// Paquet UDP reçu pour un port de la plage (payload pointe dans l'UMEM)
+typedef void (*xdp_handler_t)(void *ctx, const struct sockaddr_in *from, uint16_t port,
+                              const unsigned char *payload, int len);
+
+static inline int xdp_bpf(int cmd, union bpf_attr *attr) {
+    return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+#define XDP_INSN(c, d, s, o, i) \
+    ((struct bpf_insn){ .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+
+/*
+ * Programme XDP :
+ *   si Ethernet/IPv4 (IHL 5, non fragmenté)/UDP, adresse dst = celle de
+ *   l'interface, lo <= port dst <= hi et ports[port dst - lo] != 0
+ *       retourne bpf_redirect_map(xsks, rx_queue_index, XDP_PASS)
+ *   sinon XDP_PASS
+ * Les ports de la plage sans session active restent à la pile réseau.
+ */
+static inline int xdp_load_program(int map_fd, int ports_fd, struct in_addr ip, uint16_t lo, uint16_t hi) {
+    enum { PASS = 37 };
+#define XDP_TO_PASS(pc) (PASS - (pc) - 1)
+    struct bpf_insn prog[] = {
+        /*  0 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 6, 1, 0, 0),
+        /*  1 */ XDP_INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 1, offsetof(struct xdp_md, data), 0),
+        /*  2 */ XDP_INSN(BPF_LDX | BPF_W | BPF_MEM, 3, 1, offsetof(struct xdp_md, data_end), 0),
+        /*  3 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 4, 2, 0, 0),
+        /*  4 */ XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 4, 0, 0, XDP_HDR_LEN),
+        /*  5 */ XDP_INSN(BPF_JMP | BPF_JGT | BPF_X, 4, 3, XDP_TO_PASS(5), 0),
+        /*  6 */ XDP_INSN(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 12, 0),
+        /*  7 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XDP_TO_PASS(7), htons(ETH_P_IP)),
+        /*  8 */ XDP_INSN(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 14, 0),
+        /*  9 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XDP_TO_PASS(9), 0x45),
+        /* 10 */ XDP_INSN(BPF_LDX | BPF_B | BPF_MEM, 5, 2, 23, 0),
+        /* 11 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XDP_TO_PASS(11), IPPROTO_UDP),
+        /* 12 */ XDP_INSN(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 20, 0),
+        /* 13 */ XDP_INSN(BPF_ALU64 | BPF_AND | BPF_K, 5, 0, 0, htons(0x3FFF)),
+        /* 14 */ XDP_INSN(BPF_JMP | BPF_JNE | BPF_K, 5, 0, XDP_TO_PASS(14), 0),
+        // Adresse destination comparée sur 32 bits (JMP32 : pas d'extension de signe)
+        /* 15 */ XDP_INSN(BPF_LDX | BPF_W | BPF_MEM, 5, 2, 30, 0),
+        /* 16 */ XDP_INSN(BPF_JMP32 | BPF_JNE | BPF_K, 5, 0, XDP_TO_PASS(16), (int32_t)ip.s_addr),
+        /* 17 */ XDP_INSN(BPF_LDX | BPF_H | BPF_MEM, 5, 2, 36, 0),
+        /* 18 */ XDP_INSN(BPF_ALU | BPF_END | BPF_TO_BE, 5, 0, 0, 16),
+        /* 19 */ XDP_INSN(BPF_JMP | BPF_JLT | BPF_K, 5, 0, XDP_TO_PASS(19), lo),
+        /* 20 */ XDP_INSN(BPF_JMP | BPF_JGT | BPF_K, 5, 0, XDP_TO_PASS(20), hi),
+        // Port attribué à une session ? (clé port - lo sur la pile)
+        /* 21 */ XDP_INSN(BPF_ALU64 | BPF_SUB | BPF_K, 5, 0, 0, lo),
+        /* 22 */ XDP_INSN(BPF_STX | BPF_W | BPF_MEM, 10, 5, -4, 0),
+        /* 23 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_X, 2, 10, 0, 0),
+        /* 24 */ XDP_INSN(BPF_ALU64 | BPF_ADD | BPF_K, 2, 0, 0, -4),
+        /* 25 */ XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, ports_fd),
+        /* 26 */ XDP_INSN(0, 0, 0, 0, 0),
+        /* 27 */ XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem),
+        /* 28 */ XDP_INSN(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, XDP_TO_PASS(28), 0),
+        /* 29 */ XDP_INSN(BPF_LDX | BPF_W | BPF_MEM, 1, 0, 0, 0),
+        /* 30 */ XDP_INSN(BPF_JMP | BPF_JEQ | BPF_K, 1, 0, XDP_TO_PASS(30), 0),
+        /* 31 */ XDP_INSN(BPF_LDX | BPF_W | BPF_MEM, 2, 6, offsetof(struct xdp_md, rx_queue_index), 0),
+        /* 32 */ XDP_INSN(BPF_LD | BPF_DW | BPF_IMM, 1, BPF_PSEUDO_MAP_FD, 0, map_fd),
+        /* 33 */ XDP_INSN(0, 0, 0, 0, 0),
+        /* 34 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 3, 0, 0, XDP_PASS),
+        /* 35 */ XDP_INSN(BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect_map),
+        /* 36 */ XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+        /* 37 */ XDP_INSN(BPF_ALU64 | BPF_MOV | BPF_K, 0, 0, 0, XDP_PASS),
+        /* 38 */ XDP_INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+#undef XDP_TO_PASS
+    static char log[4096];
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uint64_t)(uintptr_t)prog;
+    attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+    attr.license = (uint64_t)(uintptr_t)"GPL";
+    attr.log_buf = (uint64_t)(uintptr_t)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    int fd = xdp_bpf(BPF_PROG_LOAD, &attr);
+    if (fd < 0 && log[0])
+        fprintf(stderr, "Vérificateur BPF :\n%s\n", log);
+    return fd;
+}
+
+static inline int xdp_map_ring(int fd, const struct xdp_ring_offset *off, off_t pgoff,
+                               uint32_t size, size_t entry, xdp_ring_t *ring) {
+    ring->map_len = off->desc + size * entry;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+    ring->producer = (uint32_t *)((char *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((char *)ring->map + off->consumer);
+    ring->desc = (char *)ring->map + off->desc;
+    ring->size = size;
+    return 0;
+}
+
+// Place libre côté producteur (fill, tx)
+static inline uint32_t xdp_ring_free(xdp_ring_t *r) {
+    return r->size - (*r->producer - __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE));
+}
+
+// Entrées disponibles côté consommateur (rx, comp)
+static inline uint32_t xdp_ring_avail(xdp_ring_t *r) {
+    return __atomic_load_n(r->producer, __ATOMIC_ACQUIRE) - *r->consumer;
+}
+
+static inline void xdp_fill(xdp_engine_t *x, uint64_t addr) {
+    uint32_t prod = *x->fill.producer;
+    ((uint64_t *)x->fill.desc)[prod & (x->fill.size - 1)] = addr;
+    __atomic_store_n(x->fill.producer, prod + 1, __ATOMIC_RELEASE);
+}
+
+static inline void xdp_close(xdp_engine_t *x) {
+    xdp_ring_t *rings[] = { &x->fill, &x->comp, &x->rx, &x->tx };
+    for (int i = 0; i < 4; i++)
+        if (rings[i]->map)
+            munmap(rings[i]->map, rings[i]->map_len);
+    if (x->link_fd >= 0)
+        close(x->link_fd);
+    if (x->prog_fd >= 0)
+        close(x->prog_fd);
+    if (x->map_fd >= 0)
+        close(x->map_fd);
+    if (x->ports_fd >= 0)
+        close(x->ports_fd);
+    if (x->fd >= 0)
+        close(x->fd);
+    if (x->umem)
+        munmap(x->umem, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE);
+    xdp_engine_t reset = XDP_ENGINE_INITIALIZER;
+    *x = reset;
+}
+
+// Nombre de files de réception actives de l'interface, -1 si inconnu
+static inline int xdp_rx_queues(const char *ifname) {
+    char path[64 + IF_NAMESIZE];
+    snprintf(path, sizeof(path), "/sys/class/net/%s/queues", ifname);
+    DIR *d = opendir(path);
+    if (!d)
+        return -1;
+    int n = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL)
+        if (strncmp(e->d_name, "rx-", 3) == 0)
+            n++;
+    closedir(d);
+    return n;
+}
+
+static inline int xdp_fail(xdp_engine_t *x, const char *what) {
+    fprintf(stderr, "AF_XDP : %s : %s\n", what, strerror(errno));
+    xdp_close(x);
+    return -1;
+}
+
+/*
+ * Ouvre le moteur sur la file `queue` de l'interface : UMEM, anneaux, socket
+ * AF_XDP en mode copie, programme XDP attaché en mode générique.
+ * Retourne 0, ou -1 (message sur stderr) si le moteur n'a pas pu démarrer.
+ */
+static inline int xdp_open(xdp_engine_t *x, const char *ifname, unsigned queue) {
+    xdp_engine_t reset = XDP_ENGINE_INITIALIZER;
+    *x = reset;
+    snprintf(x->ifname, sizeof(x->ifname), "%s", ifname);
+    x->queue = queue;
+    x->ifindex = if_nametoindex(ifname);
+    if (!x->ifindex)
+        return xdp_fail(x, ifname);
+    int nrx = xdp_rx_queues(ifname);
+    if (nrx > 1) {
+        fprintf(stderr, "AF_XDP : %s a %d files de réception, une seule est prise en charge "
+                        "(ethtool -L %s combined 1)\n", ifname, nrx, ifname);
+        xdp_close(x);
+        return -1;
+    }
+
+    // Adresses de l'interface : source des trames construites
+    struct ifreq ifr;
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0 || ioctl(s, SIOCGIFHWADDR, &ifr) < 0) {
+        if (s >= 0)
+            close(s);
+        return xdp_fail(x, "adresse MAC");
+    }
+    memcpy(x->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+    if (ioctl(s, SIOCGIFADDR, &ifr) < 0) {
+        close(s);
+        return xdp_fail(x, "adresse IPv4");
+    }
+    x->ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr;
+    close(s);
+
+    x->umem = mmap(NULL, (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (x->umem == MAP_FAILED) {
+        x->umem = NULL;
+        return xdp_fail(x, "UMEM");
+    }
+    x->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (x->fd < 0)
+        return xdp_fail(x, "socket");
+    struct xdp_umem_reg reg = {
+        .addr = (uint64_t)(uintptr_t)x->umem,
+        .len = (uint64_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE,
+        .chunk_size = XDP_FRAME_SIZE,
+        .headroom = 0,
+    };
+    int ring_size = XDP_RING_SIZE;
+    if (setsockopt(x->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(x->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) < 0)
+        return xdp_fail(x, "configuration des anneaux");
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(x->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0 ||
+        xdp_map_ring(x->fd, &off.fr, XDP_UMEM_PGOFF_FILL_RING, XDP_RING_SIZE, sizeof(uint64_t), &x->fill) < 0 ||
+        xdp_map_ring(x->fd, &off.cr, XDP_UMEM_PGOFF_COMPLETION_RING, XDP_RING_SIZE, sizeof(uint64_t), &x->comp) < 0 ||
+        xdp_map_ring(x->fd, &off.rx, XDP_PGOFF_RX_RING, XDP_RING_SIZE, sizeof(struct xdp_desc), &x->rx) < 0 ||
+        xdp_map_ring(x->fd, &off.tx, XDP_PGOFF_TX_RING, XDP_RING_SIZE, sizeof(struct xdp_desc), &x->tx) < 0)
+        return xdp_fail(x, "projection des anneaux");
+
+    // Première moitié de l'UMEM pour la réception, seconde moitié pour l'envoi
+    for (int i = 0; i < XDP_NUM_FRAMES / 2; i++)
+        xdp_fill(x, (uint64_t)i * XDP_FRAME_SIZE);
+    for (int i = 0; i < XDP_NUM_FRAMES / 2; i++)
+        x->free_frames[i] = (uint64_t)(XDP_NUM_FRAMES / 2 + i) * XDP_FRAME_SIZE;
+    x->nfree = XDP_NUM_FRAMES / 2;
+
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_flags = XDP_COPY,
+        .sxdp_ifindex = x->ifindex,
+        .sxdp_queue_id = queue,
+    };
+    if (bind(x->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+        return xdp_fail(x, "bind");
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_XSKMAP;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = 64;
+    x->map_fd = xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (x->map_fd < 0)
+        return xdp_fail(x, "création de la table XSKMAP");
+    uint32_t key = queue, value = x->fd;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = x->map_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&value;
+    if (xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr) < 0)
+        return xdp_fail(x, "enregistrement de la socket dans XSKMAP");
+
+    // Ports actifs : 1 pour un port attribué, seuls ceux-là sont redirigés
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(uint32_t);
+    attr.max_entries = XDP_PORT_COUNT;
+    x->ports_fd = xdp_bpf(BPF_MAP_CREATE, &attr);
+    if (x->ports_fd < 0)
+        return xdp_fail(x, "création de la table des ports");
+
+    x->prog_fd = xdp_load_program(x->map_fd, x->ports_fd, x->ip,
+                                  XDP_PORT_BASE, XDP_PORT_BASE + XDP_PORT_COUNT - 1);
+    if (x->prog_fd < 0)
+        return xdp_fail(x, "chargement du programme XDP");
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = x->prog_fd;
+    attr.link_create.target_ifindex = x->ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = XDP_FLAGS_SKB_MODE;
+    x->link_fd = xdp_bpf(BPF_LINK_CREATE, &attr);
+    if (x->link_fd < 0)
+        return xdp_fail(x, "attachement du programme XDP");
+    return 0;
+}
+
+// Adresse MAC d'un voisin de l'interface d'après la table ARP, -1 si inconnue
+static inline int xdp_arp_read(xdp_engine_t *x, struct in_addr ip, unsigned char mac[ETH_ALEN]) {
+    FILE *f = fopen("/proc/net/arp", "r");
+    if (!f)
+        return -1;
+    char line[256], addr[64], hw[32], dev[IF_NAMESIZE + 1];
+    unsigned type, flags;
+    int found = -1;
+    while (found < 0 && fgets(line, sizeof(line), f)) {
+        struct in_addr a;
+        if (sscanf(line, "%63s %x %x %31s %*s %16s", addr, &type, &flags, hw, dev) != 5 ||
+            inet_pton(AF_INET, addr, &a) != 1 || a.s_addr != ip.s_addr ||
+            !(flags & 0x2) || strcmp(dev, x->ifname) != 0)     // 0x2 : ATF_COM, entrée résolue
+            continue;
+        unsigned m[ETH_ALEN];
+        if (sscanf(hw, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) == ETH_ALEN) {
+            for (int i = 0; i < ETH_ALEN; i++)
+                mac[i] = m[i];
+            found = 0;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Comme xdp_arp_read, par le cache : la table n'est relue qu'en cas d'absence ou d'expiration
+static inline int xdp_arp_lookup(xdp_engine_t *x, struct in_addr ip, unsigned char mac[ETH_ALEN]) {
+    xdp_neigh_t *n = &x->neigh[ntohl(ip.s_addr) % XDP_ARP_CACHE];
+    time_t now = time(NULL);
+    if (n->ip.s_addr == ip.s_addr && n->expires > now) {
+        memcpy(mac, n->mac, ETH_ALEN);
+        return 0;
+    }
+    if (xdp_arp_read(x, ip, mac) < 0)
+        return -1;
+    n->ip = ip;
+    memcpy(n->mac, mac, ETH_ALEN);
+    n->expires = now + XDP_ARP_TTL;
+    return 0;
+}
+
+// Marque un port (indice dans la plage) actif ou libre dans la table du programme XDP
+static inline int xdp_port_set(xdp_engine_t *x, unsigned p, uint32_t on) {
+    uint32_t key = p;
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = x->ports_fd;
+    attr.key = (uint64_t)(uintptr_t)&key;
+    attr.value = (uint64_t)(uintptr_t)&on;
+    return xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+}
+
+/*
+ * Réserve un port de la plage pour une session vers `ip` et récupère l'adresse
+ * MAC du client. Retourne le port, ou 0 si la session doit rester sur socket.
+ */
+static inline uint16_t xdp_port_open(xdp_engine_t *x, struct in_addr ip, unsigned char mac[ETH_ALEN]) {
+    if (x->fd < 0 || xdp_arp_lookup(x, ip, mac) < 0)
+        return 0;
+    for (unsigned i = 0; i < XDP_PORT_COUNT; i++) {
+        unsigned p = (x->next_port + i) % XDP_PORT_COUNT;
+        if (!x->ports[p]) {
+            if (xdp_port_set(x, p, 1) < 0) {
+                perror("AF_XDP : table des ports");
+                return 0;
+            }
+            x->ports[p] = 1;
+            x->next_port = p + 1;
+            return XDP_PORT_BASE + p;
+        }
+    }
+    return 0;
+}
+
+static inline void xdp_port_close(xdp_engine_t *x, uint16_t port) {
+    if (port >= XDP_PORT_BASE && port < XDP_PORT_BASE + XDP_PORT_COUNT) {
+        x->ports[port - XDP_PORT_BASE] = 0;
+        xdp_port_set(x, port - XDP_PORT_BASE, 0);
+    }
+}
+
+static inline uint32_t xdp_csum_add(uint32_t sum, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (; len > 1; p += 2, len -= 2)
+        sum += (p[0] << 8) | p[1];
+    if (len)
+        sum += p[0] << 8;
+    return sum;
+}
+
+static inline uint16_t xdp_csum_fold(uint32_t sum) {
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return htons(~sum & 0xFFFF);
+}
+
+// Récupère les trames dont l'envoi est terminé
+static inline void xdp_reclaim(xdp_engine_t *x) {
+    uint32_t n = xdp_ring_avail(&x->comp), cons = *x->comp.consumer;
+    for (uint32_t i = 0; i < n; i++)
+        x->free_frames[x->nfree++] = ((uint64_t *)x->comp.desc)[(cons + i) & (x->comp.size - 1)];
+    __atomic_store_n(x->comp.consumer, cons + n, __ATOMIC_RELEASE);
+}
+
+/*
+ * Construit dans l'UMEM une trame UDP de `sport` vers `dst` contenant payload
+ * et la confie au noyau. Retourne -1 si aucune trame n'est libre (réessayer plus tard).
+ */
+static inline int xdp_send(xdp_engine_t *x, const unsigned char dst_mac[ETH_ALEN], const struct sockaddr_in *dst,
+                           uint16_t sport, const void *payload, size_t len) {
+    if (x->nfree == 0)
+        xdp_reclaim(x);
+    if (x->nfree == 0 || xdp_ring_free(&x->tx) == 0 || len > XDP_FRAME_SIZE - XDP_HDR_LEN) {
+        x->tx_busy++;
+        sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        return -1;
+    }
+    uint64_t addr = x->free_frames[--x->nfree];
+    unsigned char *f = x->umem + addr;
+
+    memcpy(f, dst_mac, ETH_ALEN);
+    memcpy(f + 6, x->mac, ETH_ALEN);
+    f[12] = ETH_P_IP >> 8;
+    f[13] = ETH_P_IP & 0xFF;
+
+    unsigned char *ip = f + 14;
+    uint16_t ip_len = 20 + 8 + len;
+    ip[0] = 0x45;
+    ip[1] = 0;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len & 0xFF;
+    ip[4] = x->ip_id >> 8;
+    ip[5] = x->ip_id & 0xFF;
+    x->ip_id++;
+    ip[6] = 0x40;                   // DF
+    ip[7] = 0;
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    ip[10] = ip[11] = 0;
+    memcpy(ip + 12, &x->ip, 4);
+    memcpy(ip + 16, &dst->sin_addr, 4);
+    uint16_t csum = xdp_csum_fold(xdp_csum_add(0, ip, 20));
+    memcpy(ip + 10, &csum, 2);
+
+    unsigned char *udp = ip + 20;
+    uint16_t udp_len = 8 + len, port = htons(sport);
+    memcpy(udp, &port, 2);
+    memcpy(udp + 2, &dst->sin_port, 2);
+    udp[4] = udp_len >> 8;
+    udp[5] = udp_len & 0xFF;
+    udp[6] = udp[7] = 0;
+    memcpy(udp + 8, payload, len);
+    // Pseudo-en-tête : adresses, protocole, longueur
+    uint32_t sum = xdp_csum_add(0, ip + 12, 8) + IPPROTO_UDP + udp_len;
+    csum = xdp_csum_fold(xdp_csum_add(sum, udp, udp_len));
+    if (csum == 0)
+        csum = 0xFFFF;
+    memcpy(udp + 6, &csum, 2);
+
+    uint32_t prod = *x->tx.producer;
+    struct xdp_desc *d = &((struct xdp_desc *)x->tx.desc)[prod & (x->tx.size - 1)];
+    d->addr = addr;
+    d->len = XDP_HDR_LEN + len;
+    d->options = 0;
+    __atomic_store_n(x->tx.producer, prod + 1, __ATOMIC_RELEASE);
+    // En mode copie, l'envoi n'a lieu qu'à la demande
+    sendto(x->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    x->tx_packets++;
+    return 0;
+}
+
+/*
+ * Traite les trames reçues : chaque datagramme valide est passé à handler
+ * (données lues en place dans l'UMEM), puis la trame est rendue au noyau.
+ * Retourne le nombre de trames traitées.
+ */
+static inline int xdp_poll(xdp_engine_t *x, xdp_handler_t handler, void *ctx) {
+    uint32_t n = xdp_ring_avail(&x->rx), cons = *x->rx.consumer;
+    if (n > XDP_RX_BATCH)
+        n = XDP_RX_BATCH;
+    for (uint32_t i = 0; i < n; i++) {
+        const struct xdp_desc *d = &((struct xdp_desc *)x->rx.desc)[(cons + i) & (x->rx.size - 1)];
+        const unsigned char *f = x->umem + d->addr;
+        const unsigned char *ip = f + 14, *udp = ip + 20;
+        if (d->len >= XDP_HDR_LEN) {
+            int ip_len = (ip[2] << 8) | ip[3], udp_len = (udp[4] << 8) | udp[5];
+            if (udp_len >= 8 && 20 + udp_len <= ip_len && 14 + ip_len <= (int)d->len) {
+                struct sockaddr_in from = { .sin_family = AF_INET };
+                memcpy(&from.sin_addr, ip + 12, 4);
+                memcpy(&from.sin_port, udp, 2);
+                handler(ctx, &from, (udp[2] << 8) | udp[3], udp + 8, udp_len - 8);
+                x->rx_packets++;
+            }
+        }
+        xdp_fill(x, d->addr - d->addr % XDP_FRAME_SIZE);
+    }
+    __atomic_store_n(x->rx.consumer, cons + n, __ATOMIC_RELEASE);
+    return n;
+}
+
+#endif